@@ -0,0 +1,193 @@
+//
+// Created by 翔 on 25-11-30.
+//
+// 线程池任务提交开销测试：吞吐量（任务/秒）与单次提交延迟（p50/p99）
+// 用法: task_bench [任务数，默认200000] [工作线程数，默认4] [提交线程数，默认4]
+
+#include "thread_pool.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <queue>
+#include <stdexcept>
+
+// 旧实现：全局互斥锁 + std::queue<std::function>，每个任务分配shared_ptr<packaged_task>并经过std::bind
+class LegacyThreadPool {
+public:
+    explicit LegacyThreadPool(size_t threads) {
+        for (size_t i = 0; i < threads; ++i) {
+            workers.emplace_back([this] {
+                for (;;) {
+                    std::function<void()> task;
+                    {
+                        std::unique_lock<std::mutex> lock(queue_mutex);
+                        condition.wait(lock, [this] { return stop || !tasks.empty(); });
+                        if (stop && tasks.empty())
+                            return;
+                        task = std::move(tasks.front());
+                        tasks.pop();
+                    }
+                    task();
+                }
+            });
+        }
+    }
+    ~LegacyThreadPool() {
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex);
+            stop = true;
+        }
+        condition.notify_all();
+        for (std::thread& worker : workers)
+            worker.join();
+    }
+
+    template<class F, class... Args>
+    auto enqueue(F&& f, Args&&... args) -> std::future<typename std::invoke_result_t<F, Args...>> {
+        using return_type = typename std::invoke_result_t<F, Args...>;
+        auto task = std::make_shared<std::packaged_task<return_type()>>(
+            std::bind(std::forward<F>(f), std::forward<Args>(args)...)
+        );
+        std::future<return_type> res = task->get_future();
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex);
+            if (stop)
+                throw std::runtime_error("enqueue on stopped ThreadPool");
+            tasks.emplace([task]() { (*task)(); });
+        }
+        condition.notify_one();
+        return res;
+    }
+
+private:
+    std::vector<std::thread> workers;
+    std::queue<std::function<void()>> tasks;
+    std::mutex queue_mutex;
+    std::condition_variable condition;
+    bool stop = false;
+};
+
+using Clock = std::chrono::steady_clock;
+
+// 统计结果：latencies为每个任务的提交耗时（纳秒）
+static void Report(const char* name, size_t count, Clock::duration elapsed, std::vector<uint64_t>& latencies) {
+    double seconds = std::chrono::duration<double>(elapsed).count();
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&](double p) {
+        return latencies.empty() ? 0 : latencies[std::min(latencies.size() - 1, static_cast<size_t>(p * latencies.size()))];
+    };
+    std::cout << std::left << std::setw(40) << name
+              << std::right << std::fixed << std::setprecision(2) << std::setw(10) << count / seconds / 1e6 << " M tasks/s"
+              << std::setw(10) << percentile(0.50) << " ns p50"
+              << std::setw(10) << percentile(0.99) << " ns p99" << std::endl;
+}
+
+// producers个线程共提交count个任务，submit(i)提交第i个任务；所有提交完成后调用wait等待任务执行完
+template<class Submit, class Wait>
+static void Measure(const char* name, size_t count, size_t producers, Submit&& submit, Wait&& wait) {
+    std::vector<std::vector<uint64_t>> perThread(producers);
+    auto start = Clock::now();
+    std::vector<std::thread> threads;
+    for (size_t p = 0; p < producers; ++p) {
+        threads.emplace_back([&, p] {
+            auto& latencies = perThread[p];
+            latencies.reserve(count / producers + 1);
+            for (size_t i = p; i < count; i += producers) {
+                auto t0 = Clock::now();
+                submit(i);
+                latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - t0).count());
+            }
+        });
+    }
+    for (auto& thread : threads) thread.join();
+    wait();
+    auto elapsed = Clock::now() - start;
+
+    std::vector<uint64_t> latencies;
+    for (auto& v : perThread) latencies.insert(latencies.end(), v.begin(), v.end());
+    Report(name, count, elapsed, latencies);
+}
+
+// 计数归零时唤醒等待方
+class Latch {
+public:
+    explicit Latch(size_t count) : remaining(count) {}
+    void CountDown() {
+        if (remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) done.set_value();
+    }
+    void Wait() { done.get_future().wait(); }
+
+private:
+    std::atomic<size_t> remaining;
+    std::promise<void> done;
+};
+
+int main(int argc, char* argv[]) {
+    size_t count = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 200000;
+    size_t threads = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 4;
+    size_t producers = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 4;
+    std::atomic<uint64_t> sink{0};
+    auto tiny = [&sink] { sink.fetch_add(1, std::memory_order_relaxed); };
+
+    std::cout << "[Bench] " << count << " tiny tasks, " << threads << " workers" << std::endl;
+
+    for (size_t submitters : {size_t(1), producers}) {
+        std::cout << "-- " << submitters << " submitting thread(s)" << std::endl;
+        {
+            LegacyThreadPool pool(threads);
+            std::vector<std::future<void>> futures(count);
+            Measure("legacy enqueue (future)", count, submitters,
+                    [&](size_t i) { futures[i] = pool.enqueue(tiny); },
+                    [&] { for (auto& f : futures) f.get(); });
+        }
+        {
+            ThreadPool pool(threads);
+            std::vector<std::future<void>> futures(count);
+            Measure("ThreadPool enqueue (future)", count, submitters,
+                    [&](size_t i) { futures[i] = pool.enqueue(tiny); },
+                    [&] { for (auto& f : futures) f.get(); });
+        }
+        {
+            LegacyThreadPool pool(threads);
+            Latch latch(count);
+            Measure("legacy enqueue (future discarded)", count, submitters,
+                    [&](size_t) { pool.enqueue([&] { tiny(); latch.CountDown(); }); },
+                    [&] { latch.Wait(); });
+        }
+        {
+            ThreadPool pool(threads);
+            Latch latch(count);
+            Measure("ThreadPool Post", count, submitters,
+                    [&](size_t) { pool.Post([&] { tiny(); latch.CountDown(); }); },
+                    [&] { latch.Wait(); });
+        }
+    }
+
+    // 批量提交：每批256个任务，延迟按批内平均计算
+    {
+        constexpr size_t kBatch = 256;
+        ThreadPool pool(threads);
+        Latch latch(count);
+        std::vector<uint64_t> latencies;
+        std::vector<Task> batch;
+        auto start = Clock::now();
+        for (size_t i = 0; i < count; i += kBatch) {
+            size_t n = std::min(kBatch, count - i);
+            auto t0 = Clock::now();
+            for (size_t k = 0; k < n; ++k) {
+                batch.emplace_back([&] { tiny(); latch.CountDown(); });
+            }
+            pool.PostBatch(batch);
+            uint64_t perTask = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - t0).count() / n;
+            latencies.insert(latencies.end(), n, perTask);
+        }
+        latch.Wait();
+        std::cout << "-- 1 submitting thread, batches of " << kBatch << std::endl;
+        Report("ThreadPool PostBatch", count, Clock::now() - start, latencies);
+    }
+
+    if (sink.load() == 0) return 1;
+    return 0;
+}
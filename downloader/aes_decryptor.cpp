@@ -0,0 +1,57 @@
+//
+// Created by 翔 on 25-11-24.
+//
+
+#include "aes_decryptor.h"
+#include <cstring>
+#include <algorithm>
+
+CbcDecryptor::CbcDecryptor() : ctx(EVP_CIPHER_CTX_new()) {}
+
+CbcDecryptor::~CbcDecryptor() {
+    EVP_CIPHER_CTX_free(ctx);
+}
+
+bool CbcDecryptor::Init(const std::vector<unsigned char>& key, const std::vector<unsigned char>& iv) {
+    partialLen = 0;
+    if (!ctx || key.size() != 16 || iv.size() != 16) return false;
+    if (EVP_DecryptInit_ex(ctx, EVP_aes_128_cbc(), nullptr, key.data(), iv.data()) != 1) return false;
+    // 只喂给EVP完整的块，填充由调用方处理
+    EVP_CIPHER_CTX_set_padding(ctx, 0);
+    return true;
+}
+
+bool CbcDecryptor::Update(const unsigned char* data, size_t len, std::vector<unsigned char>& out) {
+    // 先补齐上一次剩下的不完整块
+    if (partialLen > 0) {
+        size_t need = std::min(len, sizeof(partial) - partialLen);
+        memcpy(partial + partialLen, data, need);
+        partialLen += need;
+        data += need;
+        len -= need;
+        if (partialLen < sizeof(partial)) return true;
+
+        size_t offset = out.size();
+        out.resize(offset + sizeof(partial));
+        int outLen = 0;
+        if (EVP_DecryptUpdate(ctx, out.data() + offset, &outLen, partial, sizeof(partial)) != 1) return false;
+        partialLen = 0;
+    }
+
+    size_t blocks = len / 16 * 16;
+    if (blocks > 0) {
+        size_t offset = out.size();
+        out.resize(offset + blocks);
+        int outLen = 0;
+        if (EVP_DecryptUpdate(ctx, out.data() + offset, &outLen, data, static_cast<int>(blocks)) != 1) return false;
+    }
+
+    partialLen = len - blocks;
+    memcpy(partial, data + blocks, partialLen);
+    return true;
+}
+
+void CbcDecryptor::Finish(std::vector<unsigned char>& out) {
+    out.insert(out.end(), partial, partial + partialLen);
+    partialLen = 0;
+}
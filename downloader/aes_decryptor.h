@@ -0,0 +1,39 @@
+//
+// Created by 翔 on 25-11-24.
+//
+
+#ifndef AES_DECRYPTOR_H
+#define AES_DECRYPTOR_H
+
+#include <cstddef>
+#include <vector>
+#include <openssl/evp.h>
+
+// 批量解密时每次处理的数据量，大块输入才能发挥AES-NI多块并行的优势
+constexpr size_t kDecryptChunkSize = 256 * 1024;
+
+// AES-128-CBC 增量解密器
+// 数据可以分多次任意长度输入，不足16字节的尾部会缓存到下一次，CBC链式IV由EVP上下文保存，
+// 因此可以直接挂在curl写回调上边收边解密
+// TS 分片不做 PKCS7 去填充，结尾不足一个块的数据按原文输出（与DecryptTsFile行为一致）
+class CbcDecryptor {
+public:
+    CbcDecryptor();
+    ~CbcDecryptor();
+    CbcDecryptor(const CbcDecryptor&) = delete;
+    CbcDecryptor& operator=(const CbcDecryptor&) = delete;
+
+    // 开始解密新的分片，key 和 iv 均为16字节
+    bool Init(const std::vector<unsigned char>& key, const std::vector<unsigned char>& iv);
+    // 解密一段数据，追加到out末尾，返回false表示解密失败
+    bool Update(const unsigned char* data, size_t len, std::vector<unsigned char>& out);
+    // 结束当前分片，把缓存的不完整块按原文追加到out
+    void Finish(std::vector<unsigned char>& out);
+
+private:
+    EVP_CIPHER_CTX* ctx = nullptr;
+    unsigned char partial[16];   // 未凑满一个块的数据
+    size_t partialLen = 0;
+};
+
+#endif //AES_DECRYPTOR_H
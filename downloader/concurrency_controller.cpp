@@ -0,0 +1,57 @@
+//
+// Created by 翔 on 25-11-30.
+//
+
+#include "concurrency_controller.h"
+#include <algorithm>
+
+AimdController::AimdController(const AimdOptions& opts) : options(opts) {
+    options.min = std::max<size_t>(options.min, 1);
+    options.max = std::max(options.max, options.min);
+    window = std::clamp(options.initial, options.min, options.max);
+}
+
+bool AimdController::OnCongestion(std::chrono::steady_clock::time_point now) {
+    // 同一波失败通常来自窗口缩小之前发出的请求，一个采样周期内只缩小一次
+    if (lastDecrease != std::chrono::steady_clock::time_point() && now - lastDecrease < options.interval) {
+        return false;
+    }
+    lastDecrease = now;
+    slowStart = false;
+    const size_t old = window;
+    window = std::max(options.min, static_cast<size_t>(static_cast<double>(window) * options.decrease));
+    // 重新采样，缩小前的吞吐量不能作为比较基准
+    intervalStart = now;
+    intervalBytes = 0;
+    limited = false;
+    lastRate = 0;
+    return window != old;
+}
+
+bool AimdController::Tick(std::chrono::steady_clock::time_point now) {
+    if (intervalStart == std::chrono::steady_clock::time_point()) {
+        intervalStart = now;
+        return false;
+    }
+    const auto elapsed = now - intervalStart;
+    if (elapsed < options.interval) return false;
+
+    const double rate = static_cast<double>(intervalBytes) / std::chrono::duration<double>(elapsed).count();
+    const bool wasLimited = limited;
+    intervalStart = now;
+    intervalBytes = 0;
+    limited = false;
+    // 还在建立连接，没有可比较的数据
+    if (rate <= 0) return false;
+
+    const double previous = lastRate;
+    lastRate = rate;
+    if (!wasLimited || window >= options.max) return false;
+    // 缩小后的第一个周期只用来建立基准；之后吞吐量没有明显提升说明瓶颈不在并发数
+    if (previous <= 0 ? !slowStart : rate < previous * (1 + options.gain)) {
+        slowStart = false;
+        return false;
+    }
+    window = std::min(options.max, slowStart ? window * 2 : window + 1);
+    return true;
+}
@@ -0,0 +1,51 @@
+//
+// Created by 翔 on 25-11-30.
+//
+
+#ifndef CONCURRENCY_CONTROLLER_H
+#define CONCURRENCY_CONTROLLER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <chrono>
+
+// AIMD并发窗口配置
+struct AimdOptions {
+    size_t initial = 4;                     // 初始窗口
+    size_t min = 1;                         // 窗口下限
+    size_t max = 64;                        // 窗口上限
+    double decrease = 0.5;                  // 拥塞时窗口乘以该系数
+    double gain = 0.05;                     // 吞吐量至少提升该比例才继续增大窗口
+    std::chrono::milliseconds interval{1000}; // 吞吐量采样周期
+};
+
+// 自适应并发窗口（加性增、乘性减）
+// 窗口只在吞吐量随并发上升时增大：慢启动阶段每个周期翻倍，之后每个周期加1；
+// 遇到超时、429、5xx等拥塞信号时按比例缩小，每个采样周期最多缩小一次，避免同一波失败把窗口压到底。
+// 并发上限由服务端和网络的实际表现决定，而不是本机的核心数。非线程安全，由下载引擎的事件循环线程驱动
+class AimdController {
+public:
+    explicit AimdController(const AimdOptions& opts = AimdOptions());
+
+    size_t Window() const { return window; }
+    // 收到响应数据
+    void OnBytes(uint64_t bytes) { intervalBytes += bytes; }
+    // 有传输因为窗口已满而等待，只有窗口被用满时的吞吐量才能说明窗口是否够大
+    void OnLimited() { limited = true; }
+    // 拥塞信号，返回窗口是否变化
+    bool OnCongestion(std::chrono::steady_clock::time_point now);
+    // 周期性调用，采样周期结束时根据吞吐量调整窗口，返回窗口是否变化
+    bool Tick(std::chrono::steady_clock::time_point now);
+
+private:
+    AimdOptions options;
+    size_t window;
+    bool slowStart = true;
+    bool limited = false;
+    uint64_t intervalBytes = 0;
+    double lastRate = 0;                    // 上一个采样周期的吞吐量（字节/秒）
+    std::chrono::steady_clock::time_point intervalStart;
+    std::chrono::steady_clock::time_point lastDecrease;
+};
+
+#endif //CONCURRENCY_CONTROLLER_H
@@ -0,0 +1,78 @@
+//
+// Created by 翔 on 25-11-21.
+//
+
+#include "curl_pool.h"
+
+CurlHandlePool& CurlHandlePool::Instance() {
+    // 局部静态变量，C++11起保证线程安全的初始化
+    static CurlHandlePool pool;
+    return pool;
+}
+
+CurlHandlePool::CurlHandlePool() {
+    // curl_global_init非线程安全，整个进程只在这里调用一次
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+
+    share = curl_share_init();
+    curl_share_setopt(share, CURLSHOPT_LOCKFUNC, &CurlHandlePool::LockShare);
+    curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, &CurlHandlePool::UnlockShare);
+    curl_share_setopt(share, CURLSHOPT_USERDATA, this);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+}
+
+CurlHandlePool::~CurlHandlePool() {
+    {
+        std::lock_guard<std::mutex> lock(poolMutex);
+        for (CURL* curl : idle) {
+            curl_easy_cleanup(curl);
+        }
+        idle.clear();
+    }
+    curl_share_cleanup(share);
+    curl_global_cleanup();
+}
+
+CURL* CurlHandlePool::Acquire() {
+    CURL* curl = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(poolMutex);
+        if (!idle.empty()) {
+            curl = idle.back();
+            idle.pop_back();
+        }
+    }
+
+    if (!curl) {
+        curl = curl_easy_init();
+        if (!curl) return nullptr;
+    }
+    curl_easy_setopt(curl, CURLOPT_SHARE, share);
+    return curl;
+}
+
+void CurlHandlePool::Release(CURL* curl) {
+    if (!curl) return;
+    // reset只恢复选项，不会断开已建立的连接，也不会清空缓存
+    curl_easy_reset(curl);
+
+    std::unique_lock<std::mutex> lock(poolMutex);
+    if (idle.size() < kMaxIdleHandles) {
+        idle.push_back(curl);
+        return;
+    }
+    lock.unlock();
+    curl_easy_cleanup(curl);
+}
+
+void CurlHandlePool::LockShare(CURL*, curl_lock_data data, curl_lock_access, void* userptr) {
+    auto* pool = static_cast<CurlHandlePool*>(userptr);
+    pool->shareLocks[data].lock();
+}
+
+void CurlHandlePool::UnlockShare(CURL*, curl_lock_data data, void* userptr) {
+    auto* pool = static_cast<CurlHandlePool*>(userptr);
+    pool->shareLocks[data].unlock();
+}
@@ -0,0 +1,59 @@
+//
+// Created by 翔 on 25-11-21.
+//
+
+#ifndef CURL_POOL_H
+#define CURL_POOL_H
+
+#include <vector>
+#include <mutex>
+#include <curl/curl.h>
+
+// 进程级curl句柄池
+// 所有句柄绑定同一个CURLSH共享对象（DNS缓存、TLS会话、连接缓存），
+// 同一CDN上的请求可以复用已建立的连接，不必每个分片都重新做DNS解析、TCP握手和TLS握手
+class CurlHandlePool {
+public:
+    static CurlHandlePool& Instance();
+
+    // 借出一个句柄（已绑定共享对象），用完必须调用Release归还
+    CURL* Acquire();
+    // 归还句柄，重置选项后放回池中，已建立的连接会被保留
+    void Release(CURL* curl);
+
+    CurlHandlePool(const CurlHandlePool&) = delete;
+    CurlHandlePool& operator=(const CurlHandlePool&) = delete;
+
+private:
+    CurlHandlePool();
+    ~CurlHandlePool();
+
+    static void LockShare(CURL* handle, curl_lock_data data, curl_lock_access access, void* userptr);
+    static void UnlockShare(CURL* handle, curl_lock_data data, void* userptr);
+
+    static constexpr size_t kMaxIdleHandles = 256;  // 池中最多缓存的空闲句柄
+
+    CURLSH* share = nullptr;
+    std::mutex shareLocks[CURL_LOCK_DATA_LAST];     // 每类共享数据一把锁
+    std::mutex poolMutex;
+    std::vector<CURL*> idle;                        // 空闲句柄
+};
+
+// RAII方式借用句柄，离开作用域自动归还
+class PooledCurl {
+public:
+    PooledCurl() : curl(CurlHandlePool::Instance().Acquire()) {}
+    ~PooledCurl() {
+        if (curl) CurlHandlePool::Instance().Release(curl);
+    }
+    PooledCurl(const PooledCurl&) = delete;
+    PooledCurl& operator=(const PooledCurl&) = delete;
+
+    CURL* get() const { return curl; }
+    explicit operator bool() const { return curl != nullptr; }
+
+private:
+    CURL* curl;
+};
+
+#endif //CURL_POOL_H
@@ -0,0 +1,201 @@
+//
+// Created by 翔 on 25-11-30.
+//
+
+#include "executor.h"
+#include <algorithm>
+#include <iostream>
+
+// Post提交的任务抛出的异常在这里截住，不会终止整个程序；需要知道失败的调用方应使用Submit或者自己捕获
+static void RunTask(Task& task) {
+    try {
+        task();
+    } catch (const std::exception& e) {
+        std::cerr << "[Executor] Task failed: " << e.what() << std::endl;
+    } catch (...) {
+        std::cerr << "[Executor] Task failed with unknown exception" << std::endl;
+    }
+}
+
+// 当前线程所属的工作窃取执行器及队列序号，工作线程内提交的任务直接放入自己的队列
+static thread_local const WorkStealingExecutor* currentExecutor = nullptr;
+static thread_local size_t currentWorker = 0;
+
+WorkStealingExecutor::WorkStealingExecutor(size_t threads) {
+    threads = std::max<size_t>(threads, 1);
+    for (size_t i = 0; i < threads; ++i) {
+        workers.emplace_back(std::make_unique<Worker>());
+    }
+    // 所有队列创建完成后再启动线程，窃取时会访问其他线程的队列
+    for (size_t i = 0; i < threads; ++i) {
+        workers[i]->thread = std::thread(&WorkStealingExecutor::Run, this, i);
+    }
+}
+
+// 等待已提交的任务（包括执行过程中新提交的任务）全部完成
+WorkStealingExecutor::~WorkStealingExecutor() {
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        stop = true;
+        sleepCond.notify_all();
+    }
+    for (auto& worker : workers) {
+        worker->thread.join();
+    }
+}
+
+// 工作线程内提交时放入自己的队列；外部线程各自从不同的队列开始轮流放，不共用计数器
+size_t WorkStealingExecutor::PickQueue() {
+    if (currentExecutor == this) return currentWorker;
+    static thread_local size_t next = std::hash<std::thread::id>()(std::this_thread::get_id());
+    return next++ % workers.size();
+}
+
+// 提交方先增加任务数再读sleepers，休眠方先增加sleepers再检查任务数，
+// 两边都是顺序一致的原子操作，至少有一方能看到对方，因此没有线程休眠时可以跳过加锁和通知
+void WorkStealingExecutor::Wake(size_t count) {
+    if (sleepers.load(std::memory_order_seq_cst) == 0) return;
+    // 持锁通知，任务完成后执行器可能立即被析构
+    std::lock_guard<std::mutex> lock(sleepMutex);
+    if (count >= workers.size()) {
+        sleepCond.notify_all();
+    } else {
+        for (size_t i = 0; i < count; ++i) sleepCond.notify_one();
+    }
+}
+
+void WorkStealingExecutor::Post(Task task) {
+    Worker& worker = *workers[PickQueue()];
+    {
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        worker.tasks.push_back(std::move(task));
+    }
+    queued.fetch_add(1, std::memory_order_seq_cst);
+    Wake(1);
+}
+
+void WorkStealingExecutor::PostBatch(std::vector<Task>& tasks) {
+    const size_t count = tasks.size();
+    if (count == 0) return;
+    // 外部提交时平均分到各个队列，每个队列只加一次锁；工作线程内提交时全部放入自己的队列，由空闲线程窃取
+    const size_t shards = currentExecutor == this ? 1 : std::min(workers.size(), count);
+    const size_t first = PickQueue();
+    for (size_t shard = 0; shard < shards; ++shard) {
+        Worker& worker = *workers[(first + shard) % workers.size()];
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        for (size_t i = shard; i < count; i += shards) {
+            worker.tasks.push_back(std::move(tasks[i]));
+        }
+    }
+    tasks.clear();
+    queued.fetch_add(static_cast<int64_t>(count), std::memory_order_seq_cst);
+    Wake(count);
+}
+
+bool WorkStealingExecutor::TryPop(size_t index, Task& task) {
+    Worker& worker = *workers[index];
+    std::lock_guard<std::mutex> lock(worker.mutex);
+    if (worker.tasks.empty()) return false;
+    task = std::move(worker.tasks.back());
+    worker.tasks.pop_back();
+    return true;
+}
+
+bool WorkStealingExecutor::TrySteal(size_t index, Task& task) {
+    for (size_t i = 1; i < workers.size(); ++i) {
+        Worker& victim = *workers[(index + i) % workers.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (victim.tasks.empty()) continue;
+        // 从头部窃取最早提交的任务，与队列主人从尾部取互不干扰
+        task = std::move(victim.tasks.front());
+        victim.tasks.pop_front();
+        return true;
+    }
+    return false;
+}
+
+void WorkStealingExecutor::Run(size_t index) {
+    currentExecutor = this;
+    currentWorker = index;
+    Task task;
+    for (;;) {
+        if (TryPop(index, task) || TrySteal(index, task)) {
+            queued.fetch_sub(1, std::memory_order_relaxed);
+            RunTask(task);
+            task.Reset();
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(sleepMutex);
+        sleepers.fetch_add(1, std::memory_order_seq_cst);
+        sleepCond.wait(lock, [this] {
+            return stop || queued.load(std::memory_order_seq_cst) > 0;
+        });
+        sleepers.fetch_sub(1, std::memory_order_relaxed);
+        if (stop && queued.load(std::memory_order_acquire) <= 0)
+            return;
+    }
+}
+
+IoExecutor::IoExecutor(size_t threads) {
+    threads = std::max<size_t>(threads, 1);
+    for (size_t i = 0; i < threads; ++i) {
+        workers.emplace_back([this] {
+            for (;;) {
+                Task task;
+                {
+                    std::unique_lock<std::mutex> lock(queueMutex);
+                    condition.wait(lock, [this] { return stop || !tasks.empty(); });
+                    if (stop && tasks.empty())
+                        return;
+                    task = std::move(tasks.front());
+                    tasks.pop();
+                }
+                RunTask(task);
+            }
+        });
+    }
+}
+
+IoExecutor::~IoExecutor() {
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        stop = true;
+        condition.notify_all();
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+void IoExecutor::Post(Task task) {
+    // 持锁通知：任务可能在通知前就已执行完毕，等待结果的线程随后可能析构执行器
+    std::lock_guard<std::mutex> lock(queueMutex);
+    tasks.push(std::move(task));
+    condition.notify_one();
+}
+
+void IoExecutor::PostBatch(std::vector<Task>& batch) {
+    if (batch.empty()) return;
+    std::lock_guard<std::mutex> lock(queueMutex);
+    for (auto& task : batch) {
+        tasks.push(std::move(task));
+    }
+    if (batch.size() == 1) {
+        condition.notify_one();
+    } else {
+        condition.notify_all();
+    }
+    batch.clear();
+}
+
+WorkStealingExecutor& Executors::Cpu() {
+    static WorkStealingExecutor executor(std::thread::hardware_concurrency() >> 1);
+    return executor;
+}
+
+IoExecutor& Executors::Io() {
+    // 阻塞型任务的线程大部分时间在等待，按核心数的两倍分配，至少8个
+    static IoExecutor executor(std::max(8u, std::thread::hardware_concurrency() * 2));
+    return executor;
+}
@@ -0,0 +1,128 @@
+//
+// Created by 翔 on 25-11-30.
+//
+
+#ifndef EXECUTOR_H
+#define EXECUTOR_H
+
+#include <vector>
+#include <deque>
+#include <queue>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <functional>
+#include <memory>
+#include <atomic>
+#include <tuple>
+#include "task.h"
+
+// 任务执行器
+// 任务之间通过Post/Submit接力（例如cpu阶段完成后把写盘交给I/O执行器），
+// 不要在工作线程中阻塞等待另一个任务的future，否则会占住工作线程，线程全部占满时会死锁
+class Executor {
+public:
+    virtual ~Executor() = default;
+    // 提交任务，不关心结果；任务抛出的异常只会被记录，调用方等待的promise不会因此完成
+    virtual void Post(Task task) = 0;
+    // 批量提交，一次加锁放入多个任务；大量小任务（如上万个分片）时比逐个Post开销小得多
+    virtual void PostBatch(std::vector<Task>& tasks) {
+        for (auto& task : tasks) Post(std::move(task));
+        tasks.clear();
+    }
+    // 工作线程数
+    virtual size_t Size() const = 0;
+
+    // 提交任务，返回 future
+    // promise与参数直接存放在任务对象中，不再经过shared_ptr<packaged_task>、std::bind和std::function
+    template<class F, class... Args>
+    auto Submit(F&& f, Args&&... args) -> std::future<std::invoke_result_t<F, Args...>> {
+        using return_type = std::invoke_result_t<F, Args...>;
+        std::promise<return_type> promise;
+        std::future<return_type> res = promise.get_future();
+        Post([promise = std::move(promise), fn = std::forward<F>(f),
+              params = std::make_tuple(std::forward<Args>(args)...)]() mutable {
+            try {
+                if constexpr (std::is_void_v<return_type>) {
+                    std::apply(fn, std::move(params));
+                    promise.set_value();
+                } else {
+                    promise.set_value(std::apply(fn, std::move(params)));
+                }
+            } catch (...) {
+                promise.set_exception(std::current_exception());
+            }
+        });
+        return res;
+    }
+};
+
+// 工作窃取执行器，用于解密、哈希、转封装等cpu密集型任务
+// 每个工作线程有自己的双端队列：工作线程内提交的任务压入自己队列的尾部、也从尾部取（后进先出，数据还在缓存中），
+// 外部线程提交的任务按线程分散到各个队列；自己的队列为空时从其他队列的头部窃取。
+// 提交方只锁一个队列，有线程在休眠时才会去拿休眠锁，线程之间不争抢同一把锁，
+// 也不会出现一个线程排满任务而其他线程空闲
+class WorkStealingExecutor final : public Executor {
+public:
+    explicit WorkStealingExecutor(size_t threads);
+    ~WorkStealingExecutor() override;
+    WorkStealingExecutor(const WorkStealingExecutor&) = delete;
+    WorkStealingExecutor& operator=(const WorkStealingExecutor&) = delete;
+
+    void Post(Task task) override;
+    void PostBatch(std::vector<Task>& tasks) override;
+    size_t Size() const override { return workers.size(); }
+
+private:
+    // 按缓存行对齐，相邻队列的锁不会互相伪共享
+    struct alignas(64) Worker {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+        std::thread thread;
+    };
+    size_t PickQueue();
+    void Wake(size_t count);
+    void Run(size_t index);
+    bool TryPop(size_t index, Task& task);
+    bool TrySteal(size_t index, Task& task);
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::atomic<int64_t> queued{0};         // 所有队列中的任务数，空闲线程据此决定是否休眠
+    std::atomic<int> sleepers{0};           // 正在休眠的线程数
+    std::mutex sleepMutex;
+    std::condition_variable sleepCond;
+    bool stop = false;
+};
+
+// I/O执行器，用于阻塞的文件读写、网络请求、外部进程等任务
+// 任务大多在等待而不是计算，共享一个先进先出队列即可，线程数可以多于核心数
+class IoExecutor final : public Executor {
+public:
+    explicit IoExecutor(size_t threads);
+    ~IoExecutor() override;
+    IoExecutor(const IoExecutor&) = delete;
+    IoExecutor& operator=(const IoExecutor&) = delete;
+
+    void Post(Task task) override;
+    void PostBatch(std::vector<Task>& tasks) override;
+    size_t Size() const override { return workers.size(); }
+
+private:
+    std::vector<std::thread> workers;
+    std::queue<Task> tasks;
+    std::mutex queueMutex;
+    std::condition_variable condition;
+    bool stop = false;
+};
+
+// 进程级执行器，所有任务和阶段共用，不再为每个阶段单独创建线程池
+class Executors {
+public:
+    // cpu密集型任务，线程数不超过物理核心数（逻辑核心数的一半），至少一个
+    static WorkStealingExecutor& Cpu();
+    // 阻塞型任务
+    static IoExecutor& Io();
+};
+
+#endif //EXECUTOR_H
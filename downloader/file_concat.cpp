@@ -0,0 +1,156 @@
+//
+// Created by 翔 on 25-11-27.
+//
+
+#include "file_concat.h"
+#include <iostream>
+#include <atomic>
+#include <algorithm>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+// 每批同时打开的输入文件数，批量open/fstat后再依次拷贝，减少系统调用交替
+static constexpr size_t kOpenBatch = 64;
+// 用户态回退时的缓冲区大小
+static constexpr size_t kCopyBufferSize = 1024 * 1024;
+
+// 回退方案：用户态大块读写
+static bool CopyByReadWrite(int in, int out, size_t size) {
+    static thread_local std::vector<char> buf(kCopyBufferSize);
+    while (size > 0) {
+        ssize_t n = read(in, buf.data(), std::min(size, buf.size()));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        for (ssize_t written = 0; written < n;) {
+            ssize_t w = write(out, buf.data() + written, n - written);
+            if (w < 0 && errno == EINTR) continue;
+            if (w <= 0) return false;
+            written += w;
+        }
+        size -= n;
+    }
+    return true;
+}
+
+// 将in中剩余的size字节追加到out当前位置
+static bool AppendFile(int in, int out, size_t size) {
+#ifdef __linux__
+    // 进程内记录内核拷贝是否可用，避免每个文件都重复失败一次
+    static std::atomic<bool> copyRangeSupported{true};
+    static std::atomic<bool> sendfileSupported{true};
+
+    if (copyRangeSupported.load(std::memory_order_relaxed)) {
+        size_t left = size;
+        int err = 0;
+        while (left > 0) {
+            ssize_t n = copy_file_range(in, nullptr, out, nullptr, left, 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) {
+                err = errno;
+                break;
+            }
+            // 输入文件比预期短，回退也读不到剩余数据
+            if (n == 0) return false;
+            left -= n;
+        }
+        if (left == 0) return true;
+        // 跨文件系统或内核不支持时回退，已拷贝的部分文件偏移已推进，从剩余部分继续
+        if (err == ENOSYS || err == EXDEV || err == EINVAL || err == EOPNOTSUPP) {
+            copyRangeSupported.store(false, std::memory_order_relaxed);
+        }
+        size = left;
+    }
+
+    if (sendfileSupported.load(std::memory_order_relaxed)) {
+        size_t left = size;
+        int err = 0;
+        while (left > 0) {
+            ssize_t n = sendfile(out, in, nullptr, left);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) {
+                err = errno;
+                break;
+            }
+            if (n == 0) return false;
+            left -= n;
+        }
+        if (left == 0) return true;
+        if (err == ENOSYS || err == EINVAL) {
+            sendfileSupported.store(false, std::memory_order_relaxed);
+        }
+        size = left;
+    }
+#endif
+    return CopyByReadWrite(in, out, size);
+}
+
+bool ConcatFiles(const std::vector<std::string>& inputs, const std::filesystem::path& output,
+                 size_t startIndex, uint64_t startOffset,
+                 const std::function<void(size_t, uint64_t)>& onCheckpoint) {
+    int out = open(output.c_str(), O_WRONLY | O_CREAT | (startIndex == 0 ? O_TRUNC : 0), 0644);
+    if (out == -1) {
+        std::cerr << "[Merge] Cannot open output file: " << output << std::endl;
+        return false;
+    }
+    if (startIndex == 0) {
+        startOffset = 0;
+    } else if (ftruncate(out, static_cast<off_t>(startOffset)) != 0 ||
+               lseek(out, static_cast<off_t>(startOffset), SEEK_SET) == -1) {
+        // 丢掉检查点之后写了一半的数据
+        std::cerr << "[Merge] Cannot resume output file: " << output << std::endl;
+        close(out);
+        return false;
+    }
+
+    bool ok = true;
+    uint64_t offset = startOffset;
+    std::vector<std::pair<int, size_t>> batch;   // [fd, size]
+    batch.reserve(kOpenBatch);
+    for (size_t begin = startIndex; ok && begin < inputs.size(); begin += kOpenBatch) {
+        size_t end = std::min(inputs.size(), begin + kOpenBatch);
+
+        // 先批量打开本批文件并提示内核顺序预读
+        batch.clear();
+        for (size_t i = begin; i < end; ++i) {
+            int fd = open(inputs[i].c_str(), O_RDONLY);
+            struct stat st;
+            if (fd == -1 || fstat(fd, &st) == -1) {
+                std::cerr << "[Merge] Cannot open decrypted file: " << inputs[i] << std::endl;
+                if (fd != -1) close(fd);
+                ok = false;
+                break;
+            }
+#ifdef POSIX_FADV_SEQUENTIAL
+            posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+            batch.emplace_back(fd, static_cast<size_t>(st.st_size));
+        }
+
+        for (size_t i = 0; i < batch.size(); ++i) {
+            if (ok && !AppendFile(batch[i].first, out, batch[i].second)) {
+                std::cerr << "[Merge] Failed to append: " << inputs[begin + i] << std::endl;
+                ok = false;
+            }
+            offset += batch[i].second;
+            close(batch[i].first);
+        }
+
+        // 检查点之前的数据必须已经落盘，否则崩溃后从检查点续传会留下空洞
+        if (ok && onCheckpoint) {
+#ifdef __linux__
+            ok = fdatasync(out) == 0;
+#else
+            ok = fsync(out) == 0;
+#endif
+            if (ok) onCheckpoint(end, offset);
+        }
+    }
+
+    if (close(out) != 0) ok = false;
+    return ok;
+}
@@ -0,0 +1,23 @@
+//
+// Created by 翔 on 25-11-27.
+//
+
+#ifndef FILE_CONCAT_H
+#define FILE_CONCAT_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <functional>
+#include <filesystem>
+
+// 按顺序将inputs拼接到output（覆盖写）
+// Linux下优先使用copy_file_range在内核中完成拷贝，不支持时依次回退到sendfile、用户态大块读写；
+// 其他平台直接使用用户态大块读写
+// 断点续传：startIndex > 0 时保留output的前startOffset字节，从inputs[startIndex]开始继续追加
+// onCheckpoint在每批文件写入并落盘后调用，参数为已合并的文件数和输出文件的字节数
+bool ConcatFiles(const std::vector<std::string>& inputs, const std::filesystem::path& output,
+                 size_t startIndex = 0, uint64_t startOffset = 0,
+                 const std::function<void(size_t, uint64_t)>& onCheckpoint = nullptr);
+
+#endif //FILE_CONCAT_H
@@ -0,0 +1,285 @@
+//
+// Created by 翔 on 25-11-30.
+//
+
+#include "fingerprint_index.h"
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <signal.h>
+#include <cerrno>
+
+static constexpr char kIndexMagic[8] = {'V', 'D', 'F', 'P', 'I', 'D', 'X', '2'};
+static constexpr uint64_t kHeaderSize = sizeof(kIndexMagic);
+static constexpr uint64_t kRecordHeaderSize = 13;   // 总长度u32 + 指纹长度u16 + 路径长度u16 + 进程号u32 + 状态u8
+static constexpr size_t kCompactMinRecords = 1024;  // 记录数不到这么多时不压缩
+
+// 持有Lock加上的跨进程文件锁，离开作用域时释放；压缩后fd会换成新文件，因此保存引用
+class FileLock {
+public:
+    explicit FileLock(const int& fd) : fd(fd) {}
+    ~FileLock() { flock(fd, LOCK_UN); }
+    FileLock(const FileLock&) = delete;
+    FileLock& operator=(const FileLock&) = delete;
+
+private:
+    const int& fd;
+};
+
+static std::string EncodeRecord(const std::string& fingerprint, const std::string& value, uint32_t pid, uint8_t state) {
+    const auto fingerprintLen = static_cast<uint16_t>(fingerprint.size());
+    const auto pathLen = static_cast<uint16_t>(value.size());
+    const auto total = static_cast<uint32_t>(kRecordHeaderSize + fingerprintLen + pathLen);
+    std::string record(total, '\0');
+    std::memcpy(&record[0], &total, sizeof(total));
+    std::memcpy(&record[4], &fingerprintLen, sizeof(fingerprintLen));
+    std::memcpy(&record[6], &pathLen, sizeof(pathLen));
+    std::memcpy(&record[8], &pid, sizeof(pid));
+    record[12] = static_cast<char>(state);
+    std::memcpy(&record[kRecordHeaderSize], fingerprint.data(), fingerprintLen);
+    std::memcpy(&record[kRecordHeaderSize + fingerprintLen], value.data(), pathLen);
+    return record;
+}
+
+FingerprintIndex::FingerprintIndex(std::filesystem::path path) : path(std::move(path)) {}
+
+FingerprintIndex::~FingerprintIndex() {
+    if (fd != -1) close(fd);
+}
+
+FingerprintIndex& FingerprintIndex::Instance() {
+    static FingerprintIndex index([] {
+        const char* home = std::getenv("HOME");
+        std::filesystem::path dir = home && *home ? std::filesystem::path(home) / ".videoDownloader"
+                                                  : std::filesystem::temp_directory_path() / "videoDownloader";
+        return dir / "fingerprints.idx";
+    }());
+    return index;
+}
+
+bool FingerprintIndex::Open() {
+    if (fd != -1) return true;
+    std::error_code ec;
+    std::filesystem::create_directories(path.parent_path(), ec);
+    fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd == -1) {
+        std::cerr << "[Fingerprint] Cannot open index: " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// 加跨进程锁，并确认fd仍然指向索引文件：其他程序压缩索引时会用新文件替换，此时重新打开并重新加载
+bool FingerprintIndex::Lock() {
+    for (;;) {
+        if (!Open()) return false;
+        if (flock(fd, LOCK_EX) == -1) return false;
+        struct stat opened, current;
+        if (fstat(fd, &opened) == 0 && stat(path.c_str(), &current) == 0 &&
+            opened.st_dev == current.st_dev && opened.st_ino == current.st_ino) {
+            return true;
+        }
+        flock(fd, LOCK_UN);
+        close(fd);
+        fd = -1;
+        entries.clear();
+        scanned = 0;
+        records = 0;
+    }
+}
+
+// 下载中的记录只在写入它的进程还活着时有效
+bool FingerprintIndex::Valid(const Entry& entry) const {
+    if (entry.state == State::Completed) return true;
+    const auto pid = static_cast<pid_t>(entry.pid);
+    return pid == getpid() || kill(pid, 0) == 0 || errno == EPERM;
+}
+
+// 解析其他任务或其他进程新追加的记录，调用方需持有文件锁
+void FingerprintIndex::Refresh() {
+    struct stat st;
+    if (fstat(fd, &st) == -1) return;
+    uint64_t size = static_cast<uint64_t>(st.st_size);
+
+    if (size < scanned) {
+        // 文件被截断，重新加载
+        entries.clear();
+        scanned = 0;
+        records = 0;
+    }
+    if (scanned == 0) {
+        char magic[kHeaderSize];
+        if (size < kHeaderSize || pread(fd, magic, kHeaderSize, 0) != static_cast<ssize_t>(kHeaderSize) ||
+            std::memcmp(magic, kIndexMagic, kHeaderSize) != 0) {
+            // 新文件、旧格式或者无法识别的文件，重新创建
+            if (size > 0) std::cerr << "[Fingerprint] Invalid index, recreate: " << path << std::endl;
+            if (ftruncate(fd, 0) == -1 || pwrite(fd, kIndexMagic, kHeaderSize, 0) != static_cast<ssize_t>(kHeaderSize)) {
+                return;
+            }
+            scanned = kHeaderSize;
+            return;
+        }
+        scanned = kHeaderSize;
+    }
+    if (size > scanned) {
+        // 只映射未解析的部分，起点按页对齐
+        const uint64_t page = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+        const uint64_t base = scanned / page * page;
+        const size_t length = static_cast<size_t>(size - base);
+        void* mapped = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, static_cast<off_t>(base));
+        if (mapped == MAP_FAILED) {
+            perror("mmap");
+            return;
+        }
+        const char* data = static_cast<const char*>(mapped);
+
+        uint64_t offset = scanned;
+        while (offset + kRecordHeaderSize <= size) {
+            const char* header = data + (offset - base);
+            uint32_t total, pid;
+            uint16_t fingerprintLen, pathLen;
+            std::memcpy(&total, header, sizeof(total));
+            std::memcpy(&fingerprintLen, header + 4, sizeof(fingerprintLen));
+            std::memcpy(&pathLen, header + 6, sizeof(pathLen));
+            std::memcpy(&pid, header + 8, sizeof(pid));
+            const auto state = static_cast<uint8_t>(header[12]);
+            if (total != kRecordHeaderSize + fingerprintLen + pathLen || offset + total > size ||
+                state > static_cast<uint8_t>(State::Completed)) {
+                break;
+            }
+            const char* record = header + kRecordHeaderSize;
+            if (pathLen == 0) {
+                entries.erase(std::string(record, fingerprintLen));
+            } else {
+                entries[std::string(record, fingerprintLen)] = {std::string(record + fingerprintLen, pathLen), pid,
+                                                                static_cast<State>(state)};
+            }
+            offset += total;
+            ++records;
+        }
+        munmap(mapped, length);
+
+        if (offset < size) {
+            // 上次写入时崩溃留下的不完整记录
+            std::cerr << "[Fingerprint] Drop truncated record in " << path << std::endl;
+            if (ftruncate(fd, static_cast<off_t>(offset)) == -1) return;
+        }
+        scanned = offset;
+    }
+
+    // 每次运行只在第一次加载时检查一次：覆盖、删除和失效的记录占多数时压缩
+    if (!compactChecked) {
+        compactChecked = true;
+        if (records >= kCompactMinRecords && records > 2 * entries.size()) Compact();
+    }
+}
+
+// 追加一条记录，调用方需持有文件锁并已调用Refresh；entry.path为空表示删除
+bool FingerprintIndex::Append(const std::string& fingerprint, const Entry& entry) {
+    if (scanned < kHeaderSize || fingerprint.size() > UINT16_MAX || entry.path.size() > UINT16_MAX) return false;
+    const std::string record = EncodeRecord(fingerprint, entry.path, entry.pid, static_cast<uint8_t>(entry.state));
+    // 丢失索引只会多下载一次重复视频，不需要fsync
+    if (pwrite(fd, record.data(), record.size(), static_cast<off_t>(scanned)) != static_cast<ssize_t>(record.size())) {
+        std::cerr << "[Fingerprint] Cannot write index: " << path << std::endl;
+        return false;
+    }
+    scanned += record.size();
+    ++records;
+    if (entry.path.empty()) {
+        entries.erase(fingerprint);
+    } else {
+        entries[fingerprint] = entry;
+    }
+    return true;
+}
+
+// 只保留有效记录写入新文件，加锁后改名替换旧文件；调用方需持有旧文件的锁。
+// 等在旧文件锁上的其他程序拿到锁后发现文件已被替换，会重新打开新文件
+void FingerprintIndex::Compact() {
+    std::string data(kIndexMagic, kHeaderSize);
+    for (auto it = entries.begin(); it != entries.end();) {
+        if (!Valid(it->second)) {
+            it = entries.erase(it);
+            continue;
+        }
+        data += EncodeRecord(it->first, it->second.path, it->second.pid, static_cast<uint8_t>(it->second.state));
+        ++it;
+    }
+    const std::string temp = path.string() + "." + std::to_string(getpid()) + ".tmp";
+    int tempFd = open(temp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (tempFd == -1) return;
+    if (pwrite(tempFd, data.data(), data.size(), 0) != static_cast<ssize_t>(data.size()) ||
+        flock(tempFd, LOCK_EX) == -1 || rename(temp.c_str(), path.c_str()) == -1) {
+        close(tempFd);
+        unlink(temp.c_str());
+        return;
+    }
+    std::cout << "[Fingerprint] Compacted index: " << records << " -> " << entries.size() << " records" << std::endl;
+    flock(fd, LOCK_UN);
+    close(fd);
+    fd = tempFd;
+    scanned = data.size();
+    records = entries.size();
+}
+
+FingerprintIndex::Match FingerprintIndex::FindOrInsert(const std::string& fingerprint, const std::filesystem::path& dirPath) {
+    std::lock_guard<std::mutex> lock(mutex);
+    // 索引不可用时只是无法去重，不影响下载
+    if (!Lock()) return {};
+    FileLock fileLock(fd);
+    Refresh();
+
+    auto it = entries.find(fingerprint);
+    if (it != entries.end() && Valid(it->second)) {
+        std::error_code ec;
+        // 用户删除了已下载的视频时重新下载
+        if (std::filesystem::exists(it->second.path, ec)) {
+            return {it->second.path, it->second.state == State::Completed};
+        }
+    }
+    // 没有记录、目录已被删除，或者是崩溃的程序留下的下载中记录
+    Append(fingerprint, {dirPath.string(), static_cast<uint32_t>(getpid()), State::Downloading});
+    return {};
+}
+
+bool FingerprintIndex::Complete(const std::string& fingerprint, const std::filesystem::path& dirPath) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!Lock()) return false;
+    FileLock fileLock(fd);
+    Refresh();
+    return Append(fingerprint, {dirPath.string(), static_cast<uint32_t>(getpid()), State::Completed});
+}
+
+void FingerprintIndex::Move(const std::filesystem::path& from, const std::filesystem::path& to) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!Lock()) return;
+    FileLock fileLock(fd);
+    Refresh();
+    std::vector<std::pair<std::string, Entry>> moved;
+    for (const auto& entry : entries) {
+        if (entry.second.path == from.string()) moved.emplace_back(entry.first, entry.second);
+    }
+    for (auto& item : moved) {
+        item.second.path = to.string();
+        Append(item.first, item.second);
+    }
+}
+
+bool FingerprintIndex::Remove(const std::string& fingerprint, const std::filesystem::path& dirPath) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!Lock()) return false;
+    FileLock fileLock(fd);
+    Refresh();
+    auto it = entries.find(fingerprint);
+    if (it == entries.end() || it->second.state == State::Completed || it->second.path != dirPath.string() ||
+        it->second.pid != static_cast<uint32_t>(getpid())) {
+        return false;
+    }
+    return Append(fingerprint, {});
+}
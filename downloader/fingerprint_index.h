@@ -0,0 +1,69 @@
+//
+// Created by 翔 on 25-11-30.
+//
+
+#ifndef FINGERPRINT_INDEX_H
+#define FINGERPRINT_INDEX_H
+
+#include <cstdint>
+#include <string>
+#include <mutex>
+#include <unordered_map>
+#include <filesystem>
+
+// 视频指纹索引（指纹 -> 视频的目录），保存在磁盘上，所有任务共用，程序重启后仍然有效
+// 文件只追加不修改：文件头之后每条记录为 [总长度u32][指纹长度u16][路径长度u16][进程号u32][状态u8][指纹][路径]，
+// 同一指纹以最后一条记录为准，路径为空表示已删除。读取时mmap整个文件，只解析上次之后新追加的记录；
+// 查找并插入在进程内持锁、跨进程持flock，同时运行的多个任务或多个程序不会把同一个视频都当成新视频。
+// 记录分为下载中和已完成两种状态：下载中的记录只在写入它的进程还在运行时有效，
+// 程序崩溃后留下的半成品目录不会被当成已下载的视频。
+// 崩溃时最多留下最后一条不完整的记录，下次打开时截掉；打开时失效记录占多数则重写为只含有效记录的新文件
+class FingerprintIndex {
+public:
+    explicit FingerprintIndex(std::filesystem::path path);
+    ~FingerprintIndex();
+    FingerprintIndex(const FingerprintIndex&) = delete;
+    FingerprintIndex& operator=(const FingerprintIndex&) = delete;
+
+    // 进程级索引，位于 $HOME/.videoDownloader/fingerprints.idx
+    static FingerprintIndex& Instance();
+
+    struct Match {
+        std::filesystem::path path;     // 为空表示没有有效记录
+        bool completed = false;         // 该目录中的视频已下载完成；false表示其他任务正在下载
+    };
+
+    // 查找指纹对应的视频目录；没有有效记录或记录的目录已被删除时以下载中状态记为path，返回空的Match
+    Match FindOrInsert(const std::string& fingerprint, const std::filesystem::path& path);
+    // 视频下载完成，把指纹的记录改为已完成
+    bool Complete(const std::string& fingerprint, const std::filesystem::path& path);
+    // 已下载的视频被移动到新目录后，把指向from的所有记录改为to
+    void Move(const std::filesystem::path& from, const std::filesystem::path& to);
+    // 删除记录（追加一条路径为空的记录），用于没有下载完成的视频；
+    // 只删除本进程登记在path下且仍在下载中的记录，已完成或已被其他任务改写的记录保留
+    bool Remove(const std::string& fingerprint, const std::filesystem::path& path);
+
+private:
+    enum class State : uint8_t { Downloading = 0, Completed = 1 };
+    struct Entry {
+        std::string path;
+        uint32_t pid = 0;       // 写入记录的进程
+        State state = State::Downloading;
+    };
+    bool Open();
+    bool Lock();
+    void Refresh();
+    bool Valid(const Entry& entry) const;
+    bool Append(const std::string& fingerprint, const Entry& entry);
+    void Compact();
+
+    std::filesystem::path path;
+    int fd = -1;
+    uint64_t scanned = 0;               // 已解析到的文件偏移
+    size_t records = 0;                 // 已解析的记录数，包括被覆盖和删除的
+    bool compactChecked = false;
+    std::unordered_map<std::string, Entry> entries;
+    std::mutex mutex;
+};
+
+#endif //FINGERPRINT_INDEX_H
@@ -3,6 +3,7 @@
 //
 
 #include "http_client.h"
+#include "curl_pool.h"
 #include <curl/curl.h>
 #include <iostream>
 #include <filesystem>
@@ -52,12 +53,12 @@ HttpClient::HttpClient(const std::string &Url){
 
 // 本质上是对该url发出请求并返回响应
 std::string HttpClient::GetHtmlFromUrl() {
-    CURL* curl;
     CURLcode res;
     std::string readBuffer;
 
-    curl_global_init(CURL_GLOBAL_DEFAULT);
-    curl = curl_easy_init();
+    // 从进程级句柄池中借用，复用DNS缓存、TLS会话以及已建立的连接
+    PooledCurl handle;
+    CURL* curl = handle.get();
 
     if (curl) {
         curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
@@ -83,11 +84,8 @@ std::string HttpClient::GetHtmlFromUrl() {
             std::cerr << "[Curl] curl_easy_perform() failed: "
                       << curl_easy_strerror(res) << std::endl;
         }
-
-        curl_easy_cleanup(curl);
     }
 
-    curl_global_cleanup();
     return readBuffer;
 }
 
@@ -3,25 +3,31 @@
 //
 
 #include "m3u8_downloader.h"
-#include "thread_pool.h"
+#include "executor.h"
+#include "segment_fetcher.h"
+#include "aes_decryptor.h"
+#include "file_concat.h"
+#include "ts_remuxer.h"
+#include "positional_writer.h"
 #include "http_client.h"
 #include <iostream>
 #include <sstream>
 #include <fstream>
 #include <thread>
 #include <filesystem>
-#include <openssl/aes.h>
-#include <curl/curl.h>
+#include <cstring>
 #include <atomic>
+#include <map>
+#include <chrono>
+#include <condition_variable>
 #include <qhash.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <unordered_set>
+#include <algorithm>
 #include <fcntl.h>
 #include <unistd.h>
 
-// 获取设备的逻辑核心数
-// 在I/O密集型操作中可以分配更多的虚拟核心，而在cpu计算密集型中不要超过物理核心数
-const unsigned int logical_cores = std::thread::hardware_concurrency();
 // 文件操作锁
 static std::mutex fileMutex;
 
@@ -75,55 +81,23 @@ std::string sha256(const std::vector<unsigned char>& data) {
     return out.str();
 }
 
-size_t WriteFileCallback(void* ptr, size_t size, size_t nmemb, void* stream) {
-    FILE* fp = (FILE*)stream;
-    return fwrite(ptr, size, nmemb, fp);
-}
-
 // 确保每片ts文件都能被正确下载，否则在合并时会造成合并结果无法播放
+// 交给共享的下载引擎，缓存、重试以及卡顿检测都与批量下载一致
 bool m3u8Downloader::DownloadTsSegment(const std::string& url, const std::filesystem::path& outputPath) {
-    CURL* curl = curl_easy_init();
-    if (!curl) return false;
-
-    FILE* fp = fopen(outputPath.c_str(), "wb");
-    if (!fp) {
-        curl_easy_cleanup(curl);
-        return false;
-    }
-
-    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
-    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 10L); // 建立连接超时
-    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 120L);       // 总超时
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteFileCallback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, fp);
-    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);  // 关闭ssl校验
-    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0L);
-    curl_easy_setopt(curl, CURLOPT_SSLVERSION, CURL_SSLVERSION_TLSv1_2);
-    curl_easy_setopt(curl, CURLOPT_USERAGENT,
-                         "Mozilla/5.0 (Macintosh; Intel Mac OS X 10_15_7)"
-                         "AppleWebKit/537.36 (KHTML, like Gecko) Chrome/138.0.0.0 Safari/537.36");
-
-    CURLcode res = curl_easy_perform(curl);
-    long response_code = 0;
-    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
-
-    if (res != CURLE_OK) {
-        std::cerr << "[Segment] Download failed: " << outputPath
-              << " - " << curl_easy_strerror(res)
-              << ", HTTP code: " << response_code
-              << std::endl;
-        return false;
+    SegmentTask task;
+    task.url = url;
+    task.outputPath = outputPath;
+    {
+        std::lock_guard<std::mutex> lock(jobMutex);
+        task.job = fetchJob;
     }
-
-    fclose(fp);
-    curl_easy_cleanup(curl);
-    return true;
+    if (!task.job) task.job = NewFetchJob();
+    return SegmentFetcher::Shared().Submit(std::move(task)).get();
 }
 
 // 新增进度回调
 bool m3u8Downloader::DownloadAllSegments(const std::filesystem::path& dirPath, std::function<void(int)> progressCallBack) {
-    // 提前获取key，确保下载完成后能直接解析
+    // 提前获取key，分片在下载时直接解密
     if (key.empty()) {
         key = FetchKey();
     }
@@ -132,164 +106,626 @@ bool m3u8Downloader::DownloadAllSegments(const std::filesystem::path& dirPath, s
         std::cerr << "[Download] No TS segments to download!" << std::endl;
         return false;
     }
-
-    ThreadPool pool(logical_cores);
     std::filesystem::create_directories(dirPath);
-    std::vector<std::future<void>> results;
+    OpenJournal(dirPath);
+    if (!PrepareDecrypt()) {
+        return false;
+    }
+    if (ProbeRepeatVideo(dirPath)) {
+        journal.reset();
+        RemoveRepeatVideo(dirPath);
+        if (progressCallBack) progressCallBack(60);
+        return true;
+    }
+
+    // 分片下载是网络密集型操作，所有任务的传输由进程级下载引擎的同一个事件循环驱动，并发数与cpu核心数无关
+    SegmentFetcher& fetcher = SegmentFetcher::Shared();
+    auto job = NewFetchJob();
 
     std::cout << "[Download] Start downloading " << TsLinks.size() << " TS files..." << std::endl;
 
     // 初始进度（当前项目占比50%）
-    std::atomic<int> doneCount = 0;
-    std::atomic<bool> repeat(false);
+    std::atomic<size_t> doneCount = 0;
+    // 确定重复后同时作为取消标记，未开始的分片不再下载，正在下载的分片直接中断
+    auto repeat = std::make_shared<std::atomic<bool>>(false);
     // atomic不支持std::string
     std::array<std::string, 3> before3Hashes;
+    size_t hashedCount = 0;
     std::mutex hashMutex;
+    // 分片完整落盘后的处理：前3片参与指纹去重并更新进度，断点续传跳过的分片同样经过这里
+    auto onSegmentDone = [&, repeat](size_t i, const std::string& outputFile) {
+        // 通过前3片Ts文件混合计算hash来进行文件去重，只在最后一个哈希算完时查一次索引
+        if (i < 3) {
+            // 使用mmap读文件减小内存开销
+            std::string h = sha256(mmapReadFile(outputFile));
+            std::string combined;
+            {
+                std::lock_guard<std::mutex> locker(hashMutex);
+                before3Hashes[i] = h;
+                if (++hashedCount == before3Hashes.size()) {
+                    combined.reserve(64 * 3);
+                    for (auto& hash: before3Hashes) {
+                        combined.append(hash);
+                    }
+                }
+            }
+            if (!combined.empty()) {
+                std::string Fingerprint = sha256(std::vector<unsigned char>(combined.begin(), combined.end()));
+                // 典型模式：发布者 / 订阅者
+                if (!repeat->load(std::memory_order_acquire) && CheckRepeatVideo(Fingerprint, dirPath)) {
+                    // 通知其他分片repeat更新情况
+                    repeat->store(true, std::memory_order_release);
+                    progressCallBack(60);
+                    return;
+                }
+            }
+        }
+        if (repeat->load(std::memory_order_acquire)) return;
+
+        // 不要直接使用整数除法否则会造成值为0即进度不走的情况
+        // 不要使用序号算进度，因为是并发执行，会导致进度条伸缩
+        // 不要频繁的回调进度否则会造成很大的性能开销
+        doneCount.fetch_add(1, std::memory_order_relaxed);
+        if(progressCallBack && doneCount.load() % 5 == 0) {
+            progressCallBack(20 + static_cast<int>((doneCount.load() + 1) * 40.0 / TsLinks.size()));
+        }
+    };
+
+    // 前3片需要读文件计算哈希，交给cpu执行器，不占用下载引擎的事件循环
+    std::array<std::future<void>, 3> fingerprintTasks;
+    auto completeSegment = [&](size_t i, const std::string& outputFile) {
+        if (i < fingerprintTasks.size()) {
+            fingerprintTasks[i] = Executors::Cpu().Submit([&onSegmentDone, i, outputFile] {
+                onSegmentDone(i, outputFile);
+            });
+        } else {
+            onSegmentDone(i, outputFile);
+        }
+    };
+
+    tsFiles.clear();
+    std::vector<size_t> missing;
     for (size_t i = 0; i < TsLinks.size(); ++i) {
-        std::string tsUrl = TsLinks[i];
         std::filesystem::path temp = dirPath;
-        std::string outputFile = temp.append("segment_" + std::to_string(i) + ".ts");
-        tsFiles.emplace_back(outputFile);
+        tsFiles.emplace_back(temp.append("segment_" + std::to_string(i) + ".ts"));
+        // 上次已经完整下载的分片校验通过后直接跳过
+        if (journal && journal->Resumed() && SegmentJournal::VerifyFile(tsFiles[i], journal->Segment(i))) {
+            completeSegment(i, tsFiles[i]);
+        } else {
+            missing.push_back(i);
+        }
+    }
+    if (missing.size() < TsLinks.size()) {
+        std::cout << "[Download] Resume: " << TsLinks.size() - missing.size() << " of " << TsLinks.size()
+                  << " segments already downloaded" << std::endl;
+    }
 
-        results.emplace_back(pool.enqueue([=, &doneCount, &before3Hashes, &hashMutex, &repeat]() {
-            if (repeat.load(std::memory_order_acquire)) {
-                // 如果已经确定有重复，直接跳过后续分片的下载
+    std::vector<SegmentTask> tasks;
+    tasks.reserve(missing.size());
+    for (size_t i : missing) {
+        if (repeat->load(std::memory_order_acquire)) break;
+        const std::string& outputFile = tsFiles[i];
+
+        SegmentTask task;
+        task.index = i;
+        task.url = TsLinks[i];
+        task.outputPath = outputFile;
+        // 边收边解密时落盘的分片已经是明文，不再需要单独的DecryptAllTs阶段
+        // 同时记录落盘内容的长度和校验和，写入任务日志供断点续传校验
+        auto fileSink = std::make_shared<FileSink>(outputFile);
+        auto checksum = std::make_shared<ChecksumSink>(fileSink);
+        task.sink = decryptOnReceive ? MakeSegmentSink(checksum, i) : checksum;
+        task.cancelled = repeat;
+        task.job = job;
+        // 回调均在下载引擎的事件循环线程中执行
+        task.onComplete = [=, &completeSegment](size_t, bool success) {
+            if (repeat->load(std::memory_order_acquire)) {
+                // 如果已经确定有重复，后续分片无需处理
                 return;
             }
 
-            int count = 0; bool success = true;
-            success = this->DownloadTsSegment(tsUrl, outputFile);
-            // 新增重试机制，确保能正确下载每一片分片
-            while(!success && count++ < 5) {
-                std::cout << "[Download] retry " << std::to_string(count) << " times file: " << outputFile << std::endl;
-                std::this_thread::sleep_for(std::chrono::milliseconds(200));
-                if (repeat.load(std::memory_order_acquire)) return;
-                success = this->DownloadTsSegment(tsUrl, outputFile);
-                if (repeat.load(std::memory_order_acquire)) return;
-            }
-
-            // 5次重试后仍失败，直接退出下载
-            // TODO: 后续可以将下载失败的片段作出标记，然后在重试时至下载失败片段
+            // 5次重试后仍失败时保留已完成的分片，重新开始任务时只下载失败的分片
             if (success) {
-                // 通过前3片Ts文件混合计算hash来进行文件去重
-                if (i < 3) {
-                    // 使用mmap读文件减小内存开销
-                    std::string h = sha256(mmapReadFile(outputFile));
-                    std::lock_guard<std::mutex> locker(hashMutex);
-                    before3Hashes[i] = h;
-                }
-
-                {
-                    std::unique_lock<std::mutex> locker(hashMutex);
-                    if (!before3Hashes[0].empty() && !before3Hashes[1].empty() && !before3Hashes[2].empty()) {
-                        locker.unlock();
-
-                        // 仅保留一个线程计算Fingerprint，其余线程直接退出
-                        if (repeat.load(std::memory_order_acquire)) return;
-
-                        // 计算最终指纹
-                        std::string combined;
-                        combined.reserve(64 * 3);
-
-                        locker.lock();
-                        for (auto& hash: before3Hashes) {
-                            combined.append(hash);
-                        }
-                        locker.unlock();
-
-                        std::string Fingerprint = sha256(std::vector<unsigned char>(combined.begin(), combined.end()));
-
-                        // 典型模式：发布者 / 订阅者
-                        if (!repeat.load(std::memory_order_acquire)) {
-                            std::unique_lock<std::mutex> mapLocker(mapMutex);
-                            auto it = videoHashMap.find(Fingerprint);
-                            mapLocker.unlock();
-
-                            if (it != videoHashMap.end()) {
-                                // 将目录名更长的更新到已下载目录上
-                                std::filesystem::path exitPath =  it->second;
-                                if (exitPath != dirPath) {
-                                    std::string exitDirName = exitPath.filename();
-                                    std::string currDirName = dirPath.filename();
-                                    if (exitDirName.size() >= currDirName.size()) {
-                                        // 通知其他线程repeat更新情况
-                                        repeat.store(true, std::memory_order_release);
-                                        isRepeat = true;
-                                        progressCallBack(60);
-                                    } else {
-                                        std::unique_lock<std::mutex> fileLocker(fileMutex);
-                                        std::filesystem::rename(exitPath, dirPath);
-                                        fileLocker.unlock();
-
-                                        std::filesystem::path originFileName;
-                                        for (auto enty: std::filesystem::directory_iterator(exitPath)) {
-                                            if (enty.is_regular_file()) {
-                                                originFileName = enty.path();
-                                                break;
-                                            }
-                                        }
-                                        std::filesystem::path temp = exitPath;
-                                        std::filesystem::path newFileName = temp.append(currDirName);
-
-                                        fileLocker.lock();
-                                        std::filesystem::rename(originFileName, newFileName);
-                                        fileLocker.unlock();
-                                    }
-                                    return ;
-                                } else {
-                                    // 避免同一任务中的不同线程误认为自己是重复视频
-                                    // 此处什么也不做直接返回
-                                }
-                            } else {
-                                std::unique_lock<std::mutex> mapLocker(mapMutex);
-                                videoHashMap.insert({Fingerprint, dirPath});
-                                mapLocker.unlock();
-                            }
-                        }
-                    }
-                }
-
-                // 不要直接使用整数除法否则会造成值为0即进度不走的情况
-                // 不要使用序号算进度，因为是并发执行，会导致进度条伸缩
-                // 不要频繁的回调进度否则会造成很大的性能开销
-                doneCount.fetch_add(1, std::memory_order_relaxed);
-                if(progressCallBack && doneCount.load() % 5 == 0) {
-                    progressCallBack(20 + static_cast<int>((doneCount.load() + 1) * 40.0 / TsLinks.size()));
-                }
+                if (journal) journal->MarkDownloaded(i, checksum->Length(), checksum->Digest());
+                completeSegment(i, outputFile);
             } else {
                 std::cerr << "[Download] " << std::to_string(i) << " TS failed path: " << outputFile << std::endl;
                 std::filesystem::remove(outputFile);
             }
-        }));
+        };
+        tasks.push_back(std::move(task));
     }
+    // 一次性放入共享下载引擎，由引擎按并发上限逐步启动，不会同时打开上万个连接
+    std::vector<std::future<bool>> results = fetcher.SubmitBatch(tasks);
 
-    // 等待所有任务完成
+    // 等待所有分片完成
     for (auto& f : results) {
         f.get();
     }
+    for (auto& f : fingerprintTasks) {
+        if (f.valid()) f.get();
+    }
 
-    if (doneCount.load() == TsLinks.size() && !repeat.load(std::memory_order_acquire)) {
+    if (doneCount.load() == TsLinks.size() && !repeat->load(std::memory_order_acquire)) {
         // 下载完成后及时释放TsLinks，减少内存占用
         TsLinks.clear();
+        if (decryptOnReceive || !IsEncrypted()) {
+            decryptedFiles = tsFiles;
+            segmentsDecrypted = true;
+        }
         std::cout << "[Download] All TS segments downloaded. "  << dirPath << std::endl;
         return true;
-    } else if (repeat.load(std::memory_order_acquire)) {
-        std::filesystem::remove_all(dirPath);
-        std::cout << "[RepeatVideo] Remove repeated video " << dirPath << std::endl;
+    } else if (repeat->load(std::memory_order_acquire)) {
+        RemoveRepeatVideo(dirPath);
         return true;
     } else {
         return false;
     }
 }
 
-bool m3u8Downloader::parseM3U8() {
-    HttpClient client(m3u8Link);
-    std::string content = client.GetHtmlFromUrl();
+std::shared_ptr<FetchJob> m3u8Downloader::NewFetchJob() {
+    std::lock_guard<std::mutex> lock(jobMutex);
+    fetchJob = std::make_shared<FetchJob>(maxConcurrentDownloads, http2, adaptiveConcurrency);
+    fetchJob->SetRateLimit(rateLimit);
+    fetchJob->SetBoost(priorityBoost);
+    return fetchJob;
+}
+
+void m3u8Downloader::SetRateLimit(uint64_t bytesPerSecond) {
+    std::lock_guard<std::mutex> lock(jobMutex);
+    rateLimit = bytesPerSecond;
+    if (fetchJob) fetchJob->SetRateLimit(bytesPerSecond);
+}
+
+void m3u8Downloader::SetPriorityBoost(bool enable) {
+    std::lock_guard<std::mutex> lock(jobMutex);
+    priorityBoost = enable;
+    if (fetchJob) fetchJob->SetBoost(enable);
+}
+
+// 任务日志与分片放在同一目录，快照包含播放列表、key和IV，播放列表变化时旧日志作废
+void m3u8Downloader::OpenJournal(const std::filesystem::path& dirPath) {
+    JournalSnapshot current;
+    current.playlist = playlistUrl;
+    current.method = key_;
+    current.iv = iv_;
+    current.mediaSequence = mediaSequence;
+    current.plainSegments = decryptOnReceive || !IsEncrypted();
+    current.segments = TsLinks;
+    std::ostringstream keyHex;
+    keyHex << std::hex << std::setfill('0');
+    for (unsigned char byte : key) {
+        keyHex << std::setw(2) << static_cast<int>(byte);
+    }
+    current.keyHex = keyHex.str();
+
+    journal = std::make_unique<SegmentJournal>(dirPath / kJournalFileName);
+    if (!journal->Open(current)) {
+        // 没有日志只是不能续传，不影响本次下载
+        journal.reset();
+        return;
+    }
+    // key地址失效时使用上次保存的key
+    if (journal->Resumed() && key.empty() && !journal->Snapshot().keyHex.empty()) {
+        key = HexToBytes("0x" + journal->Snapshot().keyHex);
+    }
+}
+
+// 当前进程中正在下载的视频目录，受fileMutex保护；其他任务正在使用的目录不能改名
+static std::unordered_set<std::string> activeDirs;
+
+// 根据前3片分片的指纹判断是否为重复视频，返回true表示当前任务无需继续处理
+// 指纹记录在所有任务共用的磁盘索引中，同时下载的其他任务以及之前运行时下载过的视频都参与比较
+bool m3u8Downloader::CheckRepeatVideo(const std::string& Fingerprint, const std::filesystem::path& dirPath) {
+    const FingerprintIndex::Match match = FingerprintIndex::Instance().FindOrInsert(Fingerprint, dirPath);
+    const std::filesystem::path& exitPath = match.path;
+    if (exitPath.empty()) {
+        // 新视频，记录下来，任务结束时确认是否下载完成
+        std::lock_guard<std::mutex> fileLocker(fileMutex);
+        fingerprints.push_back(Fingerprint);
+        indexedDir = dirPath;
+        activeDirs.insert(dirPath.string());
+        return false;
+    }
+    if (exitPath == dirPath) {
+        // 避免同一任务中的不同分片（或同一视频的续传）误认为自己是重复视频
+        // 记录可能是同一目录下之前的线路登记的，由当前任务接管，下载完成时由它标记为已完成
+        std::lock_guard<std::mutex> fileLocker(fileMutex);
+        if (std::find(fingerprints.begin(), fingerprints.end(), Fingerprint) == fingerprints.end()) {
+            fingerprints.push_back(Fingerprint);
+            indexedDir = dirPath;
+            activeDirs.insert(dirPath.string());
+        }
+        return false;
+    }
+
+    isRepeat = true;
+    // 保留目录名更长的：当前目录删除后把已下载的视频移到当前目录名下；其他任务正在下载的目录不能移动
+    std::lock_guard<std::mutex> fileLocker(fileMutex);
+    if (match.completed && exitPath.filename().string().size() < dirPath.filename().string().size() &&
+        activeDirs.count(exitPath.string()) == 0) {
+        renameFrom = exitPath;
+    }
+    return true;
+}
+
+// 下载前的快速去重：并发请求前kProbeSegments个分片的前kProbeBytes字节（Range），
+// 用解密后的前缀和分片完整大小计算探测指纹。CBC解密前缀只需要key、IV和前缀本身，
+// 因此同一视频不论来自哪个线路、用哪个key加密，探测指纹都相同。
+// 重复视频在一个往返内被拒绝，不必等前3片完整下载；探测失败时只依靠完整指纹
+bool m3u8Downloader::ProbeRepeatVideo(const std::filesystem::path& dirPath) {
+    const size_t count = std::min(kProbeSegments, TsLinks.size());
+    if (count == 0) return false;
+
+    auto job = NewFetchJob();
+    std::vector<std::shared_ptr<MemorySink>> memories(count);
+    std::vector<std::shared_ptr<SegmentResponse>> responses(count);
+    std::vector<SegmentTask> tasks;
+    for (size_t i = 0; i < count; ++i) {
+        memories[i] = std::make_shared<MemorySink>();
+        responses[i] = std::make_shared<SegmentResponse>();
+        SegmentTask task;
+        task.index = i;
+        task.url = TsLinks[i];
+        task.outputPath = dirPath / ("segment_" + std::to_string(i) + ".ts"); // 仅用于日志
+        task.sink = MakeSegmentSink(memories[i], i);
+        task.response = responses[i];
+        task.probeBytes = kProbeBytes;
+        task.maxRetry = 1;
+        task.job = job;
+        tasks.push_back(std::move(task));
+    }
+    std::vector<std::future<bool>> results = SegmentFetcher::Shared().SubmitBatch(tasks);
 
-    if (content.empty()) {
-        std::cerr << "[ParseM3U8] Failed to download m3u8 file: " << m3u8Link << std::endl;
+    std::string combined;
+    for (size_t i = 0; i < count; ++i) {
+        if (!results[i].get() || responses[i]->totalLength < 0) {
+            job->Cancel();
+            return false;
+        }
+        combined.append(sha256(memories[i]->Take()));
+        combined.append(":" + std::to_string(responses[i]->totalLength) + ";");
+    }
+    std::string Fingerprint = "probe:" + sha256(std::vector<unsigned char>(combined.begin(), combined.end()));
+    if (!CheckRepeatVideo(Fingerprint, dirPath)) {
         return false;
     }
+    std::cout << "[Probe] Repeated video detected before download: " << dirPath << std::endl;
+    return true;
+}
+
+void m3u8Downloader::RemoveRepeatVideo(const std::filesystem::path& dirPath) {
+    std::filesystem::remove_all(dirPath);
+    std::cout << "[RepeatVideo] Remove repeated video " << dirPath << std::endl;
+    if (renameFrom.empty()) return;
+
+    std::lock_guard<std::mutex> fileLocker(fileMutex);
+    std::error_code ec;
+    std::filesystem::create_directories(dirPath.parent_path(), ec);
+    std::filesystem::rename(renameFrom, dirPath, ec);
+    if (ec) {
+        std::cerr << "[RepeatVideo] Cannot move " << renameFrom << " to " << dirPath << ": " << ec.message() << std::endl;
+        renameFrom.clear();
+        return;
+    }
+    // 视频文件与目录同名，一起改名；先收集再改名，遍历过程中不修改目录
+    const std::string oldName = renameFrom.filename().string();
+    const std::string newName = dirPath.filename().string();
+    std::vector<std::filesystem::path> videos;
+    for (const auto& entry : std::filesystem::directory_iterator(dirPath, ec)) {
+        if (entry.is_regular_file() && entry.path().stem() == oldName) {
+            videos.push_back(entry.path());
+        }
+    }
+    for (const auto& video : videos) {
+        std::filesystem::rename(video, dirPath / (newName + video.extension().string()), ec);
+    }
+    FingerprintIndex::Instance().Move(renameFrom, dirPath);
+    std::cout << "[RepeatVideo] Move " << renameFrom << " to " << dirPath << std::endl;
+    renameFrom.clear();
+}
+
+// 视频下载完成，索引中的记录改为已完成，之后的任务据此判断重复
+void m3u8Downloader::MarkCompleted() {
+    downloadCompleted = true;
+    std::vector<std::string> items;
+    std::filesystem::path dir;
+    {
+        std::lock_guard<std::mutex> fileLocker(fileMutex);
+        items = fingerprints;
+        dir = indexedDir;
+    }
+    for (const auto& item : items) {
+        FingerprintIndex::Instance().Complete(item, dir);
+    }
+}
+
+void m3u8Downloader::ReleaseFingerprint() {
+    if (fingerprints.empty()) return;
+    if (!downloadCompleted) {
+        for (const auto& item : fingerprints) {
+            FingerprintIndex::Instance().Remove(item, indexedDir);
+        }
+    }
+    std::lock_guard<std::mutex> fileLocker(fileMutex);
+    activeDirs.erase(indexedDir.string());
+    fingerprints.clear();
+}
+
+// 把播放列表中的地址补全为绝对地址：/开头的相对于域名，其余相对于播放列表所在目录
+static std::string ResolveUrl(const std::string& playlist, const std::string& link) {
+    if (link.find("http") == 0) return link;
+    size_t scheme = playlist.find("://");
+    if (link.compare(0, 2, "//") == 0) {
+        // 省略协议的地址沿用播放列表的协议
+        return (scheme == std::string::npos ? "https:" : playlist.substr(0, scheme + 1)) + link;
+    }
+    size_t host = scheme == std::string::npos ? 0 : scheme + 3;
+    const std::string origin = playlist.substr(0, playlist.find_first_of("/?#", host));
+    if (!link.empty() && link[0] == '/') return origin + link;
+    std::string dir = playlist.substr(0, playlist.find_first_of("?#"));
+    dir = dir.substr(0, dir.rfind('/') + 1);
+    if (dir.size() <= origin.size()) return origin + "/" + link;
+    return dir + link;
+}
+
+// 解析属性列表，如 BANDWIDTH=1280000,RESOLUTION=1280x720,CODECS="avc1.4d401f,mp4a.40.2"
+// 带引号的值中可能有逗号，不能直接按逗号分割
+static std::unordered_map<std::string, std::string> ParseAttributes(const std::string& list) {
+    std::unordered_map<std::string, std::string> attributes;
+    size_t pos = 0;
+    while (pos < list.size()) {
+        size_t eq = list.find('=', pos);
+        if (eq == std::string::npos) break;
+        std::string name = list.substr(pos, eq - pos);
+        std::string value;
+        if (eq + 1 < list.size() && list[eq + 1] == '"') {
+            size_t close = list.find('"', eq + 2);
+            if (close == std::string::npos) close = list.size();
+            value = list.substr(eq + 2, close - eq - 2);
+            pos = list.find(',', close);
+        } else {
+            size_t comma = list.find(',', eq + 1);
+            value = list.substr(eq + 1, comma == std::string::npos ? std::string::npos : comma - eq - 1);
+            pos = comma;
+        }
+        attributes[name] = value;
+        if (pos == std::string::npos) break;
+        ++pos;
+    }
+    return attributes;
+}
+
+// 每个#EXT-X-STREAM-INF之后的第一个非注释行是该版本的播放列表地址
+static std::vector<M3U8Variant> ParseMasterPlaylist(const std::string& content, const std::string& playlist) {
+    std::vector<M3U8Variant> variants;
+    std::istringstream stream(content);
+    std::string line;
+    bool pending = false;
+    M3U8Variant variant;
+    while (std::getline(stream, line)) {
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+
+        if (line.rfind("#EXT-X-STREAM-INF:", 0) == 0) {
+            auto attributes = ParseAttributes(line.substr(strlen("#EXT-X-STREAM-INF:")));
+            variant = M3U8Variant();
+            variant.bandwidth = strtoull(attributes["BANDWIDTH"].c_str(), nullptr, 10);
+            variant.codecs = attributes["CODECS"];
+            const std::string& resolution = attributes["RESOLUTION"];
+            size_t x = resolution.find('x');
+            if (x != std::string::npos) {
+                variant.width = atoi(resolution.c_str());
+                variant.height = atoi(resolution.c_str() + x + 1);
+            }
+            pending = true;
+        } else if (pending && !line.empty() && line[0] != '#') {
+            variant.url = ResolveUrl(playlist, line);
+            variants.push_back(variant);
+            pending = false;
+        }
+    }
+    return variants;
+}
+
+// 返回播放列表中第一个分片的地址
+static std::string FirstSegmentUrl(const std::string& content) {
+    std::istringstream stream(content);
+    std::string line;
+    while (std::getline(stream, line)) {
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        if (!line.empty() && line[0] != '#') return line;
+    }
+    return {};
+}
+
+double m3u8Downloader::ProbeVariantThroughput(const M3U8Variant& variant) {
+    HttpClient client(variant.url);
+    std::string content = client.GetHtmlFromUrl();
+    std::string segment = FirstSegmentUrl(content);
+    if (segment.empty()) return 0;
+
+    // 不查缓存，测的是网络而不是本地磁盘
+    auto memory = std::make_shared<MemorySink>();
+    SegmentTask task;
+    task.url = ResolveUrl(variant.url, segment);
+    task.outputPath = task.url;     // 仅用于日志
+    task.sink = memory;
+    task.probeBytes = kVariantProbeBytes;
+    task.useCache = false;
+    task.maxRetry = 0;
+    task.job = NewFetchJob();
+    auto start = std::chrono::steady_clock::now();
+    if (!SegmentFetcher::Shared().Submit(std::move(task)).get()) return 0;
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    size_t bytes = memory->Take().size();
+    return seconds > 0 ? bytes * 8.0 / seconds : 0;
+}
+
+const M3U8Variant* m3u8Downloader::SelectVariant() {
+    std::vector<const M3U8Variant*> candidates;
+    for (const auto& variant : variants) {
+        candidates.push_back(&variant);
+    }
+    if (candidates.empty()) return nullptr;
+    std::stable_sort(candidates.begin(), candidates.end(), [](const M3U8Variant* a, const M3U8Variant* b) {
+        return a->bandwidth < b->bandwidth;
+    });
+    // 码率上限以内的版本；全部超出时只能选最低的
+    if (variantPolicy != VariantPolicy::Highest && variantMaxBandwidth > 0) {
+        size_t allowed = 0;
+        while (allowed < candidates.size() && candidates[allowed]->bandwidth <= variantMaxBandwidth) ++allowed;
+        candidates.resize(std::max<size_t>(allowed, 1));
+    }
+    if (variantPolicy != VariantPolicy::Probe || candidates.size() == 1) {
+        return candidates.back();
+    }
+
+    // 从低到高测速，某个版本带宽不够时更高的版本也不会够，停止测速
+    const M3U8Variant* chosen = candidates.front();
+    for (const M3U8Variant* variant : candidates) {
+        double throughput = ProbeVariantThroughput(*variant);
+        std::cout << "[ParseM3U8] Variant " << variant->bandwidth << " bps measured " << static_cast<uint64_t>(throughput) << " bps" << std::endl;
+        if (throughput < variant->bandwidth * kVariantHeadroom) break;
+        chosen = variant;
+    }
+    return chosen;
+}
+
+std::vector<std::unique_ptr<m3u8Downloader>> m3u8Downloader::RaceMirrors(const std::vector<std::string>& urls,
+                                                                         std::chrono::milliseconds timeout) {
+    std::vector<std::unique_ptr<m3u8Downloader>> lines;
+    std::vector<std::future<bool>> parsed;
+    for (const auto& url : urls) {
+        lines.push_back(std::make_unique<m3u8Downloader>(url));
+        m3u8Downloader* line = lines.back().get();
+        parsed.push_back(Executors::Io().Submit([line] { return line->parseM3U8(); }));
+    }
+    // 播放列表请求本身有超时，等待全部解析结束
+    std::vector<std::unique_ptr<m3u8Downloader>> ready;
+    for (size_t i = 0; i < lines.size(); ++i) {
+        if (parsed[i].get()) {
+            ready.push_back(std::move(lines[i]));
+        } else {
+            std::cerr << "[Mirror] Line unavailable: " << urls[i] << std::endl;
+        }
+    }
+    if (ready.size() <= 1) return ready;
+
+    // 所有线路同时测速，跳过本地缓存；每个分片结束的时间在事件循环线程中记录，future返回后读取
+    struct Probe {
+        std::shared_ptr<FetchJob> job;
+        std::vector<std::shared_ptr<MemorySink>> memories;
+        std::vector<std::chrono::steady_clock::time_point> finished;
+        std::vector<std::future<bool>> results;
+        double throughput = 0;      // 比特/秒，0表示测速失败
+    };
+    std::vector<Probe> probes(ready.size());
+    const auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < ready.size(); ++i) {
+        Probe& probe = probes[i];
+        const size_t count = std::min(kMirrorProbeSegments, ready[i]->TsLinks.size());
+        probe.job = ready[i]->NewFetchJob();
+        probe.finished.resize(count);
+        std::vector<SegmentTask> tasks;
+        for (size_t k = 0; k < count; ++k) {
+            probe.memories.push_back(std::make_shared<MemorySink>());
+            SegmentTask task;
+            task.index = k;
+            task.url = ready[i]->TsLinks[k];
+            task.outputPath = task.url;     // 仅用于日志
+            task.sink = probe.memories.back();
+            task.probeBytes = kMirrorProbeBytes;
+            task.useCache = false;
+            task.maxRetry = 0;
+            task.job = probe.job;
+            task.onComplete = [finished = &probe.finished](size_t index, bool) {
+                (*finished)[index] = std::chrono::steady_clock::now();
+            };
+            tasks.push_back(std::move(task));
+        }
+        probe.results = SegmentFetcher::Shared().SubmitBatch(tasks);
+    }
+
+    const auto deadline = start + timeout;
+    for (size_t i = 0; i < ready.size(); ++i) {
+        Probe& probe = probes[i];
+        bool done = !probe.results.empty();
+        for (auto& result : probe.results) {
+            if (result.wait_until(deadline) != std::future_status::ready || !result.get()) {
+                done = false;
+                break;
+            }
+        }
+        if (!done) {
+            // 没测完的线路不再等待，取消后仍作为备用
+            probe.job->Cancel();
+            std::cout << "[Mirror] Probe failed or timed out: " << ready[i]->m3u8Link << std::endl;
+            continue;
+        }
+        uint64_t bytes = 0;
+        auto end = start;
+        for (size_t k = 0; k < probe.memories.size(); ++k) {
+            bytes += probe.memories[k]->Take().size();
+            end = std::max(end, probe.finished[k]);
+        }
+        double seconds = std::chrono::duration<double>(end - start).count();
+        probe.throughput = seconds > 0 ? bytes * 8.0 / seconds : 0;
+        std::cout << "[Mirror] " << ready[i]->m3u8Link << " measured " << static_cast<uint64_t>(probe.throughput) << " bps" << std::endl;
+    }
+    // 回调引用了probes，返回前等待被取消的分片全部结束
+    for (auto& probe : probes) {
+        probe.job->Wait();
+    }
+
+    std::vector<size_t> order(ready.size());
+    for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return probes[a].throughput > probes[b].throughput;
+    });
+    std::vector<std::unique_ptr<m3u8Downloader>> ranked;
+    for (size_t i : order) {
+        ranked.push_back(std::move(ready[i]));
+    }
+    std::cout << "[Mirror] Use fastest line: " << ranked.front()->m3u8Link << std::endl;
+    return ranked;
+}
+
+bool m3u8Downloader::parseM3U8() {
+    playlistUrl = m3u8Link;
+    std::string content;
+    for (int depth = 0; ; ++depth) {
+        HttpClient client(playlistUrl);
+        content = client.GetHtmlFromUrl();
+
+        if (content.empty()) {
+            std::cerr << "[ParseM3U8] Failed to download m3u8 file: " << playlistUrl << std::endl;
+            return false;
+        }
+        // 失效线路常返回错误页面，不能把其中的每一行当作分片
+        if (content.rfind("#EXTM3U", 8) == std::string::npos) {
+            std::cerr << "[ParseM3U8] Not a m3u8 playlist: " << playlistUrl << std::endl;
+            return false;
+        }
+        // 媒体播放列表，直接解析分片
+        if (content.find("#EXT-X-STREAM-INF:") == std::string::npos) break;
+
+        if (depth >= kMaxPlaylistDepth) {
+            std::cerr << "[ParseM3U8] Too many nested master playlists: " << m3u8Link << std::endl;
+            return false;
+        }
+        variants = ParseMasterPlaylist(content, playlistUrl);
+        const M3U8Variant* variant = SelectVariant();
+        if (!variant) {
+            std::cerr << "[ParseM3U8] No variant in master playlist: " << playlistUrl << std::endl;
+            return false;
+        }
+        std::cout << "[ParseM3U8] Select variant " << variant->bandwidth << " bps";
+        if (variant->height > 0) std::cout << " " << variant->width << "x" << variant->height;
+        std::cout << " of " << variants.size() << ": " << variant->url << std::endl;
+        playlistUrl = variant->url;
+    }
 
     std::istringstream stream(content);
     std::string line;
@@ -302,14 +738,13 @@ bool m3u8Downloader::parseM3U8() {
         if (line.rfind("#EXT-X-KEY", 0) == 0) {
             parseKey(line);
         }
+        else if (line.rfind("#EXT-X-MEDIA-SEQUENCE:", 0) == 0) {
+            // 未指定IV时按媒体序列号计算每个分片的IV
+            mediaSequence = strtoull(line.c_str() + strlen("#EXT-X-MEDIA-SEQUENCE:"), nullptr, 10);
+        }
         else if (!line.empty() && line[0] != '#') {
-            // ts 文件链接
-            std::string tsUrl = line;
-            if (tsUrl.find("http") != 0) {
-                // 相对路径补全
-                tsUrl = baseUrl + "/" + tsUrl;
-            }
-            TsLinks.emplace_back(tsUrl);
+            // ts 文件链接，相对路径补全
+            TsLinks.emplace_back(ResolveUrl(playlistUrl, line));
         }
     }
 
@@ -321,6 +756,10 @@ void m3u8Downloader::printInfo () const {
     std::cout << "[PrintInfo] URI: " << uri_ << std::endl;
     std::cout << "[PrintInfo] IV: " << iv_ << std::endl;
     std::cout << "[PrintInfo] Total TS files: " << TsLinks.size() << std::endl;
+    for (const auto& variant : variants) {
+        std::cout << "[PrintInfo] Variant: " << variant.bandwidth << " bps " << variant.width << "x" << variant.height
+                  << " " << variant.codecs << " " << variant.url << (variant.url == playlistUrl ? " (selected)" : "") << std::endl;
+    }
 }
 
 void m3u8Downloader::parseKey(const std::string& line) {
@@ -338,8 +777,8 @@ void m3u8Downloader::parseKey(const std::string& line) {
         iv_ = match[1];
 
     // URI 如果是相对路径则补全
-    if (!uri_.empty() && uri_.find("http") != 0) {
-        uri_ = baseUrl + "/" + uri_;
+    if (!uri_.empty()) {
+        uri_ = ResolveUrl(playlistUrl, uri_);
     }
 }
 
@@ -354,7 +793,7 @@ std::vector<unsigned char> m3u8Downloader::FetchKey() {
     return std::vector<unsigned char>(keyStr.begin(), keyStr.end()); // 转二进制
 }
 
-std::vector<unsigned char> m3u8Downloader::HexToBytes(const std::string& hex) {
+std::vector<unsigned char> m3u8Downloader::HexToBytes(const std::string& hex) const {
     std::vector<unsigned char> bytes;
     for (size_t i = 2; i < hex.length(); i += 2) { // 去掉前缀 0x
         std::string byteString = hex.substr(i, 2);
@@ -365,75 +804,285 @@ std::vector<unsigned char> m3u8Downloader::HexToBytes(const std::string& hex) {
 }
 
 // AES-128-CBC 解密单个 TS 文件
-bool m3u8Downloader::DecryptTsFile(const std::filesystem::path& inputFile, const std::filesystem::path& outputFile) {
+// 按大块读入后交给EVP解密，充分利用OpenSSL的AES-NI流水线实现；IV由调用方按分片传入，不共享状态
+bool m3u8Downloader::DecryptTsFile(const std::filesystem::path& inputFile, const std::filesystem::path& outputFile, const std::vector<unsigned char>& segmentIv) const {
     // 仅仅只是打开文件，当开始read的时候才开始读区数据
     std::ifstream ifs(inputFile, std::ios::binary);
     std::ofstream ofs(outputFile, std::ios::binary);
     if (!ifs || !ofs) return false;
 
-    AES_KEY aesKey;
-    AES_set_decrypt_key(key.data(), 128, &aesKey);
+    CbcDecryptor decryptor;
+    if (!decryptor.Init(key, segmentIv)) return false;
+
+    std::vector<unsigned char> inbuf(kDecryptChunkSize);
+    std::vector<unsigned char> outbuf;
+    outbuf.reserve(kDecryptChunkSize + 16);
+    while (ifs.read(reinterpret_cast<char*>(inbuf.data()), inbuf.size()) || ifs.gcount() > 0) {
+        outbuf.clear();
+        if (!decryptor.Update(inbuf.data(), ifs.gcount(), outbuf)) return false;
+        ofs.write(reinterpret_cast<char*>(outbuf.data()), outbuf.size());
+    }
+    // TS 文件不是 AES-PKCS7，剩余不足 16 字节的部分无需解密，直接写原文
+    outbuf.clear();
+    decryptor.Finish(outbuf);
+    ofs.write(reinterpret_cast<char*>(outbuf.data()), outbuf.size());
+    return static_cast<bool>(ofs);
+}
 
-    std::vector<unsigned char> inbuf(16);
-    std::vector<unsigned char> outbuf(16);
-    if (iv.empty()) {
-        iv = HexToBytes("0x" + iv_);    // 转换为子节序
+// 校验解密所需的key和iv，需在启动下载前调用
+bool m3u8Downloader::PrepareDecrypt() const {
+    if (!IsEncrypted()) return true;
+    if (key.size() != 16) {
+        std::cerr << "[Key] Invalid AES-128 key, size: " << key.size() << std::endl;
+        return false;
+    }
+    if (!iv_.empty() && iv_.size() != 32) {
+        std::cerr << "[Key] Invalid AES-128 IV: " << iv_ << std::endl;
+        return false;
     }
-    std::vector<unsigned char> current_iv = iv;
-    while (ifs.read(reinterpret_cast<char*>(inbuf.data()), 16) || ifs.gcount() > 0) {
-        size_t bytesRead = ifs.gcount();
-        // AES CBC 只能解密满块的部分
-        if (bytesRead == 16) {
-            AES_cbc_encrypt(inbuf.data(), outbuf.data(), 16, &aesKey, current_iv.data(), AES_DECRYPT);
-            ofs.write(reinterpret_cast<char*>(outbuf.data()), 16);
+    return true;
+}
+
+// 计算第index个分片的IV
+// 播放列表指定了IV时所有分片共用，否则按HLS规范使用分片的媒体序列号（大端序，128位）
+std::vector<unsigned char> m3u8Downloader::SegmentIV(size_t index) const {
+    if (!iv_.empty()) {
+        return HexToBytes("0x" + iv_);    // 转换为子节序
+    }
+    std::vector<unsigned char> bytes(16, 0);
+    uint64_t sequence = mediaSequence + index;
+    for (int i = 15; i >= 8; --i) {
+        bytes[i] = static_cast<unsigned char>(sequence & 0xFF);
+        sequence >>= 8;
+    }
+    return bytes;
+}
+
+// 加密视频在下载时直接解密，未加密视频原样写入
+std::shared_ptr<SegmentSink> m3u8Downloader::MakeSegmentSink(std::shared_ptr<SegmentSink> inner, size_t index) const {
+    if (!IsEncrypted()) return inner;
+    return std::make_shared<DecryptSink>(std::move(inner), key, SegmentIV(index));
+}
+
+// 解密TS文件中[offset, offset + length)这一段，输出写到outputFile的相同位置
+// CBC解密每个块只依赖前一个密文块，因此以offset前一个密文块作为IV即可独立解密任意对齐的分段
+bool m3u8Downloader::DecryptTsRange(const std::filesystem::path& inputFile, const std::filesystem::path& outputFile,
+                                    uint64_t offset, uint64_t length, const std::vector<unsigned char>& segmentIv) const {
+    int in = open(inputFile.c_str(), O_RDONLY);
+    if (in == -1) return false;
+    int out = open(outputFile.c_str(), O_WRONLY);
+    if (out == -1) {
+        close(in);
+        return false;
+    }
+
+    bool ok = true;
+    std::vector<unsigned char> rangeIv = segmentIv;
+    if (offset >= 16) {
+        ok = pread(in, rangeIv.data(), 16, offset - 16) == 16;
+    }
+
+    CbcDecryptor decryptor;
+    ok = ok && decryptor.Init(key, rangeIv);
+
+    std::vector<unsigned char> inbuf(kDecryptChunkSize);
+    std::vector<unsigned char> outbuf;
+    outbuf.reserve(kDecryptChunkSize + 16);
+    uint64_t readPos = offset;
+    uint64_t writePos = offset;
+    const uint64_t end = offset + length;
+    while (ok && readPos < end) {
+        size_t want = static_cast<size_t>(std::min<uint64_t>(inbuf.size(), end - readPos));
+        ssize_t n = pread(in, inbuf.data(), want, readPos);
+        if (n <= 0) {
+            ok = false;
+            break;
         }
-        else {
-            // TS 文件不是 AES-PKCS7，剩余不足 16 字节的部分无需解密，直接写原文
-            ofs.write(reinterpret_cast<char*>(inbuf.data()), bytesRead);
+        readPos += n;
+
+        outbuf.clear();
+        ok = decryptor.Update(inbuf.data(), n, outbuf);
+        if (readPos == end) {
+            decryptor.Finish(outbuf);
+        }
+        if (ok && !outbuf.empty()) {
+            ok = pwrite(out, outbuf.data(), outbuf.size(), writePos) == static_cast<ssize_t>(outbuf.size());
+            writePos += outbuf.size();
         }
     }
-    return true;
+
+    close(in);
+    close(out);
+    return ok;
 }
 
 bool m3u8Downloader::DecryptAllTs(std::function<void(int)> progressCallBack) {
+    // 分片已在下载时解密
+    if (segmentsDecrypted) {
+        if (progressCallBack) progressCallBack(90);
+        return true;
+    }
+
     if (key.empty()) {
         key = FetchKey();
     }
+    if (!PrepareDecrypt()) {
+        return false;
+    }
 
     decryptedFiles.clear();
-    ThreadPool pool(logical_cores >> 1);
-    std::vector<std::future<std::string>> futures;
+    // 解密在进程级的cpu执行器中进行，读写文件交给I/O执行器
+    Executor& cpu = Executors::Cpu();
+    Executor& io = Executors::Io();
+    std::vector<std::future<void>> futures;
+    // 读盘快于解密时限制同时在内存中的分片数，避免把整个视频读进内存
+    const size_t maxInMemory = cpu.Size() * 4;
+    size_t inMemory = 0;
+    std::mutex slotMutex;
+    std::condition_variable slotCond;
+    auto releaseSlot = [&] {
+        {
+            std::lock_guard<std::mutex> lock(slotMutex);
+            --inMemory;
+        }
+        slotCond.notify_one();
+    };
+
+    std::atomic<size_t> doneCount{0};
+    auto onFileDone = [&](bool ok, const std::filesystem::path& inputPath) {
+        if (!ok) {
+            std::cerr << "[Decrypt] Failed to decrypt " << inputPath << std::endl;
+            return;
+        }
+        //std::cout << "[Info] Decrypted " << inputFile << std::endl;
+        doneCount.fetch_add(1);
+        if(progressCallBack && doneCount.load() % 5 == 0) {
+            progressCallBack(60 + static_cast<int>((doneCount.load() + 1) * 30.0 / tsFiles.size()));
+        }
+        if (doneCount.load() == tsFiles.size()) {
+            progressCallBack(90);
+        }
+    };
 
-    std::atomic<int> doneCount{0};
     for (size_t i = 0; i < tsFiles.size(); ++i) {
         std::filesystem::path inputPath(tsFiles[i]);
         // 不要使用字符串拼接，直接使用std::fileSystem::path
         std::string outputFile = inputPath.parent_path().append("decrypt_" + std::to_string(i) + ".ts");
         decryptedFiles.emplace_back(outputFile);
+        const std::vector<unsigned char> segmentIv = SegmentIV(i);
+
+        std::error_code ec;
+        uint64_t fileSize = std::filesystem::file_size(inputPath, ec);
+        if (ec) {
+            // 分片不存在或无法访问，不能拿出错时的返回值去分配内存
+            onFileDone(false, inputPath);
+            continue;
+        }
+        if (parallelDecryptThreshold > 0 && fileSize >= parallelDecryptThreshold) {
+            // 大分片切成多段并行解密，各段直接写入输出文件的对应位置
+            std::ofstream(outputFile, std::ios::binary).close();
+            std::filesystem::resize_file(outputFile, fileSize, ec);
+            if (ec) {
+                onFileDone(false, inputPath);
+                continue;
+            }
 
-        futures.emplace_back(pool.enqueue([=, &doneCount]() {
-            bool ok = DecryptTsFile(inputPath.c_str(), outputFile);
+            uint64_t shards = (fileSize + kDecryptShardSize - 1) / kDecryptShardSize;
+            auto remaining = std::make_shared<std::atomic<uint64_t>>(shards);
+            auto shardsOk = std::make_shared<std::atomic<bool>>(true);
+            for (uint64_t shard = 0; shard < shards; ++shard) {
+                uint64_t offset = shard * kDecryptShardSize;
+                uint64_t length = std::min<uint64_t>(kDecryptShardSize, fileSize - offset);
+                futures.emplace_back(cpu.Submit([=, &onFileDone]() {
+                    bool ok = false;
+                    try {
+                        ok = DecryptTsRange(inputPath, outputFile, offset, length, segmentIv);
+                        int count = 0;
+                        while (!ok && count++ < 3) {
+                            ok = DecryptTsRange(inputPath, outputFile, offset, length, segmentIv);
+                            std::cerr << "[Decrypt] Retry " << std::to_string(count) << " times decrypt " << inputPath << " @" << offset << std::endl;
+                        }
+                    } catch (const std::exception& e) {
+                        std::cerr << "[Decrypt] " << inputPath << " @" << offset << ": " << e.what() << std::endl;
+                        ok = false;
+                    }
+                    if (!ok) shardsOk->store(false);
+                    // 最后一段完成时整个分片才算完成
+                    if (remaining->fetch_sub(1) == 1) {
+                        onFileDone(shardsOk->load(), inputPath);
+                    }
+                }));
+            }
+            continue;
+        }
 
-            int count = 0;
-            while (!ok && count++ < 3) {
-                ok = DecryptTsFile(inputPath.c_str(), outputFile);
-                std::cerr << "[Decrypt] Retry " << std::to_string(count) << " times decrypt " << inputPath << std::endl;
+        {
+            std::unique_lock<std::mutex> lock(slotMutex);
+            slotCond.wait(lock, [&] { return inMemory < maxInMemory; });
+            ++inMemory;
+        }
+        // 普通分片分三个阶段接力：I/O执行器读入 -> cpu执行器解密 -> I/O执行器写出，解密线程不会阻塞在磁盘上
+        // 任何阶段抛出异常（如内存不足）都按该分片失败结束，释放名额并完成promise，不会让等待的一方卡住
+        auto done = std::make_shared<std::promise<void>>();
+        futures.emplace_back(done->get_future());
+        auto finish = [=, &onFileDone, &releaseSlot](bool ok) {
+            releaseSlot();
+            onFileDone(ok, inputPath);
+            done->set_value();
+        };
+        auto fail = [=](const std::exception& e) {
+            std::cerr << "[Decrypt] " << inputPath << ": " << e.what() << std::endl;
+            finish(false);
+        };
+        io.Post([=, &cpu, &io]() {
+            std::shared_ptr<std::vector<unsigned char>> data;
+            bool read = false;
+            try {
+                data = std::make_shared<std::vector<unsigned char>>(fileSize);
+                std::ifstream ifs(inputPath, std::ios::binary);
+                read = ifs && ifs.read(reinterpret_cast<char*>(data->data()), data->size());
+            } catch (const std::exception& e) {
+                fail(e);
+                return;
             }
 
-            if (!ok) {
-                std::cerr << "[Decrypt] Failed to decrypt " << inputPath << std::endl;
-            } else {
-                //std::cout << "[Info] Decrypted " << inputFile << std::endl;
-                doneCount.fetch_add(1);
-                if(progressCallBack && doneCount.load() % 5 == 0) {
-                    progressCallBack(60 + static_cast<int>((doneCount.load() + 1) * 30.0 / tsFiles.size()));
+            cpu.Post([=, &io]() {
+                auto plain = std::make_shared<std::vector<unsigned char>>();
+                bool decrypted = false;
+                try {
+                    plain->reserve(data->size());
+                    CbcDecryptor decryptor;
+                    decrypted = read && decryptor.Init(key, segmentIv) &&
+                                decryptor.Update(data->data(), data->size(), *plain);
+                    if (decrypted) decryptor.Finish(*plain);
+                } catch (const std::exception& e) {
+                    fail(e);
+                    return;
                 }
-                if (doneCount.load() == tsFiles.size()) {
-                    progressCallBack(90);
-                }
-            }
-            return outputFile;
-        }));
+                data->clear();
+                data->shrink_to_fit();
+
+                io.Post([=]() {
+                    bool ok = false;
+                    try {
+                        std::ofstream ofs(outputFile, std::ios::binary);
+                        ok = decrypted && ofs.write(reinterpret_cast<const char*>(plain->data()), plain->size());
+                        ofs.close();
+                        ok = ok && !ofs.fail();
+
+                        int count = 0;
+                        while (!ok && count++ < 3) {
+                            ok = DecryptTsFile(inputPath.c_str(), outputFile, segmentIv);
+                            std::cerr << "[Decrypt] Retry " << std::to_string(count) << " times decrypt " << inputPath << std::endl;
+                        }
+                    } catch (const std::exception& e) {
+                        std::cerr << "[Decrypt] " << inputPath << ": " << e.what() << std::endl;
+                        ok = false;
+                    }
+                    finish(ok);
+                });
+            });
+        });
     }
 
     // 等待所有解密完成
@@ -449,50 +1098,434 @@ bool m3u8Downloader::DecryptAllTs(std::function<void(int)> progressCallBack) {
 }
 
 bool m3u8Downloader::MergeToVideo(const std::filesystem::path& outputFile, std::function<void(int)> progressCallBack, m3u8Downloader::VideoFormat format) {
-    std::ofstream ofs(outputFile, std::ios::binary);
-    if (!ofs) {
-        std::cerr << "[Merge] Cannot open output file: " << outputFile << std::endl;
-        return false;
+    // 输出MP4时按顺序把解密后的分片直接送入转封装器，不先合并出完整的TS再读一遍；
+    // 含有不支持的编码时回退为合并TS后交给ffmpeg转换
+    if (format == m3u8Downloader::VideoFormat::MP4) {
+        std::filesystem::path mp4Path = outputFile;
+        mp4Path.replace_extension(Format2String(format));
+        if (RemuxTsFilesToMp4(decryptedFiles, mp4Path)) {
+            std::cout << "[Merge] All TS segments remuxed. " << mp4Path << std::endl;
+            MarkCompleted();
+            progressCallBack(100);
+            return true;
+        }
+        std::filesystem::remove(mp4Path);
+        std::cerr << "[Remux] Native remux failed, falling back to ffmpeg: " << outputFile << std::endl;
     }
 
     // 按照解密后的顺序合并，避免乱序
-    // 合并占50%，转换占50%
-    for (const auto& decryptedFile : decryptedFiles) {
-        std::ifstream ifs(decryptedFile, std::ios::binary);
-        if (!ifs) {
-            std::cerr << "[Merge] Cannot open decrypted file: " << decryptedFile << std::endl;
+    // 分片数据由内核直接拷贝到输出文件，不经过用户态缓冲区
+    // 有任务日志时从上一次合并的检查点继续，输出文件比检查点短说明检查点之后的数据不可信，从头合并
+    size_t startIndex = 0;
+    uint64_t startOffset = 0;
+    std::function<void(size_t, uint64_t)> onCheckpoint;
+    if (journal) {
+        std::error_code ec;
+        uint64_t existing = std::filesystem::file_size(outputFile, ec);
+        if (!ec && journal->MergedCount() > 0 && journal->MergedCount() <= decryptedFiles.size() &&
+            existing >= journal->MergedBytes()) {
+            startIndex = journal->MergedCount();
+            startOffset = journal->MergedBytes();
+            std::cout << "[Merge] Resume from segment " << startIndex << " (" << startOffset << " bytes)" << std::endl;
+        }
+        onCheckpoint = [this](size_t count, uint64_t bytes) { journal->MarkMerged(count, bytes); };
+    }
+    if (!ConcatFiles(decryptedFiles, outputFile, startIndex, startOffset, onCheckpoint)) {
+        return false;
+    }
+
+    if (format != m3u8Downloader::VideoFormat::TS) {
+        progressCallBack(95);
+        ConvertFormat(outputFile, format);
+    }
+    MarkCompleted();
+    progressCallBack(100);
+
+    return true;
+}
+
+// 将合并好的TS转换为目标容器格式，转换后删除TS
+// MP4在写出分片的同时已在进程内转封装，只有含不支持的编码时才会走到这里；MKV、MOV同样交给ffmpeg
+void m3u8Downloader::ConvertFormat(const std::filesystem::path& tsPath, m3u8Downloader::VideoFormat format) {
+    std::filesystem::path transformed = tsPath;
+    //replace_extension操作会修改原对象
+    transformed.replace_extension(Format2String(format));
+    std::filesystem::remove(transformed);
+    // 使用ffmpeg进行容器转换(允许路径中包含空白字符)
+    // 可以使用caffeinate -i 命令来制定执行时避免休眠而中断
+    char outputpath[2048] = {0};
+    snprintf(outputpath, sizeof(outputpath), "ffmpeg -y -i \"%s\" -c copy \"%s\"", tsPath.c_str(), transformed.c_str());
+    std::cout << "[FFmpeg] " << outputpath << std::endl;
+    system(outputpath); // 同步执行
+    // 删除默认TS格式
+    std::filesystem::remove(tsPath);
+}
+
+// 流式模式：下载 -> 解密 -> 按序追加在内存中以流水线方式完成，中间分片不落盘，只有最终文件写入磁盘
+// 正在下载、等待解密以及等待写入的分片总数不超过streamWindow，总字节数不超过streamWindowBytes，内存占用有上限
+bool m3u8Downloader::StreamToVideo(const std::filesystem::path& outputFile, std::function<void(int)> progressCallBack, m3u8Downloader::VideoFormat format) {
+    if (key.empty()) {
+        key = FetchKey();
+    }
+
+    if (TsLinks.empty()) {
+        std::cerr << "[Stream] No TS segments to download!" << std::endl;
+        return false;
+    }
+    if (!PrepareDecrypt()) {
+        return false;
+    }
+
+    std::filesystem::path dirPath = outputFile.parent_path();
+    if (ProbeRepeatVideo(dirPath)) {
+        RemoveRepeatVideo(dirPath);
+        if (progressCallBack) progressCallBack(100);
+        return true;
+    }
+    std::filesystem::create_directories(dirPath);
+    // 输出MP4时明文TS直接送入转封装器，不再先写出完整的TS再转换
+    std::filesystem::path mp4Path = outputFile;
+    mp4Path.replace_extension(Format2String(m3u8Downloader::VideoFormat::MP4));
+    std::unique_ptr<TsRemuxer> remuxer;
+    std::ofstream ofs;
+    if (format == m3u8Downloader::VideoFormat::MP4) {
+        remuxer = std::make_unique<TsRemuxer>(mp4Path);
+        if (!remuxer->IsOpen()) {
+            return false;
+        }
+    } else {
+        ofs.open(outputFile, std::ios::binary);
+        if (!ofs) {
+            std::cerr << "[Stream] Cannot open output file: " << outputFile << std::endl;
             return false;
         }
+    }
+
+    std::cout << "[Stream] Start streaming " << TsLinks.size() << " TS segments to " << outputFile << std::endl;
+
+    const size_t total = TsLinks.size();
+    auto cancelled = std::make_shared<std::atomic<bool>>(false);
+    // 已解密、等待按序写入的分片
+    std::mutex readyMutex;
+    std::condition_variable readyCond;
+    std::map<size_t, std::vector<unsigned char>> ready;
+    bool failed = false;
+    std::array<std::string, 3> before3Hashes;
 
-        // ofs << ifs.rdbuf();  // 直接读区整个文件内存占用较大，按分块（8K）处理
-        char buf[8192];
-        // read()函数只有在读取满缓冲区后才回返回true，这会导致最后一部分未被写入
-        while (ifs) {
-            ifs.read(buf, sizeof(buf));
-            ofs.write(buf, ifs.gcount());
+    SegmentFetcher& fetcher = SegmentFetcher::Shared();
+    auto job = NewFetchJob();
+    // 只提前提交一个窗口的分片，按总数参与调度排序
+    job->SetExpectedSegments(total);
+    // 先于ready等局部变量析构：退出前取消并等待本任务的分片全部结束，之后不会再有回调访问它们
+    struct JobGuard {
+        std::shared_ptr<FetchJob> job;
+        ~JobGuard() {
+            job->Cancel();
+            job->Wait();
+        }
+    } guard{job};
+
+    auto submit = [&](size_t i) {
+        auto memory = std::make_shared<MemorySink>();
+        SegmentTask task;
+        task.index = i;
+        task.url = TsLinks[i];
+        task.outputPath = dirPath / ("segment_" + std::to_string(i) + ".ts"); // 仅用于日志
+        // 在curl写回调中边收边解密，分片下载完成时明文已经就绪
+        task.sink = MakeSegmentSink(memory, i);
+        task.cancelled = cancelled;
+        task.job = job;
+        task.onComplete = [&, memory](size_t index, bool success) {
+            std::lock_guard<std::mutex> lock(readyMutex);
+            if (!success) {
+                failed = true;
+            } else {
+                ready.emplace(index, memory->Take());
+            }
+            readyCond.notify_one();
+        };
+        fetcher.Submit(std::move(task));
+    };
+
+    // 分片大小在下载前未知，按已写出分片的平均大小估算窗口内的字节数；第一片写出前只提交少量分片
+    size_t submitted = 0;
+    uint64_t writtenBytes = 0;
+    auto refill = [&](size_t written) {
+        while (submitted < total) {
+            const size_t inFlight = submitted - written;
+            if (inFlight > 0) {
+                if (inFlight >= streamWindow) break;
+                if (written == 0 ? inFlight >= kStreamInitialWindow
+                                 : (inFlight + 1) * (writtenBytes / written) > streamWindowBytes) break;
+            }
+            submit(submitted++);
+        }
+    };
+    refill(0);
+
+    bool success = true;
+    for (size_t next = 0; next < total; ++next) {
+        std::vector<unsigned char> data;
+        {
+            std::unique_lock<std::mutex> lock(readyMutex);
+            readyCond.wait(lock, [&] { return failed || ready.count(next) > 0; });
+            if (failed) {
+                success = false;
+                break;
+            }
+            auto it = ready.find(next);
+            data = std::move(it->second);
+            ready.erase(it);
+        }
+
+        // 使用前3片计算指纹
+        if (next < 3) {
+            before3Hashes[next] = sha256(data);
+        }
+        bool written;
+        if (remuxer) {
+            written = remuxer->Write(data.data(), data.size());
+            // PMT在第一个分片中，含有不支持的编码时改为写TS，最后交给ffmpeg转换
+            if (written && next == 0 && remuxer->Unsupported()) {
+                remuxer.reset();
+                std::filesystem::remove(mp4Path);
+                std::cout << "[Stream] Stream not remuxable in-process, writing TS instead" << std::endl;
+                ofs.open(outputFile, std::ios::binary);
+            }
+        }
+        if (!remuxer) {
+            written = static_cast<bool>(ofs.write(reinterpret_cast<const char*>(data.data()), data.size()));
+        }
+        if (!written) {
+            std::cerr << "[Stream] Write failed: " << outputFile << std::endl;
+            success = false;
+            break;
+        }
+        // 写出一片后按新的平均大小补充窗口
+        writtenBytes += data.size();
+        refill(next + 1);
+
+        // 前3片写入后即可计算指纹判断是否重复
+        if (next == 2) {
+            std::string combined;
+            combined.reserve(64 * 3);
+            for (auto& hash: before3Hashes) {
+                combined.append(hash);
+            }
+            std::string Fingerprint = sha256(std::vector<unsigned char>(combined.begin(), combined.end()));
+            if (CheckRepeatVideo(Fingerprint, dirPath)) {
+                cancelled->store(true, std::memory_order_release);
+                ofs.close();
+                remuxer.reset();
+                progressCallBack(100);
+                RemoveRepeatVideo(dirPath);
+                return true;
+            }
+        }
+
+        if (progressCallBack && (next + 1) % 5 == 0) {
+            progressCallBack(20 + static_cast<int>((next + 1) * 75.0 / total));
         }
-        ifs.close();
     }
     ofs.close();
+    if (success && remuxer && !remuxer->Finish()) {
+        std::cerr << "[Stream] Remux failed: " << mp4Path << std::endl;
+        success = false;
+    }
 
-    if (format != m3u8Downloader::VideoFormat::TS) {
+    if (!success) {
+        cancelled->store(true, std::memory_order_release);
+        std::filesystem::remove(remuxer ? mp4Path : outputFile);
+        std::cerr << "[Stream] Failed to stream video: " << outputFile << std::endl;
+        return false;
+    }
+
+    // 下载完成后及时释放TsLinks，减少内存占用
+    TsLinks.clear();
+    std::cout << "[Stream] All TS segments merged. " << (remuxer ? mp4Path : outputFile) << std::endl;
+
+    if (!remuxer && format != m3u8Downloader::VideoFormat::TS) {
         progressCallBack(95);
-        std::filesystem::path tsPath = outputFile;
-        std::filesystem::path transformed = tsPath;
-        //replace_extension操作会修改原对象
-        transformed.replace_extension(Format2String(format));
-        std::filesystem::remove(transformed);
-        // 使用ffmpeg进行容器转换(允许路径中包含空白字符)
-        // 可以使用caffeinate -i 命令来制定执行时避免休眠而中断
-        char outputpath[2048] = {0};
-        snprintf(outputpath, sizeof(outputpath), "ffmpeg -y -i \"%s\" -c copy \"%s\"", outputFile.c_str(), transformed.c_str());
-        std::cout << "[FFmpeg] " << outputpath << std::endl;
-        system(outputpath); // 同步执行
-        // 删除默认TS格式
-        std::filesystem::remove(tsPath);
+        ConvertFormat(outputFile, format);
     }
+    MarkCompleted();
     progressCallBack(100);
+    return true;
+}
+
+// 定位写模式：各分片下载完成后直接写到输出文件的最终偏移处（可乱序），不产生中间文件也不需要合并，
+// 最后一个分片完成时输出文件即已完成。分片大小不提前用HEAD获取，下载请求的响应头到达时即确定后面分片的位置
+// （见PositionalLayout），位置还不确定的分片暂存在内存中
+bool m3u8Downloader::DownloadToFile(const std::filesystem::path& outputFile, std::function<void(int)> progressCallBack, m3u8Downloader::VideoFormat format) {
+    if (key.empty()) {
+        key = FetchKey();
+    }
+
+    if (TsLinks.empty()) {
+        std::cerr << "[Positional] No TS segments to download!" << std::endl;
+        return false;
+    }
+    if (!PrepareDecrypt()) {
+        return false;
+    }
 
+    if (ProbeRepeatVideo(outputFile.parent_path())) {
+        RemoveRepeatVideo(outputFile.parent_path());
+        if (progressCallBack) progressCallBack(100);
+        return true;
+    }
+
+    const size_t total = TsLinks.size();
+    SegmentFetcher& fetcher = SegmentFetcher::Shared();
+    auto job = NewFetchJob();
+
+    std::filesystem::path dirPath = outputFile.parent_path();
+    std::filesystem::create_directories(dirPath);
+    int fd = open(outputFile.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        std::cerr << "[Positional] Cannot prepare output file: " << outputFile << std::endl;
+        return false;
+    }
+    auto layout = std::make_shared<PositionalLayout>(fd, total);
+
+    std::cout << "[Positional] Start downloading " << total << " TS segments to " << outputFile << std::endl;
+
+    std::atomic<int> doneCount = 0;
+    std::atomic<bool> failed(false);
+    auto cancelled = std::make_shared<std::atomic<bool>>(false);
+    // 前3片的数据可能还在内存中等待写入，在写入时直接计算哈希，不从输出文件读回
+    std::array<std::shared_ptr<ChecksumSink>, 3> before3Sinks;
+    std::array<std::string, 3> before3Hashes;
+    size_t hashedCount = 0;
+    std::mutex hashMutex;
+    // 只在最后一个哈希算完时查一次索引
+    auto checkFingerprint = [&](size_t index) {
+        std::string combined;
+        {
+            std::lock_guard<std::mutex> locker(hashMutex);
+            before3Hashes[index] = before3Sinks[index]->Digest();
+            if (++hashedCount == before3Hashes.size()) {
+                combined.reserve(64 * 3);
+                for (auto& hash: before3Hashes) {
+                    combined.append(hash);
+                }
+            }
+        }
+        if (!combined.empty()) {
+            std::string Fingerprint = sha256(std::vector<unsigned char>(combined.begin(), combined.end()));
+            if (CheckRepeatVideo(Fingerprint, dirPath)) {
+                cancelled->store(true, std::memory_order_release);
+            }
+        }
+    };
+    // 查索引需要加文件锁并读写索引文件，交给cpu执行器，不占用下载引擎的事件循环
+    std::array<std::future<void>, 3> fingerprintTasks;
+    std::vector<SegmentTask> tasks;
+    tasks.reserve(total);
+    for (size_t i = 0; i < total; ++i) {
+        SegmentTask task;
+        task.index = i;
+        task.url = TsLinks[i];
+        task.outputPath = outputFile;   // 仅用于日志
+        std::shared_ptr<SegmentSink> sink = std::make_shared<PositionalSink>(layout, fd, i);
+        if (i < before3Sinks.size()) {
+            before3Sinks[i] = std::make_shared<ChecksumSink>(sink);
+            sink = before3Sinks[i];
+        }
+        task.sink = MakeSegmentSink(sink, i);
+        task.cancelled = cancelled;
+        task.job = job;
+        // 回调均在下载引擎的事件循环线程中执行
+        task.onComplete = [&](size_t index, bool success) {
+            if (cancelled->load(std::memory_order_acquire)) return;
+            if (!success) {
+                std::cerr << "[Positional] " << index << " TS failed" << std::endl;
+                failed.store(true);
+                cancelled->store(true, std::memory_order_release);
+                return;
+            }
+
+            if (index < fingerprintTasks.size()) {
+                fingerprintTasks[index] = Executors::Cpu().Submit([&checkFingerprint, index] {
+                    checkFingerprint(index);
+                });
+            }
+
+            doneCount.fetch_add(1, std::memory_order_relaxed);
+            if (progressCallBack && doneCount.load() % 5 == 0) {
+                progressCallBack(20 + static_cast<int>(doneCount.load() * 75.0 / total));
+            }
+        };
+        tasks.push_back(std::move(task));
+    }
+    std::vector<std::future<bool>> results = fetcher.SubmitBatch(tasks);
+
+    // 输出MP4时按分片顺序等待，每个分片完成后立即从输出文件读回（仍在页缓存中）送入转封装器，与下载同时进行，
+    // 最后一个分片完成时MP4也已基本写完，不需要在最后再完整读一遍TS。
+    // 分片i成功时前面的分片都已成功、大小都已确定，它的数据一定已经写入输出文件
+    std::filesystem::path mp4Path = outputFile;
+    mp4Path.replace_extension(Format2String(m3u8Downloader::VideoFormat::MP4));
+    std::unique_ptr<TsRemuxer> remuxer;
+    if (format == m3u8Downloader::VideoFormat::MP4) {
+        remuxer = std::make_unique<TsRemuxer>(mp4Path);
+        if (!remuxer->IsOpen()) remuxer.reset();
+    }
+    std::vector<unsigned char> buffer;
+    for (size_t i = 0; i < total; ++i) {
+        const bool success = results[i].get();
+        if (!remuxer) continue;
+        uint64_t offset = 0;
+        int64_t size = -1;
+        bool fed = success && layout->Locate(i, offset, size) && size >= 0;
+        if (fed) {
+            buffer.resize(static_cast<size_t>(size));
+            fed = pread(fd, buffer.data(), buffer.size(), static_cast<off_t>(offset)) == size &&
+                  remuxer->Write(buffer.data(), buffer.size()) && !remuxer->Unsupported();
+        }
+        if (!fed) {
+            // 下载失败或含有不支持的编码，之后改用ffmpeg转换完整的TS
+            remuxer.reset();
+            std::filesystem::remove(mp4Path);
+        }
+    }
+    for (auto& f : fingerprintTasks) {
+        if (f.valid()) f.get();
+    }
+    uint64_t fileSize = 0;
+    const bool written = layout->Finished(fileSize);
+    close(fd);
+
+    if (isRepeat.load()) {
+        remuxer.reset();
+        RemoveRepeatVideo(dirPath);
+        return true;
+    }
+    if (failed.load() || doneCount.load() != static_cast<int>(total) || !written) {
+        remuxer.reset();
+        std::filesystem::remove(mp4Path);
+        std::filesystem::remove(outputFile);
+        std::cerr << "[Positional] Failed to download video: " << outputFile << std::endl;
+        return false;
+    }
+
+    // 下载完成后及时释放TsLinks，减少内存占用
+    TsLinks.clear();
+    std::cout << "[Positional] All TS segments written (" << fileSize << " bytes). " << outputFile << std::endl;
+
+    if (remuxer && remuxer->Finish()) {
+        std::filesystem::remove(outputFile);
+        std::cout << "[Positional] Remuxed to " << mp4Path << std::endl;
+    } else if (format != m3u8Downloader::VideoFormat::TS) {
+        if (remuxer) {
+            remuxer.reset();
+            std::filesystem::remove(mp4Path);
+            std::cerr << "[Remux] Native remux failed, falling back to ffmpeg: " << outputFile << std::endl;
+        }
+        progressCallBack(95);
+        ConvertFormat(outputFile, format);
+    }
+    MarkCompleted();
+    progressCallBack(100);
     return true;
 }
 
@@ -505,4 +1538,10 @@ void m3u8Downloader::DeleteTemplateFile() {
     for(auto item: decryptedFiles) {
         std::filesystem::remove(item);
     }
+
+    // 任务已完成，不再需要续传
+    if (journal) {
+        journal->Remove();
+        journal.reset();
+    }
 }
@@ -11,34 +11,49 @@
 #include <regex>
 #include <iomanip>
 #include <sstream>
+#include <memory>
+#include <chrono>
 #include <__filesystem/filesystem_error.h>
 #include <openssl/sha.h>
+#include "segment_fetcher.h"
+#include "segment_cache.h"
+#include "segment_journal.h"
+#include "fingerprint_index.h"
 
 // 计算文件hash值
 std::string sha256(const std::vector<unsigned char>& data);
 
+// 主播放列表（#EXT-X-STREAM-INF）中的一个码率版本
+struct M3U8Variant {
+    std::string url;            // 该版本的媒体播放列表地址
+    uint64_t bandwidth = 0;     // BANDWIDTH，峰值码率（比特/秒）
+    int width = 0;              // RESOLUTION，未知时为0
+    int height = 0;
+    std::string codecs;         // CODECS，如 avc1.64001f,mp4a.40.2
+};
+
 // 实现对m3u8中分片ts文件的下载
 class m3u8Downloader {
 public:
     // 从m3u8文件中读取数据并填充
     explicit m3u8Downloader(const std::string& url)
-        : m3u8Link(url)
-    {
-        if (!url.empty()) {
-            baseUrl = extractBaseUrl(url); // 自动提取域名
-        }
-    }
+        : m3u8Link(url), playlistUrl(url) {}
     ~m3u8Downloader() {
+        ReleaseFingerprint();
         TsLinks.clear();
         tsFiles.clear();
         decryptedFiles.clear();
         key.clear();
-        iv.clear();
-        videoHashMap.clear();
     };
 
     // 常见video格式
     enum class VideoFormat{ TS = 0, MP4, MKV, MOV};
+    // 主播放列表的版本选择策略
+    enum class VariantPolicy {
+        Highest,    // 码率最高的版本
+        Capped,     // 不超过码率上限的最高版本
+        Probe,      // 从低到高试下载各版本第一个分片的开头测速，选带宽够用的最高版本（同样受码率上限限制）
+    };
     std::atomic<bool> isRepeat = false; // 当前视频是否重复
 
     using VF = m3u8Downloader::VideoFormat;
@@ -63,42 +78,131 @@ public:
         }
     }
 
+    // 解析播放列表；主播放列表按版本选择策略选出一个版本后解析它的媒体播放列表
     bool parseM3U8();
     void printInfo() const;
+    // 并行解析所有候选线路（镜像），再同时下载每条线路前几个分片的开头测速，返回按吞吐量从高到低排列的线路；
+    // 测速超时或失败的线路排在最后作为备用，播放列表解析失败的线路被去掉。只有一条线路时不测速
+    static std::vector<std::unique_ptr<m3u8Downloader>> RaceMirrors(const std::vector<std::string>& urls,
+                                                                    std::chrono::milliseconds timeout = std::chrono::seconds(5));
+    // 主播放列表中的所有版本，按出现顺序；媒体播放列表为空
+    const std::vector<M3U8Variant>& Variants() const { return variants; }
+    // 设置版本选择策略，maxBandwidth为码率上限（比特/秒），0表示不限；需在parseM3U8之前调用
+    void SetVariantPolicy(VariantPolicy policy, uint64_t maxBandwidth = 0) {
+        variantPolicy = policy;
+        variantMaxBandwidth = maxBandwidth;
+    }
     bool DownloadAllSegments(const std::filesystem::path& dirPath, std::function<void(int)> progressCallBack = nullptr);
     bool DecryptAllTs(std::function<void(int)> progressCallBack = nullptr);
     bool MergeToVideo(const std::filesystem::path& outputFile, std::function<void(int)> progressCallBack = nullptr, m3u8Downloader::VideoFormat format = m3u8Downloader::VideoFormat::TS);
+    // 流式模式：下载、解密、合并在内存中流水线完成，只有最终文件落盘
+    bool StreamToVideo(const std::filesystem::path& outputFile, std::function<void(int)> progressCallBack = nullptr, m3u8Downloader::VideoFormat format = m3u8Downloader::VideoFormat::TS);
+    // 定位写模式：分片下载完成后直接写到输出文件的最终位置，不产生中间文件也不需要合并；分片大小由下载请求的响应头给出
+    bool DownloadToFile(const std::filesystem::path& outputFile, std::function<void(int)> progressCallBack = nullptr, m3u8Downloader::VideoFormat format = m3u8Downloader::VideoFormat::TS);
     void DeleteTemplateFile();
+    // 设置本任务同时下载的分片数量上限，与cpu核心数无关；
+    // 所有任务共用进程级下载引擎（SegmentFetcher::Shared()），实际并发数还受总上限和各源站的自适应窗口限制
+    void SetMaxConcurrentDownloads(size_t n) { maxConcurrentDownloads = n == 0 ? 1 : n; }
+    // 本任务的自适应并发（AIMD），关闭后本任务固定按上限并发，仍受各源站的窗口限制
+    void SetAdaptiveConcurrency(bool enable) { adaptiveConcurrency = enable; }
+    // 共享下载引擎当前的并发窗口（所有任务、所有源站之和）
+    static size_t DownloadWindow() { return SegmentFetcher::Shared().Window(); }
+    // 限制本任务的下载带宽（字节/秒），0表示不限速；下载过程中也可以调整
+    void SetRateLimit(uint64_t bytesPerSecond);
+    // 提升本任务的调度优先级（例如界面上选中的视频），下载过程中也可以调整
+    void SetPriorityBoost(bool enable);
+    // 限制所有任务合计的下载带宽（字节/秒），0表示不限速
+    static void SetGlobalRateLimit(uint64_t bytesPerSecond) { SegmentFetcher::Shared().SetRateLimit(bytesPerSecond); }
+    // 每个源站同时下载的分片数上限，0表示只受自适应窗口限制
+    static void SetMaxConnectionsPerHost(size_t n) { SegmentFetcher::Shared().SetDefaultHostLimit(n); }
+    // 单独设置某个源站（host[:port]）同时下载的分片数上限，0表示使用默认值
+    static void SetHostConnectionLimit(const std::string& host, size_t n) { SegmentFetcher::Shared().SetHostLimit(host, n); }
+    // 本地分片缓存的容量（字节），所有任务共用，0表示关闭；默认1GB
+    static void SetSegmentCacheLimit(uint64_t bytes) { SegmentCache::Instance().SetCapacity(bytes); }
+    // 流式模式下内存中最多保留的分片数
+    void SetStreamWindow(size_t n) { streamWindow = n == 0 ? 1 : n; }
+    // 流式模式下内存中最多保留的分片字节数（按已写出分片的平均大小估算），至少保留一个分片
+    void SetStreamWindowBytes(uint64_t bytes) { streamWindowBytes = bytes; }
+    // 是否在下载时直接解密，关闭后由DecryptAllTs单独解密落盘的分片
+    void SetDecryptOnReceive(bool enable) { decryptOnReceive = enable; }
+    // DecryptAllTs中大于threshold字节的分片切段并行解密，0表示关闭
+    void SetParallelDecryptThreshold(uint64_t threshold) { parallelDecryptThreshold = threshold; }
+    // 开启HTTP/2多路复用下载分片，服务端不支持时自动回退HTTP/1.1
+    void SetHttp2(bool enable) { http2 = enable; }
 
 private:
     void parseKey(const std::string& line);
+    // 按版本选择策略从variants中选出一个版本，没有可用版本时返回nullptr
+    const M3U8Variant* SelectVariant();
+    // 测量下载某个版本第一个分片开头部分的吞吐量（比特/秒），失败时返回0
+    double ProbeVariantThroughput(const M3U8Variant& variant);
     bool DownloadTsSegment(const std::string& url, const std::filesystem::path& outputFile);
-    static std::string extractBaseUrl(const std::string& fullUrl) {
-        std::regex pattern(R"((https?:\/\/[^\/]+))");
-        std::smatch match;
-        if (std::regex_search(fullUrl, match, pattern))
-            return match[1].str();
-        return {};
-    }
     //从链接中获取到实际的解密key
     std::vector<unsigned char> FetchKey();
-    std::vector<unsigned char> HexToBytes(const std::string& hex);
-    bool DecryptTsFile(const std::filesystem::path& inputFile, const std::filesystem::path& outputFile);
+    std::vector<unsigned char> HexToBytes(const std::string& hex) const;
+    bool DecryptTsFile(const std::filesystem::path& inputFile, const std::filesystem::path& outputFile, const std::vector<unsigned char>& segmentIv) const;
+    bool DecryptTsRange(const std::filesystem::path& inputFile, const std::filesystem::path& outputFile,
+                        uint64_t offset, uint64_t length, const std::vector<unsigned char>& segmentIv) const;
+    bool IsEncrypted() const { return key_ == "AES-128"; }
+    bool PrepareDecrypt() const;
+    std::vector<unsigned char> SegmentIV(size_t index) const;
+    // 本次下载在共享下载引擎中的任务
+    std::shared_ptr<FetchJob> NewFetchJob();
+    std::shared_ptr<SegmentSink> MakeSegmentSink(std::shared_ptr<SegmentSink> inner, size_t index) const;
+    void ConvertFormat(const std::filesystem::path& tsPath, m3u8Downloader::VideoFormat format);
+    bool CheckRepeatVideo(const std::string& Fingerprint, const std::filesystem::path& dirPath);
+    // 下载前的快速去重，返回true表示是重复视频
+    bool ProbeRepeatVideo(const std::filesystem::path& dirPath);
+    // 删除重复视频的目录，已下载视频的目录名更短时改用当前的目录名
+    void RemoveRepeatVideo(const std::filesystem::path& dirPath);
+    // 视频下载完成，把本任务的指纹记录改为已完成
+    void MarkCompleted();
+    // 任务结束时释放指纹：视频没有下载完成时从索引中删除，避免之后同一视频被误判为重复
+    void ReleaseFingerprint();
+    // 打开任务日志，已有同一任务的日志时据此断点续传
+    void OpenJournal(const std::filesystem::path& dirPath);
 
 private:
     const std::string m3u8Link;
-    std::string baseUrl;
+    std::string playlistUrl;                     // 实际解析的媒体播放列表地址，主播放列表时为选中的版本
+    std::vector<M3U8Variant> variants;           // 主播放列表中的所有版本
+    VariantPolicy variantPolicy = VariantPolicy::Highest;
+    uint64_t variantMaxBandwidth = 0;            // 版本的码率上限（比特/秒），0表示不限
     std::vector<std::string> TsLinks;            // 保存所有ts下载路径
     std::vector<std::string> tsFiles;            // 下载到本地的TS 文件路径
     std::vector<std::string> decryptedFiles;     // 解密后所有TS 文件路径
     std::string key_; // 加密方式
     std::string uri_; // 密钥下载地址
     std::string iv_;  // IV解密向量
-    // key 和 iv 均需要使用长度为16子节
+    // key 和 iv 均需要使用长度为16子节，iv按分片计算（见SegmentIV）
     std::vector<unsigned char> key;  // AES key
-    std::vector<unsigned char> iv;   // AES IV
-    std::unordered_map<std::string, std::filesystem::path> videoHashMap; // [videohash, outputPath]
-    std::mutex mapMutex;
+    uint64_t mediaSequence = 0;      // #EXT-X-MEDIA-SEQUENCE，第一个分片的序列号
+    std::vector<std::string> fingerprints; // 本任务写入指纹索引的指纹（探测指纹和完整指纹）
+    std::filesystem::path indexedDir;  // 本任务在指纹索引中登记的目录
+    bool downloadCompleted = false;  // 视频是否已完整下载
+    std::filesystem::path renameFrom;  // 重复视频的已下载目录，目录名比当前的短，删除当前目录后改名
+    size_t maxConcurrentDownloads = 64; // 本任务同时下载的分片数上限
+    bool adaptiveConcurrency = true;    // 本任务是否按自己的AIMD窗口调整并发
+    bool http2 = false;           // 使用HTTP/2多路复用下载分片
+    std::mutex jobMutex;          // 保护fetchJob、rateLimit和priorityBoost，下载过程中可以从其他线程调整
+    std::shared_ptr<FetchJob> fetchJob; // 当前下载在共享下载引擎中的任务
+    uint64_t rateLimit = 0;       // 本任务的带宽上限（字节/秒）
+    bool priorityBoost = false;   // 本任务优先调度
+    size_t streamWindow = 128;    // 流式模式下内存中最多保留的分片数
+    uint64_t streamWindowBytes = 32ull * 1024 * 1024; // 流式模式下内存中最多保留的分片字节数
+    bool segmentsDecrypted = false; // 分片是否已在下载时解密
+    std::unique_ptr<SegmentJournal> journal; // 临时文件模式下的任务日志，任务完成后删除
+    bool decryptOnReceive = true;   // 下载时直接解密
+    uint64_t parallelDecryptThreshold = 16 * 1024 * 1024; // 超过该大小的分片切段并行解密
+    static constexpr uint64_t kDecryptShardSize = 4 * 1024 * 1024; // 并行解密时每段大小，必须是16的倍数
+    static constexpr size_t kProbeSegments = 3;     // 探测去重使用的分片数，与完整指纹一致取前3片
+    static constexpr uint64_t kProbeBytes = 4096;   // 每个分片探测的字节数，必须是16的倍数
+    static constexpr size_t kStreamInitialWindow = 4;  // 流式模式下还不知道分片大小时同时下载的分片数
+    static constexpr uint64_t kVariantProbeBytes = 512 * 1024;  // 版本测速时下载的字节数
+    static constexpr double kVariantHeadroom = 1.25;  // 测得的吞吐量至少为版本码率的这么多倍才选它
+    static constexpr int kMaxPlaylistDepth = 3;     // 主播放列表最多嵌套的层数
+    static constexpr size_t kMirrorProbeSegments = 2;           // 线路测速使用的分片数
+    static constexpr uint64_t kMirrorProbeBytes = 256 * 1024;   // 线路测速时每个分片下载的字节数
 };
 
 #endif //M3U8_DOWNLOADER_H
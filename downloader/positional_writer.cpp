@@ -0,0 +1,122 @@
+//
+// Created by 翔 on 25-11-30.
+//
+
+#include "positional_writer.h"
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+
+PositionalLayout::PositionalLayout(int fd, size_t count) : fd(fd), sizes(count, -1), offsets(count + 1, 0) {}
+
+bool PositionalLayout::WriteAt(int fd, const char* data, size_t len, uint64_t offset) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pwrite(fd, data + done, len - done, static_cast<off_t>(offset + done));
+        if (n <= 0) return false;
+        done += n;
+    }
+    return true;
+}
+
+bool PositionalLayout::SetSize(size_t index, uint64_t size) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (index >= sizes.size()) return false;
+    if (sizes[index] >= 0) {
+        return sizes[index] == static_cast<int64_t>(size);
+    }
+    sizes[index] = static_cast<int64_t>(size);
+    if (index == known) Advance();
+    return true;
+}
+
+// 持锁调用：向后推进已确定位置的分片，预分配新确定的区间，写出位置刚确定的缓存分片
+void PositionalLayout::Advance() {
+    const size_t old = known;
+    while (known < sizes.size() && sizes[known] >= 0) {
+        offsets[known + 1] = offsets[known] + static_cast<uint64_t>(sizes[known]);
+        ++known;
+    }
+    if (known == old) return;
+#ifdef __linux__
+    // 只扩展不截断，失败时写入时再按需分配
+    fallocate(fd, 0, static_cast<off_t>(offsets[old]), static_cast<off_t>(offsets[known] - offsets[old]));
+#endif
+    for (auto it = parked.begin(); it != parked.end() && it->first <= known;) {
+        if (!WriteAt(fd, it->second.data(), it->second.size(), offsets[it->first])) {
+            std::cerr << "[Positional] Write failed: segment " << it->first << std::endl;
+            failed = true;
+        }
+        it = parked.erase(it);
+    }
+}
+
+bool PositionalLayout::Locate(size_t index, uint64_t& offset, int64_t& size) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (index > known || index >= sizes.size()) return false;
+    offset = offsets[index];
+    size = sizes[index];
+    return true;
+}
+
+bool PositionalLayout::Park(size_t index, std::vector<char> data) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (index < sizes.size() && index <= known) {
+        return WriteAt(fd, data.data(), data.size(), offsets[index]);
+    }
+    parked[index] = std::move(data);
+    return true;
+}
+
+bool PositionalLayout::Finished(uint64_t& total) {
+    std::lock_guard<std::mutex> lock(mutex);
+    total = offsets[known];
+    return !failed && known == sizes.size() && parked.empty();
+}
+
+bool PositionalSink::Open() {
+    written = 0;
+    pending.clear();
+    return fd != -1;
+}
+
+size_t PositionalSink::Write(const char* data, size_t len) {
+    uint64_t offset = 0;
+    int64_t size = -1;
+    if (!layout->Locate(index, offset, size)) {
+        pending.insert(pending.end(), data, data + len);
+        return len;
+    }
+    // 超出响应头给出的大小，直接中断，避免覆盖下一个分片
+    if (size >= 0 && written + pending.size() + len > static_cast<uint64_t>(size)) return 0;
+    if (!pending.empty()) {
+        if (!PositionalLayout::WriteAt(fd, pending.data(), pending.size(), offset + written)) return 0;
+        written += pending.size();
+        pending.clear();
+    }
+    if (!PositionalLayout::WriteAt(fd, data, len, offset + written)) return 0;
+    written += len;
+    return len;
+}
+
+bool PositionalSink::Close(bool success) {
+    if (!success) return false;
+    // 没有Content-Length时以实际收到的大小为准，有时与之比较
+    if (!layout->SetSize(index, written + pending.size())) return false;
+    if (pending.empty()) return true;
+    // 位置仍不确定时交给布局保存，前面的分片大小确定后写入
+    bool ok = layout->Park(index, std::move(pending));
+    pending.clear();
+    return ok;
+}
+
+bool PositionalSink::Resume(uint64_t offset) {
+    if (fd == -1 || offset > written + pending.size()) return false;
+    if (offset >= written) {
+        pending.resize(offset - written);
+    } else {
+        written = offset;
+        pending.clear();
+    }
+    return true;
+}
@@ -0,0 +1,69 @@
+//
+// Created by 翔 on 25-11-30.
+//
+
+#ifndef POSITIONAL_WRITER_H
+#define POSITIONAL_WRITER_H
+
+#include <cstdint>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <memory>
+#include "segment_sink.h"
+
+// 定位写模式的输出文件布局：分片i写在前i个分片大小之和处，分片可以乱序完成。
+// 分片大小不提前请求，由下载请求的响应头（Content-Length）给出，没有时以下载完成后的实际大小为准；
+// 前面所有分片的大小都已知后分片的位置才确定，位置还不确定的分片先缓存在内存中，确定后再写入文件。
+// 位置确定的区间随即预分配，减少写入过程中的块分配和碎片。线程安全
+class PositionalLayout {
+public:
+    PositionalLayout(int fd, size_t count);
+    PositionalLayout(const PositionalLayout&) = delete;
+    PositionalLayout& operator=(const PositionalLayout&) = delete;
+
+    // 记录分片大小，与之前记录的不一致（分片内容已变化）时返回false
+    bool SetSize(size_t index, uint64_t size);
+    // 分片在输出文件中的偏移，位置还不确定时返回false；size为分片大小，未知时为-1
+    bool Locate(size_t index, uint64_t& offset, int64_t& size);
+    // 分片已完整下载（大小已记录），数据交给布局，位置确定后写入；位置已确定时立即写入
+    bool Park(size_t index, std::vector<char> data);
+    // 所有分片的位置都已确定且数据都已写入时返回true，total为输出文件的大小
+    bool Finished(uint64_t& total);
+
+    // 在offset处写入完整的数据
+    static bool WriteAt(int fd, const char* data, size_t len, uint64_t offset);
+
+private:
+    void Advance();
+
+    const int fd;
+    std::mutex mutex;
+    std::vector<int64_t> sizes;         // 各分片大小，-1表示未知
+    std::vector<uint64_t> offsets;      // offsets[i]在i <= known时有效
+    size_t known = 0;                   // 开头连续已知大小的分片数，前known + 1个分片的位置已确定
+    std::map<size_t, std::vector<char>> parked;     // 已下载完成、等待位置确定的分片
+    bool failed = false;                // 写入缓存的分片失败
+};
+
+// 按布局写入输出文件的分片，位置确定前收到的数据暂存在内存中
+class PositionalSink : public SegmentSink {
+public:
+    PositionalSink(std::shared_ptr<PositionalLayout> layout, int fd, size_t index)
+        : layout(std::move(layout)), fd(fd), index(index) {}
+
+    bool Open() override;
+    bool OnSize(uint64_t size) override { return layout->SetSize(index, size); }
+    size_t Write(const char* data, size_t len) override;
+    bool Close(bool success) override;
+    bool Resume(uint64_t offset) override;
+
+private:
+    std::shared_ptr<PositionalLayout> layout;
+    int fd;
+    size_t index;
+    uint64_t written = 0;               // 已写入文件的字节数
+    std::vector<char> pending;          // 位置确定前收到的数据，接在written之后
+};
+
+#endif //POSITIONAL_WRITER_H
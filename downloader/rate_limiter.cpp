@@ -0,0 +1,63 @@
+//
+// Created by 翔 on 25-11-30.
+//
+
+#include "rate_limiter.h"
+#include <algorithm>
+#include <cmath>
+
+// 突发上限至少为64KB，低速率时也能放行一个完整的curl写入块
+static constexpr double kMinBurst = 64 * 1024;
+
+TokenBucket::TokenBucket(uint64_t bytesPerSecond) {
+    SetRate(bytesPerSecond);
+}
+
+void TokenBucket::SetRate(uint64_t bytesPerSecond) {
+    std::lock_guard<std::mutex> lock(mutex);
+    const auto now = Clock::now();
+    if (rate == 0) {
+        // 从不限速切换过来时从满桶开始
+        tokens = std::max(static_cast<double>(bytesPerSecond), kMinBurst);
+    } else {
+        // 按原速率结算到当前时刻，已经透支的部分继续保留
+        Refill(now);
+    }
+    rate = bytesPerSecond;
+    capacity = std::max(static_cast<double>(rate), kMinBurst);
+    tokens = std::min(tokens, capacity);
+    last = now;
+}
+
+uint64_t TokenBucket::Rate() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return rate;
+}
+
+void TokenBucket::Refill(Clock::time_point now) {
+    if (now > last) {
+        tokens = std::min(capacity, tokens + std::chrono::duration<double>(now - last).count() * static_cast<double>(rate));
+        last = now;
+    }
+}
+
+bool TokenBucket::Ready(Clock::time_point now) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (rate == 0) return true;
+    Refill(now);
+    return tokens > 0;
+}
+
+void TokenBucket::Consume(uint64_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (rate == 0) return;
+    tokens -= static_cast<double>(bytes);
+}
+
+std::chrono::milliseconds TokenBucket::WaitTime(Clock::time_point now) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (rate == 0) return std::chrono::milliseconds(0);
+    Refill(now);
+    if (tokens > 0) return std::chrono::milliseconds(0);
+    return std::chrono::milliseconds(static_cast<int64_t>(std::ceil(-tokens * 1000.0 / static_cast<double>(rate))) + 1);
+}
@@ -0,0 +1,41 @@
+//
+// Created by 翔 on 25-11-30.
+//
+
+#ifndef RATE_LIMITER_H
+#define RATE_LIMITER_H
+
+#include <cstdint>
+#include <chrono>
+#include <mutex>
+
+// 令牌桶限速器，按字节计
+// curl的写回调要么整块接收要么暂停，不能只接收一部分，因此令牌数为正时整块放行、允许透支，
+// 透支的部分由之后的等待补回，长期平均速率仍不超过设定值。线程安全，可以在下载过程中调整速率
+class TokenBucket {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    explicit TokenBucket(uint64_t bytesPerSecond = 0);
+
+    // 调整速率（字节/秒），0表示不限速；突发上限为一秒的量
+    void SetRate(uint64_t bytesPerSecond);
+    uint64_t Rate() const;
+    // 当前是否可以继续接收数据
+    bool Ready(Clock::time_point now);
+    // 取走bytes字节的令牌，可以透支
+    void Consume(uint64_t bytes);
+    // 令牌恢复为正还需要等待的时间，不限速或已可以接收时为0
+    std::chrono::milliseconds WaitTime(Clock::time_point now);
+
+private:
+    void Refill(Clock::time_point now);
+
+    mutable std::mutex mutex;
+    uint64_t rate = 0;
+    double tokens = 0;
+    double capacity = 0;
+    Clock::time_point last;
+};
+
+#endif //RATE_LIMITER_H
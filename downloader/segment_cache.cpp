@@ -0,0 +1,302 @@
+//
+// Created by 翔 on 25-11-30.
+//
+
+#include "segment_cache.h"
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <unistd.h>
+
+static constexpr uint64_t kDefaultCapacity = 1ULL << 30;
+
+static std::string ToHex(const unsigned char* data, unsigned int len) {
+    static const char* const kHex = "0123456789abcdef";
+    std::string hex;
+    hex.reserve(len * 2);
+    for (unsigned int i = 0; i < len; ++i) {
+        hex.push_back(kHex[data[i] >> 4]);
+        hex.push_back(kHex[data[i] & 0x0F]);
+    }
+    return hex;
+}
+
+static std::string Sha256Hex(const std::string& text) {
+    unsigned char hash[EVP_MAX_MD_SIZE];
+    unsigned int hashLen = 0;
+    if (EVP_Digest(text.data(), text.size(), hash, &hashLen, EVP_sha256(), nullptr) != 1) return {};
+    return ToHex(hash, hashLen);
+}
+
+CacheSink::CacheSink(std::shared_ptr<SegmentSink> inner, std::filesystem::path tempPath)
+    : inner(std::move(inner)), tempPath(std::move(tempPath)), ctx(EVP_MD_CTX_new()) {}
+
+CacheSink::~CacheSink() {
+    Discard();
+    EVP_MD_CTX_free(ctx);
+}
+
+void CacheSink::Discard() {
+    if (fp) {
+        fclose(fp);
+        fp = nullptr;
+    }
+    // 已经移入缓存时临时文件不存在，删除失败无影响
+    std::error_code ec;
+    std::filesystem::remove(tempPath, ec);
+}
+
+bool CacheSink::Open() {
+    Discard();
+    length = 0;
+    digest.clear();
+    complete = false;
+    if (!inner->Open()) return false;
+    fp = fopen(tempPath.c_str(), "wb");
+    if (fp && (!ctx || EVP_DigestInit_ex(ctx, EVP_sha256(), nullptr) != 1)) {
+        Discard();
+    }
+    return true;
+}
+
+size_t CacheSink::Write(const char* data, size_t len) {
+    size_t n = inner->Write(data, len);
+    if (fp) {
+        if (fwrite(data, 1, n, fp) == n) {
+            EVP_DigestUpdate(ctx, data, n);
+        } else {
+            Discard();
+        }
+    }
+    length += n;
+    return n;
+}
+
+bool CacheSink::Close(bool success) {
+    bool ok = inner->Close(success);
+    if (fp) {
+        bool written = fclose(fp) == 0;
+        fp = nullptr;
+        unsigned char hash[EVP_MAX_MD_SIZE];
+        unsigned int hashLen = 0;
+        if (ok && success && written && EVP_DigestFinal_ex(ctx, hash, &hashLen) == 1) {
+            digest = ToHex(hash, hashLen);
+            complete = true;
+        }
+    }
+    if (!complete) Discard();
+    return ok;
+}
+
+bool CacheSink::Resume(uint64_t offset) {
+    // 摘要只能继续累加，不能回退
+    return offset == length && inner->Resume(offset);
+}
+
+SegmentCache::SegmentCache(std::filesystem::path dir, uint64_t capacity) : dir(std::move(dir)), capacity(capacity) {}
+
+SegmentCache& SegmentCache::Instance() {
+    static SegmentCache cache([] {
+        const char* home = std::getenv("HOME");
+        std::filesystem::path dir = home && *home ? std::filesystem::path(home) / ".videoDownloader"
+                                                  : std::filesystem::temp_directory_path() / "videoDownloader";
+        return dir / "segments";
+    }(), kDefaultCapacity);
+    return cache;
+}
+
+std::string SegmentCache::Normalize(const std::string& url) {
+    // 片段不会发给服务端；主机名和查询参数都可能决定内容（不同网站的/hls/index0.ts、带签名的地址），必须保留
+    return url.substr(0, url.find('#'));
+}
+
+std::filesystem::path SegmentCache::BlobPath(const std::string& digest) const {
+    return dir / "objects" / digest.substr(0, 2) / digest;
+}
+
+std::filesystem::path SegmentCache::RefPath(const std::string& url) const {
+    std::string name = Sha256Hex(Normalize(url));
+    return dir / "refs" / name.substr(0, 2) / name;
+}
+
+std::filesystem::path SegmentCache::NewTempPath() {
+    return dir / "tmp" / (std::to_string(getpid()) + "-" + std::to_string(tempCounter++));
+}
+
+std::filesystem::path SegmentCache::TempPath() {
+    std::lock_guard<std::mutex> lock(mutex);
+    Load();
+    return NewTempPath();
+}
+
+// 第一次使用时扫描已有内容，按修改时间重建LRU顺序；调用方需持锁
+void SegmentCache::Load() {
+    if (loaded) return;
+    loaded = true;
+    std::error_code ec;
+    std::filesystem::create_directories(dir / "tmp", ec);
+    if (ec) {
+        std::cerr << "[Cache] Cannot create cache directory: " << dir << std::endl;
+        return;
+    }
+    // 清理崩溃时留下的临时文件，其他程序正在写入的临时文件不会这么旧
+    const auto expired = std::filesystem::file_time_type::clock::now() - std::chrono::hours(24);
+    for (const auto& entry : std::filesystem::directory_iterator(dir / "tmp", ec)) {
+        std::error_code timeEc;
+        if (entry.last_write_time(timeEc) < expired && !timeEc) {
+            std::filesystem::remove(entry.path(), timeEc);
+        }
+    }
+
+    struct Found {
+        std::filesystem::file_time_type time;
+        std::string digest;
+        uint64_t size;
+    };
+    std::vector<Found> found;
+    for (const auto& entry : std::filesystem::recursive_directory_iterator(dir / "objects", ec)) {
+        std::error_code entryEc;
+        if (!entry.is_regular_file(entryEc)) continue;
+        uint64_t size = entry.file_size(entryEc);
+        auto time = entry.last_write_time(entryEc);
+        if (entryEc) continue;
+        found.push_back({time, entry.path().filename().string(), size});
+    }
+    std::sort(found.begin(), found.end(), [](const Found& a, const Found& b) { return a.time < b.time; });
+    for (auto& item : found) {
+        lru.push_front(item.digest);
+        blobs[item.digest] = {item.size, lru.begin()};
+        total += item.size;
+    }
+    if (!found.empty()) {
+        std::cout << "[Cache] Loaded " << found.size() << " segments (" << total << " bytes) from " << dir << std::endl;
+    }
+    Evict();
+}
+
+// 移到LRU的最前面，同时更新文件的修改时间，重启后仍能恢复使用顺序；调用方需持锁
+void SegmentCache::Touch(const std::string& digest) {
+    auto it = blobs.find(digest);
+    if (it == blobs.end()) return;
+    lru.splice(lru.begin(), lru, it->second.position);
+    std::error_code ec;
+    std::filesystem::last_write_time(BlobPath(digest), std::filesystem::file_time_type::clock::now(), ec);
+}
+
+// 淘汰最久未使用的内容直到不超过容量；调用方需持锁
+void SegmentCache::Evict() {
+    const uint64_t limit = capacity.load(std::memory_order_relaxed);
+    size_t evicted = 0;
+    while (total > limit && !lru.empty()) {
+        const std::string& digest = lru.back();
+        std::error_code ec;
+        std::filesystem::remove(BlobPath(digest), ec);
+        auto it = blobs.find(digest);
+        total -= it->second.size;
+        blobs.erase(it);
+        lru.pop_back();
+        ++evicted;
+    }
+    if (evicted > 0) {
+        std::cout << "[Cache] Evicted " << evicted << " segments, " << total << " bytes left" << std::endl;
+    }
+}
+
+void SegmentCache::SetCapacity(uint64_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex);
+    capacity.store(bytes, std::memory_order_relaxed);
+    // 关闭缓存时保留已有内容，重新打开后仍然可用
+    if (bytes > 0 && loaded) Evict();
+}
+
+bool SegmentCache::Lookup(const std::string& url, Entry& entry) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!Enabled()) return false;
+    Load();
+    const std::filesystem::path ref = RefPath(url);
+    std::ifstream in(ref);
+    if (!in) return false;
+    std::string digest, etag;
+    uint64_t length = 0;
+    std::error_code ec;
+    if (!std::getline(in, digest) || !(in >> length) || digest.size() < 2) {
+        std::filesystem::remove(ref, ec);
+        return false;
+    }
+    in.ignore();
+    std::getline(in, etag);
+
+    // 内容已被淘汰或不完整时删除映射，重新下载
+    const std::filesystem::path blob = BlobPath(digest);
+    uint64_t size = std::filesystem::file_size(blob, ec);
+    if (ec || size != length) {
+        std::filesystem::remove(ref, ec);
+        return false;
+    }
+    if (blobs.find(digest) == blobs.end()) {
+        // 其他程序写入的内容
+        lru.push_front(digest);
+        blobs[digest] = {size, lru.begin()};
+        total += size;
+    }
+    Touch(digest);
+    entry.blob = blob;
+    entry.length = length;
+    entry.etag = etag;
+    return true;
+}
+
+bool SegmentCache::Store(const std::string& url, const std::string& etag, const CacheSink& sink) {
+    if (!sink.Complete() || sink.Length() == 0) return false;
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!Enabled()) return false;
+    Load();
+
+    const std::string& digest = sink.Digest();
+    const std::filesystem::path blob = BlobPath(digest);
+    std::error_code ec;
+    if (blobs.find(digest) == blobs.end()) {
+        if (std::filesystem::exists(blob, ec)) {
+            // 其他程序已经保存过相同内容
+            std::filesystem::remove(sink.TempPath(), ec);
+        } else {
+            std::filesystem::create_directories(blob.parent_path(), ec);
+            std::filesystem::rename(sink.TempPath(), blob, ec);
+            if (ec) {
+                std::cerr << "[Cache] Cannot store segment: " << ec.message() << std::endl;
+                std::filesystem::remove(sink.TempPath(), ec);
+                return false;
+            }
+        }
+        lru.push_front(digest);
+        blobs[digest] = {sink.Length(), lru.begin()};
+        total += sink.Length();
+    } else {
+        // 相同内容已在缓存中（例如片头片尾），只记录地址映射
+        std::filesystem::remove(sink.TempPath(), ec);
+    }
+    Touch(digest);
+
+    // 先写临时文件再改名，其他程序不会读到写了一半的映射
+    const std::filesystem::path ref = RefPath(url);
+    const std::filesystem::path temp = NewTempPath();
+    {
+        std::ofstream out(temp, std::ios::trunc);
+        out << digest << '\n' << sink.Length() << '\n' << etag << '\n';
+        if (!out) {
+            std::filesystem::remove(temp, ec);
+            return false;
+        }
+    }
+    std::filesystem::create_directories(ref.parent_path(), ec);
+    std::filesystem::rename(temp, ref, ec);
+    if (ec) {
+        std::filesystem::remove(temp, ec);
+        return false;
+    }
+    Evict();
+    return true;
+}
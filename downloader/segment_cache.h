@@ -0,0 +1,110 @@
+//
+// Created by 翔 on 25-11-30.
+//
+
+#ifndef SEGMENT_CACHE_H
+#define SEGMENT_CACHE_H
+
+#include <cstdio>
+#include <cstdint>
+#include <string>
+#include <list>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <filesystem>
+#include <openssl/evp.h>
+#include "segment_sink.h"
+
+// 写入下载目标的同时把收到的原始数据保存到缓存的临时文件，并计算SHA-256
+// 缓存写入失败只会放弃缓存这一片，不影响下载本身
+class CacheSink : public SegmentSink {
+public:
+    CacheSink(std::shared_ptr<SegmentSink> inner, std::filesystem::path tempPath);
+    ~CacheSink() override;
+    CacheSink(const CacheSink&) = delete;
+    CacheSink& operator=(const CacheSink&) = delete;
+
+    bool Open() override;
+    size_t Write(const char* data, size_t len) override;
+    bool Close(bool success) override;
+    bool Resume(uint64_t offset) override;
+    bool OnSize(uint64_t size) override { return inner->OnSize(size); }
+
+    // 传输成功且临时文件完整写入后为true
+    bool Complete() const { return complete; }
+    uint64_t Length() const { return length; }
+    const std::string& Digest() const { return digest; }
+    const std::filesystem::path& TempPath() const { return tempPath; }
+
+private:
+    void Discard();
+
+    std::shared_ptr<SegmentSink> inner;
+    std::filesystem::path tempPath;
+    FILE* fp = nullptr;
+    EVP_MD_CTX* ctx;
+    uint64_t length = 0;
+    std::string digest;
+    bool complete = false;
+};
+
+// 本地分片缓存，所有任务共用，程序重启后仍然有效
+// 分片内容按SHA-256保存一份（objects/），同一网站反复出现的片头片尾、其他线路（镜像）上的同一分片
+// 在下载完成、算出摘要之后才合并为一份，只占一份空间；
+// 分片地址到内容的映射单独保存（refs/），记录内容摘要、长度和ETag。映射按完整地址（含主机名和查询参数）查找，
+// 只有请求过的同一地址才会命中，不会按路径猜测把其他网站的同名分片当成命中。
+// 超出容量时按最近使用时间淘汰内容，最近使用时间记在文件的修改时间上；被淘汰内容的映射在下次查找时清理。
+// 多个程序共用一个缓存目录时各自统计容量，总占用可能短暂超出
+class SegmentCache {
+public:
+    SegmentCache(std::filesystem::path dir, uint64_t capacity);
+    SegmentCache(const SegmentCache&) = delete;
+    SegmentCache& operator=(const SegmentCache&) = delete;
+
+    // 进程级缓存，位于 $HOME/.videoDownloader/segments，默认容量1GB
+    static SegmentCache& Instance();
+
+    struct Entry {
+        std::filesystem::path blob;     // 内容文件
+        uint64_t length = 0;
+        std::string etag;
+    };
+
+    // 调整容量（字节），0表示关闭缓存；缩小时立即淘汰
+    void SetCapacity(uint64_t bytes);
+    bool Enabled() const { return capacity.load(std::memory_order_relaxed) > 0; }
+    // 查找分片地址对应的内容，命中时更新最近使用时间
+    bool Lookup(const std::string& url, Entry& entry);
+    // 为CacheSink分配临时文件
+    std::filesystem::path TempPath();
+    // 把CacheSink完整写入的临时文件移入缓存，并记录地址映射
+    bool Store(const std::string& url, const std::string& etag, const CacheSink& sink);
+
+    // 缓存使用的地址：完整地址去掉片段
+    static std::string Normalize(const std::string& url);
+
+private:
+    struct Blob {
+        uint64_t size = 0;
+        std::list<std::string>::iterator position;
+    };
+    void Load();
+    void Touch(const std::string& digest);
+    void Evict();
+    std::filesystem::path NewTempPath();
+    std::filesystem::path BlobPath(const std::string& digest) const;
+    std::filesystem::path RefPath(const std::string& url) const;
+
+    const std::filesystem::path dir;
+    std::atomic<uint64_t> capacity;
+    bool loaded = false;
+    uint64_t total = 0;                                 // 缓存内容的总大小
+    std::list<std::string> lru;                         // 内容摘要，最近使用的在前
+    std::unordered_map<std::string, Blob> blobs;
+    uint64_t tempCounter = 0;
+    std::mutex mutex;
+};
+
+#endif //SEGMENT_CACHE_H
@@ -0,0 +1,1078 @@
+//
+// Created by 翔 on 25-11-20.
+//
+
+#include "segment_fetcher.h"
+#include "curl_pool.h"
+#include "segment_cache.h"
+#include "executor.h"
+#include <iostream>
+#include <cstdio>
+#include <cctype>
+#include <cstdlib>
+#include <algorithm>
+
+struct SegmentFetcher::Transfer {
+    SegmentTask task;
+    std::promise<bool> promise;
+    CURL* easy = nullptr;
+    SegmentFetcher* owner = nullptr;
+    std::shared_ptr<SegmentSink> sink;
+    std::shared_ptr<CacheSink> cache;   // 不为空时sink为它，下载成功后存入分片缓存
+    HostState* host = nullptr;
+    int attempt = 0;    // 已重试次数
+    // 断点续传状态，跨重试保留
+    uint64_t received = 0;          // sink已接收的响应体字节数
+    uint64_t resumeFrom = 0;        // 本次传输的起始偏移，0表示从头下载
+    std::string etag;               // 响应头中的ETag
+    std::string lastModified;       // 响应头中的Last-Modified
+    curl_off_t totalLength = -1;    // 响应头Content-Range中的总长度
+    bool rangeUnsupported = false;  // 服务端不支持Range或资源已变化，只能整片重新下载
+    curl_slist* headers = nullptr;
+    std::chrono::steady_clock::time_point started;  // 本次传输开始的时间
+    // 卡顿检测，每次传输重新计算
+    bool responded = false;                             // 已收到响应的第一个字节
+    std::chrono::steady_clock::time_point respondedAt;
+    curl_off_t progressBytes = 0;                       // 本次传输已收到的字节数
+    std::chrono::steady_clock::time_point progressAt;   // 最近一次收到数据的时间
+    bool waiting = false;                               // 等待带宽而暂停，不计入卡顿时间
+    bool stalled = false;                               // 因卡顿被中断
+    bool restarted = false;                             // 本次传输想续传但没能续传，从头开始
+    bool sizeReported = false;                          // 本次传输已把响应头中的分片大小告知sink
+    int stallReissues = 0;                              // 卡顿后不计入重试次数的重新请求次数
+    // 对冲：原请求的hedge指向正在进行的副本请求，副本的primary指向原请求；副本写入buffer，不调用回调
+    Transfer* primary = nullptr;
+    Transfer* hedge = nullptr;
+    std::shared_ptr<MemorySink> buffer;
+};
+
+static constexpr size_t kLatencySamples = 256;     // 计算耗时分位数使用的最近分片数
+static constexpr size_t kMinLatencySamples = 20;   // 样本不足时不对冲
+static constexpr int kMaxStallReissues = 20;        // 卡顿后免计重试次数的重新请求上限，之后按普通失败计数
+
+static bool IsCancelled(const SegmentTask& task) {
+    return (task.cancelled && task.cancelled->load(std::memory_order_acquire)) ||
+           (task.job && task.job->Cancelled());
+}
+
+static std::shared_ptr<SegmentSink> TargetSink(const SegmentTask& task) {
+    if (task.sink) return task.sink;
+    if (task.headOnly) return std::make_shared<MemorySink>();
+    return std::make_shared<FileSink>(task.outputPath);
+}
+
+size_t SegmentFetcher::WriteCallback(void* ptr, size_t size, size_t nmemb, void* userdata) {
+    auto* transfer = static_cast<Transfer*>(userdata);
+    // 暂停期间被取消时直接中断，不再等待带宽
+    if (IsCancelled(transfer->task)) return 0;
+    size_t len = size * nmemb;
+    // 探测请求收够probeBytes后返回0中断传输，HandleDone按成功处理
+    bool probeDone = false;
+    if (transfer->task.probeBytes > 0 && transfer->received + len >= transfer->task.probeBytes) {
+        len = transfer->task.probeBytes > transfer->received ? transfer->task.probeBytes - transfer->received : 0;
+        probeDone = true;
+    }
+    // 总带宽或任务带宽用完时暂停，curl会保留这块数据，事件循环在令牌恢复后继续传输
+    TokenBucket& global = transfer->owner->bandwidth;
+    TokenBucket& job = transfer->task.job->bandwidth;
+    const auto now = TokenBucket::Clock::now();
+    if (!global.Ready(now) || !job.Ready(now)) {
+        transfer->waiting = true;
+        transfer->owner->paused.push_back(transfer);
+        return CURL_WRITEFUNC_PAUSE;
+    }
+    global.Consume(len);
+    job.Consume(len);
+    // 响应头已经全部收到：把分片的完整大小告知sink，定位写模式据此提前确定后面分片的位置。
+    // 只对完整下载的成功响应生效，错误页面的大小不是分片的大小
+    if (!transfer->sizeReported) {
+        transfer->sizeReported = true;
+        const SegmentTask& task = transfer->task;
+        long responseCode = 0;
+        curl_easy_getinfo(transfer->easy, CURLINFO_RESPONSE_CODE, &responseCode);
+        curl_off_t total = -1;
+        if (responseCode == 206) {
+            total = transfer->totalLength;
+        } else if (responseCode == 200) {
+            curl_easy_getinfo(transfer->easy, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &total);
+        }
+        if (!transfer->primary && task.probeBytes == 0 && !task.headOnly && total >= 0 &&
+            !transfer->sink->OnSize(static_cast<uint64_t>(total))) {
+            return 0;
+        }
+    }
+    size_t n = transfer->sink->Write(static_cast<const char*>(ptr), len);
+    transfer->received += n;
+    transfer->host->controller.OnBytes(n);
+    transfer->task.job->controller.OnBytes(n);
+    return probeDone ? 0 : n;
+}
+
+// 记录续传需要的校验信息；跟随重定向时会收到多个响应，只保留最后一个
+size_t SegmentFetcher::HeaderCallback(char* buffer, size_t size, size_t nitems, void* userdata) {
+    auto* transfer = static_cast<Transfer*>(userdata);
+    if (!transfer->responded) {
+        // 卡顿检测从收到响应开始计时，建连和等待首字节由连接超时和maxStall限制
+        transfer->responded = true;
+        transfer->respondedAt = transfer->progressAt = std::chrono::steady_clock::now();
+    }
+    const size_t len = size * nitems;
+    std::string line(buffer, len);
+    if (line.compare(0, 5, "HTTP/") == 0) {
+        transfer->etag.clear();
+        transfer->lastModified.clear();
+        transfer->totalLength = -1;
+        return len;
+    }
+    size_t colon = line.find(':');
+    if (colon == std::string::npos) return len;
+    std::string name = line.substr(0, colon);
+    std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) { return std::tolower(c); });
+    size_t begin = line.find_first_not_of(" \t", colon + 1);
+    size_t end = line.find_last_not_of(" \t\r\n");
+    std::string value = begin == std::string::npos || end < begin ? "" : line.substr(begin, end - begin + 1);
+    if (name == "etag") {
+        transfer->etag = value;
+    } else if (name == "last-modified") {
+        transfer->lastModified = value;
+    } else if (name == "accept-ranges" && value == "none") {
+        transfer->rangeUnsupported = true;
+    } else if (name == "content-range") {
+        // bytes 0-4095/123456，总长度未知时为*
+        size_t slash = value.rfind('/');
+        if (slash != std::string::npos && slash + 1 < value.size() && std::isdigit(static_cast<unsigned char>(value[slash + 1]))) {
+            transfer->totalLength = std::strtoll(value.c_str() + slash + 1, nullptr, 10);
+        }
+    }
+    return len;
+}
+
+// 传输过程中检查取消标记和卡顿，返回非0会让curl中断当前传输
+int SegmentFetcher::ProgressCallback(void* clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t, curl_off_t) {
+    auto* transfer = static_cast<Transfer*>(clientp);
+    if (IsCancelled(transfer->task)) return 1;
+    const auto now = std::chrono::steady_clock::now();
+    if (transfer->waiting) {
+        transfer->progressAt = now;
+        return 0;
+    }
+    if (dlnow > transfer->progressBytes) {
+        transfer->progressBytes = dlnow;
+        transfer->progressAt = now;
+    }
+
+    // 正常耗时 = 分片大小（优先用Content-Length）/ 该源站的单连接吞吐量；没有数据或者还没收到响应时按maxStall
+    const FetcherOptions& options = transfer->owner->options;
+    const HostState& host = *transfer->host;
+    const double size = dltotal > 0 ? static_cast<double>(dltotal) : host.segmentBytes;
+    double stall = std::chrono::duration<double>(options.maxStall).count();
+    if (transfer->responded && host.rate > 0 && size > 0) {
+        stall = std::clamp(2 * size / host.rate, std::chrono::duration<double>(options.minStall).count(), stall);
+    }
+    if (std::chrono::duration<double>(now - transfer->progressAt).count() > stall) {
+        transfer->stalled = true;
+        return 1;
+    }
+    // 一直有数据但速度远低于正常水平，多半是落到了慢节点或者连接在滴流；限速时速度由带宽设置决定，不检查
+    if (!transfer->responded) return 0;
+    const double elapsed = std::chrono::duration<double>(now - transfer->respondedAt).count();
+    const bool rateLimited = transfer->owner->bandwidth.Rate() > 0 || transfer->task.job->bandwidth.Rate() > 0;
+    if (!rateLimited && host.rate > 0 && elapsed > stall &&
+        static_cast<double>(dlnow) / elapsed < host.rate * options.lowSpeedRatio) {
+        transfer->stalled = true;
+        return 1;
+    }
+    return 0;
+}
+
+// 指数滑动平均，第一个样本直接作为初值
+static void Ewma(double& average, double sample) {
+    average = average > 0 ? average * 0.8 + sample * 0.2 : sample;
+}
+
+// 超时、连接失败或中断、限流以及服务端错误视为拥塞；404之类的错误与并发数无关
+
+static bool IsCongestion(CURLcode res, long responseCode) {
+    if (responseCode == 429 || responseCode >= 500) return true;
+    switch (res) {
+        case CURLE_OPERATION_TIMEDOUT:
+        case CURLE_COULDNT_CONNECT:
+        case CURLE_SEND_ERROR:
+        case CURLE_RECV_ERROR:
+        case CURLE_PARTIAL_FILE:
+        case CURLE_GOT_NOTHING:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// 源站标识（host:port），并发窗口按源站分别控制
+static std::string HostKey(const std::string& url) {
+    size_t begin = url.find("://");
+    begin = begin == std::string::npos ? 0 : begin + 3;
+    size_t end = url.find_first_of("/?#", begin);
+    std::string authority = url.substr(begin, end == std::string::npos ? std::string::npos : end - begin);
+    size_t at = authority.rfind('@');
+    return at == std::string::npos ? authority : authority.substr(at + 1);
+}
+
+// 任务窗口的初始值与源站窗口一致，上限为任务的并发上限
+static AimdOptions JobAimdOptions(size_t maxConcurrent) {
+    AimdOptions aimd;
+    aimd.max = maxConcurrent;
+    return aimd;
+}
+
+FetchJob::FetchJob(size_t maxConcurrent, bool http2, bool adaptive)
+    : maxConcurrent(maxConcurrent == 0 ? 1 : maxConcurrent), http2(http2), adaptive(adaptive),
+      controller(JobAimdOptions(this->maxConcurrent)) {}
+
+void FetchJob::Add(size_t count) {
+    std::lock_guard<std::mutex> lock(mutex);
+    outstanding += count;
+}
+
+void FetchJob::Done() {
+    // 持锁通知，Wait返回后任务对象可能立即被析构
+    std::lock_guard<std::mutex> lock(mutex);
+    ++finished;
+    if (--outstanding == 0) idle.notify_all();
+}
+
+void FetchJob::SetExpectedSegments(size_t n) {
+    std::lock_guard<std::mutex> lock(mutex);
+    expected = n;
+}
+
+size_t FetchJob::Remaining() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return std::max(expected > finished ? expected - finished : 0, outstanding);
+}
+
+void FetchJob::Wait() {
+    std::unique_lock<std::mutex> lock(mutex);
+    idle.wait(lock, [this] { return outstanding == 0; });
+}
+
+SegmentFetcher::SegmentFetcher(const FetcherOptions& opts)
+    : defaultJob(std::make_shared<FetchJob>(opts.maxConcurrent, opts.http2)),
+      options(opts), maxConcurrent(opts.maxConcurrent == 0 ? 1 : opts.maxConcurrent),
+      window(opts.adaptive ? 0 : maxConcurrent.load()),
+      bandwidth(opts.rateLimit), defaultHostLimit(opts.maxPerHost)
+{
+    // 确保curl全局初始化以及共享对象先于multi句柄创建
+    CurlHandlePool::Instance();
+    // 缓存读写在I/O执行器中进行，先创建两者，保证它们晚于下载引擎析构
+    SegmentCache::Instance();
+    Executors::Io();
+    multi = curl_multi_init();
+    // 是否使用HTTP/2由每个任务决定，多路复用只对协商到HTTP/2的连接生效，HTTP/1.1的传输不受影响
+    curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    curl_multi_setopt(multi, CURLMOPT_MAX_CONCURRENT_STREAMS, options.maxStreamsPerConnection);
+    loopThread = std::thread(&SegmentFetcher::EventLoop, this);
+}
+
+SegmentFetcher& SegmentFetcher::Shared() {
+    // 所有任务合计的上限，单个任务的上限见FetchJob::maxConcurrent
+    static SegmentFetcher fetcher([] {
+        FetcherOptions opts;
+        opts.maxConcurrent = 128;
+        return opts;
+    }());
+    return fetcher;
+}
+
+SegmentFetcher::~SegmentFetcher() {
+    stop.store(true, std::memory_order_release);
+    curl_multi_wakeup(multi);
+    if (loopThread.joinable())
+        loopThread.join();
+    {
+        // 等待I/O执行器中的缓存读写结束，查找完才交回的分片在下面结束
+        std::unique_lock<std::mutex> lock(queueMutex);
+        cacheIdle.wait(lock, [this] { return cacheTasks == 0; });
+    }
+    AbortAll();
+    curl_multi_cleanup(multi);
+}
+
+std::future<bool> SegmentFetcher::Submit(SegmentTask task) {
+    std::vector<SegmentTask> tasks;
+    tasks.push_back(std::move(task));
+    return std::move(SubmitBatch(tasks).front());
+}
+
+std::vector<std::future<bool>> SegmentFetcher::SubmitBatch(std::vector<SegmentTask>& tasks) {
+    std::vector<std::future<bool>> res;
+    res.reserve(tasks.size());
+    std::vector<Transfer*> transfers;
+    transfers.reserve(tasks.size());
+    for (auto& task : tasks) {
+        auto* transfer = new Transfer();
+        transfer->task = std::move(task);
+        transfer->owner = this;
+        if (!transfer->task.job) transfer->task.job = defaultJob;
+        // 放入队列前计数，Wait不会在分片结束之前返回
+        transfer->task.job->Add(1);
+        res.emplace_back(transfer->promise.get_future());
+        transfers.push_back(transfer);
+    }
+    tasks.clear();
+    // 使用缓存的分片先在I/O执行器中查找缓存，不在事件循环线程中读写磁盘
+    std::vector<Task> lookupTasks;
+    const bool cacheEnabled = SegmentCache::Instance().Enabled();
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        for (auto* transfer : transfers) {
+            if (cacheEnabled && transfer->task.useCache) {
+                ++cacheTasks;
+                lookupTasks.emplace_back([this, transfer] { LookupCache(transfer); });
+            } else {
+                Enqueue(transfer);
+            }
+        }
+    }
+    Executors::Io().PostBatch(lookupTasks);
+    // 唤醒阻塞在curl_multi_poll上的事件循环
+    curl_multi_wakeup(multi);
+    return res;
+}
+
+// 在I/O执行器中运行：命中时直接写入目标，交给事件循环结束；未命中时准备好写入缓存的sink后排队下载
+void SegmentFetcher::LookupCache(Transfer* transfer) {
+    const SegmentTask& task = transfer->task;
+    const bool hit = !IsCancelled(task) && ServeFromCache(transfer);
+    if (!hit && !task.headOnly && task.probeBytes == 0) {
+        // 完整下载的分片同时写入缓存；续传时接着写同一个临时文件
+        SegmentCache& cache = SegmentCache::Instance();
+        transfer->sink = TargetSink(task);
+        if (cache.Enabled()) {
+            transfer->cache = std::make_shared<CacheSink>(transfer->sink, cache.TempPath());
+            transfer->sink = transfer->cache;
+        }
+    }
+    std::lock_guard<std::mutex> lock(queueMutex);
+    if (hit) {
+        served.push_back(transfer);
+    } else {
+        Enqueue(transfer);
+    }
+    // 持锁唤醒并计数，析构函数等到计数为0之后才会销毁multi句柄
+    curl_multi_wakeup(multi);
+    if (--cacheTasks == 0) cacheIdle.notify_all();
+}
+
+// 下载成功的分片在I/O执行器中存入缓存，sink随任务一起保留到存完
+void SegmentFetcher::StoreInCache(const Transfer* transfer) {
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        ++cacheTasks;
+    }
+    Executors::Io().Post([this, url = transfer->task.url, etag = transfer->etag, sink = transfer->cache] {
+        SegmentCache::Instance().Store(url, etag, *sink);
+        std::lock_guard<std::mutex> lock(queueMutex);
+        if (--cacheTasks == 0) cacheIdle.notify_all();
+    });
+}
+
+// 放入所属任务的等待队列，调用方需持有queueMutex
+void SegmentFetcher::Enqueue(Transfer* transfer) {
+    const auto& job = transfer->task.job;
+    auto it = std::find_if(queues.begin(), queues.end(), [&](const JobQueue& queue) { return queue.job == job; });
+    if (it == queues.end()) {
+        queues.push_back(JobQueue{job, {}});
+        it = queues.end() - 1;
+    }
+    it->pending.push_back(transfer);
+}
+
+void SegmentFetcher::SetMaxConcurrent(size_t n) {
+    maxConcurrent.store(n == 0 ? 1 : n, std::memory_order_relaxed);
+    if (!options.adaptive) window.store(n == 0 ? 1 : n, std::memory_order_relaxed);
+    curl_multi_wakeup(multi);
+}
+
+void SegmentFetcher::SetHostLimit(const std::string& host, size_t n) {
+    {
+        std::lock_guard<std::mutex> lock(limitMutex);
+        if (n == 0) {
+            hostLimits.erase(host);
+        } else {
+            hostLimits[host] = n;
+        }
+    }
+    hostLimitsChanged.store(true, std::memory_order_release);
+    curl_multi_wakeup(multi);
+}
+
+void SegmentFetcher::SetDefaultHostLimit(size_t n) {
+    {
+        std::lock_guard<std::mutex> lock(limitMutex);
+        defaultHostLimit = n;
+    }
+    hostLimitsChanged.store(true, std::memory_order_release);
+    curl_multi_wakeup(multi);
+}
+
+size_t SegmentFetcher::HostLimit(const std::string& name) {
+    std::lock_guard<std::mutex> lock(limitMutex);
+    auto it = hostLimits.find(name);
+    return it != hostLimits.end() ? it->second : defaultHostLimit;
+}
+
+SegmentFetcher::HostState* SegmentFetcher::HostOf(const std::string& url) {
+    std::string key = HostKey(url);
+    auto& host = hosts[key];
+    if (!host) {
+        AimdOptions aimd;
+        aimd.initial = options.initialConcurrent;
+        aimd.max = maxConcurrent.load(std::memory_order_relaxed);
+        host.reset(new HostState{key, AimdController(aimd), 0, HostLimit(key)});
+        UpdateWindow();
+    }
+    return host.get();
+}
+
+bool SegmentFetcher::HasRoom(const HostState* host) const {
+    if (host->limit > 0 && host->inFlight >= host->limit) return false;
+    return !options.adaptive || host->inFlight < host->controller.Window();
+}
+
+void SegmentFetcher::UpdateWindow() {
+    if (!options.adaptive) return;
+    size_t sum = 0;
+    for (const auto& item : hosts) {
+        const HostState& host = *item.second;
+        sum += host.limit > 0 ? std::min(host.controller.Window(), host.limit) : host.controller.Window();
+    }
+    sum = std::min(sum, maxConcurrent.load(std::memory_order_relaxed));
+    if (window.exchange(sum, std::memory_order_relaxed) != sum && options.onWindowChange) {
+        options.onWindowChange(sum);
+    }
+}
+
+void SegmentFetcher::EventLoop() {
+    while (!stop.load(std::memory_order_acquire)) {
+        StartPending();
+        ResumePaused();
+        CheckStragglers();
+
+        int running = 0;
+        curl_multi_perform(multi, &running);
+
+        int msgsLeft = 0;
+        while (CURLMsg* msg = curl_multi_info_read(multi, &msgsLeft)) {
+            if (msg->msg == CURLMSG_DONE) {
+                HandleDone(msg->easy_handle, msg->data.result);
+            }
+        }
+
+        // 没有可读写的socket时最多阻塞100ms，Submit会通过wakeup提前唤醒
+        curl_multi_poll(multi, nullptr, 0, PollTimeout(), nullptr);
+    }
+    AbortAll();
+}
+
+// 令牌恢复后继续暂停的传输；恢复时curl会立即用保留的数据再次调用写回调，带宽仍不足时会重新暂停
+void SegmentFetcher::ResumePaused() {
+    if (paused.empty()) return;
+    const auto now = TokenBucket::Clock::now();
+    std::vector<Transfer*> waiting;
+    waiting.swap(paused);
+    for (auto* transfer : waiting) {
+        if (IsCancelled(transfer->task) || (bandwidth.Ready(now) && transfer->task.job->bandwidth.Ready(now))) {
+            transfer->waiting = false;
+            transfer->progressAt = std::chrono::steady_clock::now();
+            curl_easy_pause(transfer->easy, CURLPAUSE_CONT);
+        } else {
+            paused.push_back(transfer);
+        }
+    }
+}
+
+// 有暂停的传输时按最早恢复的时间唤醒，否则最多阻塞100ms
+int SegmentFetcher::PollTimeout() {
+    std::chrono::milliseconds timeout(100);
+    const auto now = TokenBucket::Clock::now();
+    for (auto* transfer : paused) {
+        auto wait = std::max(bandwidth.WaitTime(now), transfer->task.job->bandwidth.WaitTime(now));
+        timeout = std::min(timeout, std::max(wait, std::chrono::milliseconds(1)));
+    }
+    return static_cast<int>(timeout.count());
+}
+
+// 按总并发上限、各任务的上限和各源站的窗口启动等待中的传输，重试任务优先；
+// 先保证每个任务的保底传输数，剩余名额按优先级依次分配：提升过的任务在前，其余按剩余分片数从少到多（SRPT），
+// 同时下载多个视频时先完成的视频尽早完成，而不是所有视频一起拖到最后
+void SegmentFetcher::StartPending() {
+    auto now = std::chrono::steady_clock::now();
+    if (hostLimitsChanged.exchange(false, std::memory_order_acq_rel)) {
+        for (auto& item : hosts) {
+            item.second->limit = HostLimit(item.first);
+        }
+        UpdateWindow();
+    }
+    if (options.adaptive) {
+        bool changed = false;
+        for (auto& item : hosts) {
+            HostState& host = *item.second;
+            const size_t old = host.controller.Window();
+            if (host.controller.Tick(now)) {
+                std::cout << "[Fetcher] " << host.name << " window " << old << " -> " << host.controller.Window() << std::endl;
+                changed = true;
+            }
+        }
+        if (changed) UpdateWindow();
+    }
+
+    const size_t limit = maxConcurrent.load(std::memory_order_relaxed);
+    size_t started = inFlight.load(std::memory_order_relaxed);
+    std::vector<Transfer*> ready;
+    // 占用任务和源站的窗口，窗口已满时留到下一轮；已取消的分片不占名额，取出后直接结束
+    auto take = [&](Transfer* transfer) {
+        FetchJob& job = *transfer->task.job;
+        if (!transfer->host) transfer->host = HostOf(transfer->task.url);
+        const bool cancelled = IsCancelled(transfer->task);
+        if (!cancelled) {
+            if (job.inFlight >= job.maxConcurrent) return false;
+            if (options.adaptive && job.adaptive) {
+                if (job.controller.Tick(now)) {
+                    std::cout << "[Fetcher] Job window -> " << job.controller.Window() << std::endl;
+                }
+                if (job.inFlight >= job.controller.Window()) {
+                    job.controller.OnLimited();
+                    return false;
+                }
+            }
+            if (!HasRoom(transfer->host)) {
+                transfer->host->controller.OnLimited();
+                return false;
+            }
+            ++started;
+        }
+        ++job.inFlight;
+        ++transfer->host->inFlight;
+        ready.push_back(transfer);
+        return true;
+    };
+
+    for (auto it = retrying.begin(); it != retrying.end() && started < limit;) {
+        if (it->first <= now && take(it->second)) {
+            it = retrying.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        if (started < limit && !queues.empty()) {
+            struct Candidate {
+                JobQueue* queue;
+                bool boosted;
+                size_t remaining;
+            };
+            std::vector<Candidate> order;
+            order.reserve(queues.size());
+            for (auto& queue : queues) {
+                order.push_back({&queue, queue.job->Boosted(), queue.job->Remaining()});
+            }
+            std::stable_sort(order.begin(), order.end(), [](const Candidate& a, const Candidate& b) {
+                if (a.boosted != b.boosted) return a.boosted;
+                return a.remaining < b.remaining;
+            });
+
+            // 保底：每个任务轮流取一个，直到达到保底传输数
+            for (bool progress = true; progress && started < limit;) {
+                progress = false;
+                for (auto& candidate : order) {
+                    auto& pending = candidate.queue->pending;
+                    if (started < limit && !pending.empty() &&
+                        candidate.queue->job->inFlight < options.fairShare && take(pending.front())) {
+                        pending.pop_front();
+                        progress = true;
+                    }
+                }
+            }
+            // 剩余名额按优先级顺序分配，任务或源站已满时轮到下一个任务
+            for (auto& candidate : order) {
+                auto& pending = candidate.queue->pending;
+                while (started < limit && !pending.empty() && take(pending.front())) {
+                    pending.pop_front();
+                }
+            }
+        }
+        queues.erase(std::remove_if(queues.begin(), queues.end(),
+                                    [](const JobQueue& queue) { return queue.pending.empty(); }),
+                     queues.end());
+    }
+
+    std::vector<Transfer*> hits;
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        hits.swap(served);
+    }
+    // 回调中可能再次Submit，因此不能持锁启动/结束传输
+    // 缓存命中的分片直接结束，不占用连接和带宽
+    for (auto* transfer : hits) {
+        Finish(transfer, true);
+    }
+    for (auto* transfer : ready) {
+        if (IsCancelled(transfer->task) || !StartTransfer(transfer)) {
+            --transfer->task.job->inFlight;
+            --transfer->host->inFlight;
+            Finish(transfer, false);
+        }
+    }
+}
+
+// 从分片缓存读出内容写入sink，探测请求只写入前probeBytes字节；未命中或写入失败时返回false，改为从网络下载
+// 在I/O执行器中运行
+bool SegmentFetcher::ServeFromCache(Transfer* transfer) {
+    const SegmentTask& task = transfer->task;
+    SegmentCache& cache = SegmentCache::Instance();
+    SegmentCache::Entry entry;
+    if (!cache.Lookup(task.url, entry)) return false;
+
+    if (!task.headOnly) {
+        FILE* fp = fopen(entry.blob.c_str(), "rb");
+        if (!fp) return false;
+        std::shared_ptr<SegmentSink> sink = TargetSink(task);
+        uint64_t left = task.probeBytes > 0 ? std::min(entry.length, task.probeBytes) : entry.length;
+        bool ok = sink->Open();
+        std::vector<char> buffer(64 * 1024);
+        while (ok && left > 0) {
+            size_t n = fread(buffer.data(), 1, static_cast<size_t>(std::min<uint64_t>(left, buffer.size())), fp);
+            ok = n > 0 && sink->Write(buffer.data(), n) == n;
+            left -= n;
+        }
+        fclose(fp);
+        // 写入失败时sink中的数据作废，下载时会重新Open
+        if (!sink->Close(ok) || !ok) return false;
+    }
+    if (task.response) {
+        auto& response = *task.response;
+        response.httpCode = 200;
+        response.contentLength = static_cast<curl_off_t>(entry.length);
+        response.totalLength = static_cast<curl_off_t>(entry.length);
+        response.etag = entry.etag;
+    }
+    return true;
+}
+
+bool SegmentFetcher::StartTransfer(Transfer* transfer) {
+    const SegmentTask& task = transfer->task;
+    // 使用缓存的分片已在LookupCache中准备好sink
+    if (!transfer->sink) transfer->sink = TargetSink(task);
+    // 上一次传输中断时保留已收到的数据，只请求剩余部分
+    transfer->resumeFrom = 0;
+    transfer->restarted = false;
+    if (transfer->received > 0 && !transfer->rangeUnsupported && !task.headOnly && task.probeBytes == 0 &&
+        transfer->sink->Resume(transfer->received)) {
+        transfer->resumeFrom = transfer->received;
+        std::cout << "[Download] Resume " << task.outputPath << " from " << transfer->resumeFrom << " bytes" << std::endl;
+    } else {
+        transfer->restarted = transfer->received > 0;
+        transfer->received = 0;
+        if (!transfer->sink->Open()) {
+            std::cerr << "[Fetcher] Cannot open sink: " << task.outputPath << std::endl;
+            return false;
+        }
+    }
+
+    // 从句柄池中借用，共享DNS缓存、TLS会话以及连接缓存
+    CURL* curl = CurlHandlePool::Instance().Acquire();
+    if (!curl) {
+        transfer->sink->Close(false);
+        return false;
+    }
+
+    curl_easy_setopt(curl, CURLOPT_URL, task.url.c_str());
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    // 建立连接超时按该源站的平均建连时间推算；传输过程不设总超时，由ProgressCallback检测卡顿
+    long connectTimeout = 10000;
+    if (transfer->host->connectSeconds > 0) {
+        connectTimeout = std::clamp(static_cast<long>(transfer->host->connectSeconds * 4000), 2000L, 10000L);
+    }
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, connectTimeout);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, transfer);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, HeaderCallback);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, transfer);
+    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+    curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, ProgressCallback);
+    curl_easy_setopt(curl, CURLOPT_XFERINFODATA, transfer);
+    curl_easy_setopt(curl, CURLOPT_PRIVATE, transfer);
+    if (transfer->primary) {
+        // 对冲请求使用新连接，原连接卡住或者落到了慢节点时不受影响
+        curl_easy_setopt(curl, CURLOPT_FRESH_CONNECT, 1L);
+    }
+    if (task.headOnly) {
+        curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+    }
+    if (task.probeBytes > 0) {
+        curl_easy_setopt(curl, CURLOPT_RANGE, ("0-" + std::to_string(task.probeBytes - 1)).c_str());
+    }
+    if (transfer->resumeFrom > 0) {
+        // 服务端忽略Range返回200时curl会以CURLE_RANGE_ERROR结束，响应体不会写入sink
+        curl_easy_setopt(curl, CURLOPT_RESUME_FROM_LARGE, static_cast<curl_off_t>(transfer->resumeFrom));
+        // If-Range：资源在两次请求之间发生变化时服务端返回完整的新内容，而不是拼接出错误的数据
+        // 弱ETag不能用于If-Range，此时退回Last-Modified
+        std::string validator = transfer->etag.empty() || transfer->etag.compare(0, 2, "W/") == 0
+                                    ? transfer->lastModified : transfer->etag;
+        if (!validator.empty()) {
+            transfer->headers = curl_slist_append(nullptr, ("If-Range: " + validator).c_str());
+            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, transfer->headers);
+        }
+    }
+    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);  // 关闭ssl校验
+    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0L);
+    curl_easy_setopt(curl, CURLOPT_SSLVERSION, CURL_SSLVERSION_TLSv1_2);
+    curl_easy_setopt(curl, CURLOPT_USERAGENT,
+                         "Mozilla/5.0 (Macintosh; Intel Mac OS X 10_15_7)"
+                         "AppleWebKit/537.36 (KHTML, like Gecko) Chrome/138.0.0.0 Safari/537.36");
+    if (task.job->http2) {
+        // 通过ALPN协商HTTP/2，不支持时自动回退HTTP/1.1
+        curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+        // 连接握手期间新的传输先等待，确认能否复用后再决定是否新建连接
+        curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+    } else {
+        curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
+    }
+
+    transfer->easy = curl;
+    transfer->started = std::chrono::steady_clock::now();
+    transfer->responded = false;
+    transfer->sizeReported = false;
+    transfer->progressBytes = 0;
+    transfer->progressAt = transfer->started;
+    transfer->waiting = false;
+    transfer->stalled = false;
+    curl_multi_add_handle(multi, curl);
+    active.insert(transfer);
+    inFlight.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+void SegmentFetcher::HandleDone(CURL* easy, CURLcode res) {
+    Transfer* transfer = nullptr;
+    curl_easy_getinfo(easy, CURLINFO_PRIVATE, &transfer);
+    long responseCode = 0;
+    curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &responseCode);
+    // 只统计新建的连接，复用连接的建连时间接近0
+    long connects = 0;
+    curl_off_t connectTime = 0;
+    if (curl_easy_getinfo(easy, CURLINFO_NUM_CONNECTS, &connects) == CURLE_OK && connects > 0 &&
+        curl_easy_getinfo(easy, CURLINFO_CONNECT_TIME_T, &connectTime) == CURLE_OK && connectTime > 0) {
+        Ewma(transfer->host->connectSeconds, static_cast<double>(connectTime) / 1e6);
+    }
+    if (transfer->primary) {
+        HandleHedgeDone(transfer, res, responseCode);
+        return;
+    }
+    if (transfer->task.response) {
+        auto& response = *transfer->task.response;
+        response.httpCode = responseCode;
+        curl_easy_getinfo(easy, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &response.contentLength);
+        // 续传响应的Content-Length只是剩余部分
+        if (transfer->resumeFrom > 0 && response.contentLength >= 0) {
+            response.contentLength += static_cast<curl_off_t>(transfer->resumeFrom);
+        }
+        response.totalLength = responseCode == 206 ? transfer->totalLength : response.contentLength;
+        response.etag = transfer->etag;
+    }
+
+    Detach(transfer);
+
+    const SegmentTask& task = transfer->task;
+    // 服务端返回错误页面时curl同样是CURLE_OK，需要结合状态码判断；续传必须是206
+    bool success = res == CURLE_OK && responseCode < 400 && (transfer->resumeFrom == 0 || responseCode == 206);
+    if (task.probeBytes > 0 && res == CURLE_WRITE_ERROR && transfer->received >= task.probeBytes && responseCode < 400) {
+        // 探测请求收够数据后主动中断
+        success = true;
+    }
+    if (success) {
+        if (transfer->sink->Close(true)) {
+            if (transfer->cache) {
+                StoreInCache(transfer);
+            }
+            RecordLatency(transfer);
+            RecordHostStats(transfer, true);
+            Finish(transfer, true);
+            return;
+        }
+        // 收尾失败（如长度与预期不符），已写入的数据不可信
+        transfer->received = 0;
+    }
+
+    if (IsCancelled(task)) {
+        transfer->sink->Close(false);
+        Finish(transfer, false);
+        return;
+    }
+
+    HostState& host = *transfer->host;
+    const size_t oldWindow = host.controller.Window();
+    if (options.adaptive && (IsCongestion(res, responseCode) || transfer->stalled) && host.controller.OnCongestion(std::chrono::steady_clock::now())) {
+        std::cout << "[Fetcher] " << host.name << " congested, window " << oldWindow << " -> " << host.controller.Window() << std::endl;
+        UpdateWindow();
+    }
+    FetchJob& job = *task.job;
+    const size_t oldJobWindow = job.controller.Window();
+    if (options.adaptive && job.adaptive && (IsCongestion(res, responseCode) || transfer->stalled) &&
+        job.controller.OnCongestion(std::chrono::steady_clock::now())) {
+        std::cout << "[Fetcher] Job congested, window " << oldJobWindow << " -> " << job.controller.Window() << std::endl;
+    }
+
+    if (transfer->resumeFrom > 0 && (res == CURLE_RANGE_ERROR || responseCode == 416 || res == CURLE_OK)) {
+        // 服务端不支持Range，或者资源已经变化（If-Range不匹配），之后只能整片重新下载
+        transfer->rangeUnsupported = true;
+    }
+    if (res == CURLE_WRITE_ERROR || responseCode >= 400) {
+        // 写入失败或收到的是错误页面，已写入的数据不能作为续传的基础
+        transfer->received = 0;
+    }
+
+    if (transfer->stalled) {
+        // 卡顿的速度也计入吞吐量，源站整体变慢时阈值随之放宽
+        RecordHostStats(transfer, false);
+        std::cerr << "[Fetcher] Stalled: " << task.outputPath << " after " << transfer->progressBytes
+                  << " bytes, reissue" << std::endl;
+        // 收到的新数据能保留下来（完整下载、本次确实是从断点开始的、服务端支持续传）时不计入重试次数，
+        // 立即从断点重新请求；这样的重新请求也有上限，不会因为每次都收到一点数据而无限重试
+        const bool progressed = task.probeBytes == 0 && !task.headOnly && !transfer->restarted &&
+                                !transfer->rangeUnsupported && transfer->received > transfer->resumeFrom;
+        if (progressed && transfer->stallReissues < kMaxStallReissues) {
+            ++transfer->stallReissues;
+            retrying.emplace_back(std::chrono::steady_clock::now(), transfer);
+            return;
+        }
+        if (transfer->attempt++ < task.maxRetry) {
+            retrying.emplace_back(std::chrono::steady_clock::now(), transfer);
+            return;
+        }
+        transfer->sink->Close(false);
+        Finish(transfer, false);
+        return;
+    }
+
+    std::cerr << "[Segment] Download failed: " << task.outputPath
+              << " - " << curl_easy_strerror(res)
+              << ", HTTP code: " << responseCode
+              << std::endl;
+
+    // 新增重试机制，确保能正确下载每一片分片
+    if (transfer->attempt++ < task.maxRetry) {
+        std::cout << "[Download] retry " << transfer->attempt << " times file: " << task.outputPath << std::endl;
+        // sink保持打开，重试时从断点继续
+        retrying.emplace_back(std::chrono::steady_clock::now() + std::chrono::milliseconds(200), transfer);
+        return;
+    }
+    transfer->sink->Close(false);
+    Finish(transfer, false);
+}
+
+// 把传输从curl中移除并归还句柄，释放占用的名额
+void SegmentFetcher::Detach(Transfer* transfer) {
+    active.erase(transfer);
+    paused.erase(std::remove(paused.begin(), paused.end(), transfer), paused.end());
+    curl_multi_remove_handle(multi, transfer->easy);
+    CurlHandlePool::Instance().Release(transfer->easy);
+    transfer->easy = nullptr;
+    curl_slist_free_all(transfer->headers);
+    transfer->headers = nullptr;
+    inFlight.fetch_sub(1, std::memory_order_relaxed);
+    // 对冲请求不占任务的名额
+    if (!transfer->primary) --transfer->task.job->inFlight;
+    --transfer->host->inFlight;
+}
+
+// 只统计第一次就完整下载成功的分片，重试和续传的耗时不代表正常水平
+void SegmentFetcher::RecordLatency(const Transfer* transfer) {
+    const SegmentTask& task = transfer->task;
+    if (task.headOnly || task.probeBytes > 0) return;
+    ++task.job->completedSegments;
+    if (transfer->attempt > 0 || transfer->resumeFrom > 0) return;
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - transfer->started).count();
+    if (latencies.size() < kLatencySamples) {
+        latencies.push_back(seconds);
+    } else {
+        latencies[latencyNext] = seconds;
+        latencyNext = (latencyNext + 1) % kLatencySamples;
+    }
+    hedgeDelay = 0;
+}
+
+// 更新源站的吞吐量和分片大小；限速时的速度不代表源站的水平
+void SegmentFetcher::RecordHostStats(const Transfer* transfer, bool complete) {
+    const SegmentTask& task = transfer->task;
+    if (task.headOnly || task.probeBytes > 0 || bandwidth.Rate() > 0 || task.job->bandwidth.Rate() > 0) return;
+    HostState& host = *transfer->host;
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - transfer->started).count();
+    const uint64_t bytes = transfer->received > transfer->resumeFrom ? transfer->received - transfer->resumeFrom : 0;
+    if (seconds > 0 && bytes > 0) Ewma(host.rate, static_cast<double>(bytes) / seconds);
+    if (complete) Ewma(host.segmentBytes, static_cast<double>(transfer->received));
+}
+
+// 找出耗时超过阈值的分片发起对冲，每个任务的对冲次数受hedgeBudget限制
+void SegmentFetcher::CheckStragglers() {
+    if (!options.hedge || active.empty() || latencies.size() < kMinLatencySamples || bandwidth.Rate() > 0) return;
+    if (hedgeDelay == 0) {
+        std::vector<double> sorted(latencies);
+        size_t k = std::min(sorted.size() - 1, static_cast<size_t>(sorted.size() * options.hedgePercentile));
+        std::nth_element(sorted.begin(), sorted.begin() + k, sorted.end());
+        hedgeDelay = std::max(sorted[k], std::chrono::duration<double>(options.hedgeMinDelay).count());
+    }
+
+    const auto now = std::chrono::steady_clock::now();
+    std::vector<Transfer*> stragglers;
+    for (auto* transfer : active) {
+        const SegmentTask& task = transfer->task;
+        // 探测、HEAD和需要响应信息的请求不对冲；对冲结果整片写入内存，续传中的传输也不对冲
+        if (transfer->primary || transfer->hedge || task.headOnly || task.probeBytes > 0 || task.response ||
+            transfer->resumeFrom > 0 || task.job->bandwidth.Rate() > 0 || IsCancelled(task)) {
+            continue;
+        }
+        const HostState* host = transfer->host;
+        if (host->limit > 0 && host->inFlight >= host->limit) continue;
+        FetchJob& job = *task.job;
+        if (job.hedgesIssued >= static_cast<size_t>(job.completedSegments * options.hedgeBudget)) continue;
+        if (std::chrono::duration<double>(now - transfer->started).count() > hedgeDelay) {
+            // 先占用额度，同一轮中同一任务的多个分片不会超出预算；发起失败时归还
+            ++job.hedgesIssued;
+            stragglers.push_back(transfer);
+        }
+    }
+    for (auto* transfer : stragglers) {
+        StartHedge(transfer);
+    }
+}
+
+void SegmentFetcher::StartHedge(Transfer* primary) {
+    auto* hedge = new Transfer;
+    hedge->task.index = primary->task.index;
+    hedge->task.url = primary->task.url;
+    hedge->task.outputPath = primary->task.outputPath;
+    hedge->task.cancelled = primary->task.cancelled;
+    hedge->task.job = primary->task.job;
+    hedge->task.useCache = false;
+    hedge->owner = this;
+    hedge->host = primary->host;
+    hedge->primary = primary;
+    hedge->buffer = std::make_shared<MemorySink>();
+    hedge->sink = hedge->buffer;
+    ++hedge->host->inFlight;
+    if (!StartTransfer(hedge)) {
+        --hedge->host->inFlight;
+        --primary->task.job->hedgesIssued;
+        delete hedge;
+        return;
+    }
+    primary->hedge = hedge;
+    std::cout << "[Fetcher] Hedge " << primary->task.outputPath << " after "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - primary->started).count()
+              << " ms" << std::endl;
+}
+
+// 原请求已结束，中断并丢弃对冲请求
+void SegmentFetcher::DropHedge(Transfer* hedge) {
+    hedge->primary->hedge = nullptr;
+    Detach(hedge);
+    delete hedge;
+}
+
+// 对冲请求先完成：中断原请求（正在传输或等待重试），把对冲请求收到的数据重新写入原请求的sink
+void SegmentFetcher::HandleHedgeDone(Transfer* hedge, CURLcode res, long responseCode) {
+    Transfer* primary = hedge->primary;
+    std::vector<unsigned char> data = hedge->buffer->Take();
+    const std::string etag = hedge->etag;
+    DropHedge(hedge);
+    if (res != CURLE_OK || responseCode >= 400 || IsCancelled(primary->task)) {
+        return;
+    }
+
+    std::cout << "[Fetcher] Hedge won: " << primary->task.outputPath << std::endl;
+    if (primary->easy) {
+        Detach(primary);
+    } else {
+        retrying.erase(std::remove_if(retrying.begin(), retrying.end(),
+                                      [primary](const auto& item) { return item.second == primary; }),
+                       retrying.end());
+    }
+    primary->etag = etag;
+    SegmentSink& sink = *primary->sink;
+    if (sink.Open() && sink.Write(reinterpret_cast<const char*>(data.data()), data.size()) == data.size() && sink.Close(true)) {
+        if (primary->cache) {
+            StoreInCache(primary);
+        }
+        ++primary->task.job->completedSegments;
+        Finish(primary, true);
+        return;
+    }
+    // 数据写入失败，按原请求失败处理
+    primary->received = 0;
+    if (primary->attempt++ < primary->task.maxRetry) {
+        retrying.emplace_back(std::chrono::steady_clock::now() + std::chrono::milliseconds(200), primary);
+        return;
+    }
+    primary->sink->Close(false);
+    Finish(primary, false);
+}
+
+void SegmentFetcher::Finish(Transfer* transfer, bool success) {
+    if (transfer->hedge) DropHedge(transfer->hedge);
+    std::shared_ptr<FetchJob> job = transfer->task.job;
+    if (transfer->task.onComplete) {
+        transfer->task.onComplete(transfer->task.index, success);
+    }
+    transfer->promise.set_value(success);
+    delete transfer;
+    job->Done();
+}
+
+// 事件循环退出时，所有未完成的传输均以失败结束
+void SegmentFetcher::AbortAll() {
+    std::vector<Transfer*> left;
+    std::vector<Transfer*> hits;
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        for (auto& queue : queues) {
+            left.insert(left.end(), queue.pending.begin(), queue.pending.end());
+        }
+        queues.clear();
+        // 缓存命中的分片已经写好，按成功结束
+        hits.swap(served);
+    }
+    for (auto* transfer : hits) {
+        Finish(transfer, true);
+    }
+    for (auto& item : retrying) {
+        item.second->sink->Close(false);
+        left.push_back(item.second);
+    }
+    retrying.clear();
+    paused.clear();
+
+    // 对冲请求没有回调，直接丢弃
+    std::vector<Transfer*> hedges;
+    for (auto* transfer : active) {
+        if (transfer->primary) hedges.push_back(transfer);
+    }
+    for (auto* hedge : hedges) {
+        DropHedge(hedge);
+    }
+    for (auto* transfer : active) {
+        curl_multi_remove_handle(multi, transfer->easy);
+        CurlHandlePool::Instance().Release(transfer->easy);
+        curl_slist_free_all(transfer->headers);
+        transfer->sink->Close(false);
+        inFlight.fetch_sub(1, std::memory_order_relaxed);
+        --transfer->task.job->inFlight;
+        left.push_back(transfer);
+    }
+    active.clear();
+
+    for (auto* transfer : left) {
+        Finish(transfer, false);
+    }
+}
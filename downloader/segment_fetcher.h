@@ -0,0 +1,240 @@
+//
+// Created by 翔 on 25-11-20.
+//
+
+#ifndef SEGMENT_FETCHER_H
+#define SEGMENT_FETCHER_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <unordered_set>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <future>
+#include <chrono>
+#include <functional>
+#include <filesystem>
+#include <curl/curl.h>
+#include "segment_sink.h"
+#include "concurrency_controller.h"
+#include "rate_limiter.h"
+
+// 传输的响应信息，在onComplete之前由下载引擎填充
+struct SegmentResponse {
+    long httpCode = 0;
+    curl_off_t contentLength = -1;         // Content-Length，未知时为-1
+    curl_off_t totalLength = -1;           // 资源的完整大小：部分响应取Content-Range中的总长度，完整响应同Content-Length
+    std::string etag;                      // ETag，没有时为空
+};
+
+// 一个下载任务（通常对应一个视频）在下载引擎中的状态，同一任务的所有分片共用
+// 多个任务共用一个下载引擎时按剩余分片数从少到多调度（SRPT），先把快完成的视频下完；
+// 每个任务保底有少量传输，剩余量大的任务不会一直等待。单个任务的并发数不超过自己的上限；
+// 开启自适应并发时还不超过任务自己的AIMD窗口（按该任务的吞吐量和拥塞信号调整），与各源站的窗口同时生效
+class FetchJob {
+public:
+    explicit FetchJob(size_t maxConcurrent = 64, bool http2 = false, bool adaptive = true);
+    FetchJob(const FetchJob&) = delete;
+    FetchJob& operator=(const FetchJob&) = delete;
+
+    // 取消任务，未开始的分片直接失败，正在传输的分片会被中断
+    void Cancel() { cancelled.store(true, std::memory_order_release); }
+    bool Cancelled() const { return cancelled.load(std::memory_order_acquire); }
+    // 等待已提交的分片全部结束，返回后不会再有该任务的回调
+    void Wait();
+    // 限制该任务的下载带宽（字节/秒），0表示不限速，下载过程中也可以调整
+    void SetRateLimit(uint64_t bytesPerSecond) { bandwidth.SetRate(bytesPerSecond); }
+    // 提升优先级（例如用户在界面上选中的任务），排在所有未提升的任务之前调度
+    void SetBoost(bool enable) { boosted.store(enable, std::memory_order_relaxed); }
+    bool Boosted() const { return boosted.load(std::memory_order_relaxed); }
+    // 预计提交的分片总数。流式下载只提前提交一个窗口，告知总数后才能按实际剩余量排序
+    void SetExpectedSegments(size_t n);
+    // 剩余分片数：预计总数减去已结束的分片数，未设置预计总数时为已提交但尚未结束的分片数
+    size_t Remaining();
+
+    const size_t maxConcurrent;     // 该任务同时进行的传输上限
+    // HTTP/2多路复用：同一源站的分片作为多个stream复用一条（或少数几条）连接，
+    // 服务端不支持HTTP/2时通过ALPN自动回退HTTP/1.1；关闭时固定使用HTTP/1.1
+    const bool http2;
+    const bool adaptive;            // 是否按任务自己的AIMD窗口调整并发，关闭时固定按maxConcurrent并发
+
+private:
+    friend class SegmentFetcher;
+    void Add(size_t count);
+    void Done();
+
+    std::atomic<bool> cancelled{false};
+    std::atomic<bool> boosted{false};
+    std::mutex mutex;
+    std::condition_variable idle;
+    size_t outstanding = 0;         // 已提交但尚未结束的分片数
+    size_t finished = 0;            // 已结束的分片数
+    size_t expected = 0;            // 预计提交的分片总数，0表示未知
+    size_t inFlight = 0;            // 正在传输的分片数，仅在事件循环线程中访问
+    AimdController controller;      // 任务的并发窗口，仅在事件循环线程中访问
+    // 对冲预算按任务计算，一个任务用掉的额度不会影响其他任务，任务结束后随之释放；仅在事件循环线程中访问
+    size_t completedSegments = 0;   // 完整下载成功的分片数
+    size_t hedgesIssued = 0;        // 已发起的对冲请求数
+    TokenBucket bandwidth;
+};
+
+// 单个分片下载任务
+struct SegmentTask {
+    size_t index = 0;                      // 分片序号
+    std::string url;                       // 分片下载地址
+    std::filesystem::path outputPath;      // 本地保存路径
+    std::shared_ptr<SegmentSink> sink;     // 数据写入目标，为空时写入outputPath
+    std::shared_ptr<SegmentResponse> response; // 不为空时填充响应信息
+    bool headOnly = false;                 // 只请求响应头（HEAD），用于提前获取分片大小
+    // 不为0时只请求前probeBytes字节（Range），用于下载前的重复检测；服务端忽略Range时收够后中断
+    uint64_t probeBytes = 0;
+    int maxRetry = 5;                      // 失败后的最大重试次数
+    // 先查本地分片缓存（SegmentCache），命中时不发请求；完整下载成功的分片写入缓存
+    bool useCache = true;
+    // 取消标记，同一任务的所有分片共用，置为true后未开始的分片直接失败，正在传输的分片会被中断
+    std::shared_ptr<std::atomic<bool>> cancelled;
+    // 所属的下载任务，为空时归入下载引擎的默认任务
+    std::shared_ptr<FetchJob> job;
+    // 分片结束回调，在事件循环线程中执行，不要在回调中做耗时操作
+    std::function<void(size_t index, bool success)> onComplete;
+};
+
+// 下载引擎配置
+struct FetcherOptions {
+    size_t maxConcurrent = 64;              // 所有任务合计同时进行的传输上限
+    // 自适应并发：每个源站单独维护AIMD窗口（所有任务共用），每个任务也有自己的AIMD窗口（见FetchJob::adaptive），
+    // 吞吐量随并发上升时增大，遇到超时、429、5xx时缩小；maxConcurrent作为所有源站合计的上限。关闭时固定按上限并发
+    bool adaptive = true;
+    size_t initialConcurrent = 4;           // 每个源站的初始窗口
+    // 每个源站同时进行的传输上限，自适应窗口不会超过它；0表示只受窗口和总上限限制。
+    // 有些CDN会封禁并发连接过多的客户端，可以用SetHostLimit为单个源站单独设置
+    size_t maxPerHost = 0;
+    uint64_t rateLimit = 0;                 // 所有任务合计的下载带宽上限（字节/秒），0表示不限速
+    size_t fairShare = 2;                   // 每个有等待分片的任务至少同时进行的传输数（在各自上限和源站窗口内）
+    // 窗口变化时回调，参数为所有源站的窗口之和；在事件循环线程中执行
+    std::function<void(size_t window)> onWindowChange;
+    bool http2 = false;                     // 未指定任务的分片是否使用HTTP/2，见FetchJob::http2
+    long maxStreamsPerConnection = 100;     // 每条HTTP/2连接上的最大stream数，超出后才会新建连接
+    // 对冲请求：分片耗时超过近期分片耗时的hedgePercentile分位数（且不少于hedgeMinDelay）时，在新连接上再请求一次，
+    // 先完成的为准，另一个中断。每个任务的对冲次数不超过该任务已完成分片数的hedgeBudget，限速时慢是预期的，不对冲
+    bool hedge = true;
+    double hedgePercentile = 0.95;
+    double hedgeBudget = 0.05;
+    std::chrono::milliseconds hedgeMinDelay{1000};
+    // 卡顿检测，取代固定的连接超时和总超时：按源站近期的单连接吞吐量和分片大小推算正常耗时，
+    // 超过stall时间（正常耗时的2倍，限制在minStall和maxStall之间）没有收到数据，或者平均速度低于正常水平的lowSpeedRatio时，
+    // 中断并立即重新请求（从断点续传）。连接超时为该源站平均建连时间的4倍。限速暂停期间不计时，限速时不检查速度
+    std::chrono::milliseconds minStall{4000};
+    std::chrono::milliseconds maxStall{30000};
+    double lowSpeedRatio = 0.1;
+};
+
+// 基于curl_multi的分片下载引擎
+// 所有传输都在同一个事件循环线程中驱动，不会为每个分片占用一个系统线程，
+// 因此并发数只受网络限制，与cpu核心数无关
+class SegmentFetcher {
+public:
+    explicit SegmentFetcher(const FetcherOptions& opts = FetcherOptions());
+    ~SegmentFetcher();
+    SegmentFetcher(const SegmentFetcher&) = delete;
+    SegmentFetcher& operator=(const SegmentFetcher&) = delete;
+
+    // 进程级下载引擎，所有下载任务共用一个事件循环线程、一个连接池和一个总并发上限，
+    // 同时下载多个视频时不会按任务数成倍地占用线程和连接
+    static SegmentFetcher& Shared();
+
+    // 提交任务（线程安全），返回 future，值为分片最终是否下载成功
+    std::future<bool> Submit(SegmentTask task);
+    // 批量提交，只加一次锁、唤醒一次事件循环，提交后tasks被清空
+    std::vector<std::future<bool>> SubmitBatch(std::vector<SegmentTask>& tasks);
+    // 调整所有任务合计同时进行的传输上限
+    void SetMaxConcurrent(size_t n);
+    // 调整所有任务合计的下载带宽上限（字节/秒），0表示不限速
+    void SetRateLimit(uint64_t bytesPerSecond) { bandwidth.SetRate(bytesPerSecond); }
+    // 调整单个源站（URL中的host[:port]）同时进行的传输上限，0表示使用默认值
+    void SetHostLimit(const std::string& host, size_t n);
+    // 调整未单独设置的源站的传输上限，0表示不限制
+    void SetDefaultHostLimit(size_t n);
+    size_t InFlight() const { return inFlight.load(std::memory_order_relaxed); }
+    // 当前的并发窗口（所有源站之和，不超过上限）
+    size_t Window() const { return window.load(std::memory_order_relaxed); }
+
+private:
+    struct Transfer;
+    // 单个源站（host:port）的并发状态
+    struct HostState {
+        std::string name;
+        AimdController controller;
+        size_t inFlight = 0;
+        size_t limit = 0;                   // 传输上限，0表示不限制
+        // 近期完成的传输的滑动平均，用于卡顿检测；0表示还没有数据
+        double rate = 0;                    // 单个传输的吞吐量（字节/秒）
+        double segmentBytes = 0;            // 分片大小
+        double connectSeconds = 0;          // 建立连接的耗时
+    };
+    // 单个下载任务的等待队列
+    struct JobQueue {
+        std::shared_ptr<FetchJob> job;
+        std::deque<Transfer*> pending;
+    };
+    void Enqueue(Transfer* transfer);
+    HostState* HostOf(const std::string& url);
+    size_t HostLimit(const std::string& name);
+    bool HasRoom(const HostState* host) const;
+    void UpdateWindow();
+    void EventLoop();
+    void StartPending();
+    void ResumePaused();
+    int PollTimeout();
+    void LookupCache(Transfer* transfer);
+    void StoreInCache(const Transfer* transfer);
+    bool ServeFromCache(Transfer* transfer);
+    bool StartTransfer(Transfer* transfer);
+    void Detach(Transfer* transfer);
+    void RecordLatency(const Transfer* transfer);
+    void CheckStragglers();
+    void StartHedge(Transfer* primary);
+    void DropHedge(Transfer* hedge);
+    void HandleHedgeDone(Transfer* hedge, CURLcode res, long responseCode);
+    static size_t WriteCallback(void* ptr, size_t size, size_t nmemb, void* userdata);
+    static size_t HeaderCallback(char* buffer, size_t size, size_t nitems, void* userdata);
+    static int ProgressCallback(void* clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t, curl_off_t);
+    void RecordHostStats(const Transfer* transfer, bool complete);
+    void HandleDone(CURL* easy, CURLcode res);
+    void Finish(Transfer* transfer, bool success);
+    void AbortAll();
+
+    CURLM* multi = nullptr;
+    std::thread loopThread;
+    std::mutex queueMutex;                              // 保护queues、served和cacheTasks
+    std::vector<JobQueue> queues;                       // 有等待传输的任务
+    std::vector<Transfer*> served;                      // 缓存命中、等待事件循环结束的分片
+    size_t cacheTasks = 0;                              // 正在I/O执行器中读写缓存的任务数
+    std::condition_variable cacheIdle;
+    std::shared_ptr<FetchJob> defaultJob;               // 未指定任务的分片归入该任务
+    // 以下成员仅在事件循环线程中访问
+    std::unordered_set<Transfer*> active;               // 正在传输
+    std::vector<std::pair<std::chrono::steady_clock::time_point, Transfer*>> retrying; // 等待重试
+    std::unordered_map<std::string, std::unique_ptr<HostState>> hosts;
+    std::vector<Transfer*> paused;                      // 带宽用完而暂停的传输
+    std::vector<double> latencies;                      // 近期分片的耗时（秒），环形缓冲
+    size_t latencyNext = 0;
+    double hedgeDelay = 0;                              // 发起对冲的耗时阈值（秒），0表示需要重新计算
+    const FetcherOptions options;
+    std::atomic<size_t> maxConcurrent;
+    std::atomic<size_t> window;
+    std::atomic<size_t> inFlight{0};
+    std::atomic<bool> stop{false};
+    TokenBucket bandwidth;                              // 所有任务共用的带宽
+    std::mutex limitMutex;                              // 保护hostLimits和defaultHostLimit
+    std::unordered_map<std::string, size_t> hostLimits;
+    size_t defaultHostLimit;
+    std::atomic<bool> hostLimitsChanged{false};
+};
+
+#endif //SEGMENT_FETCHER_H
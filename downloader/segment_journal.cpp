@@ -0,0 +1,236 @@
+//
+// Created by 翔 on 25-11-29.
+//
+
+#include "segment_journal.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iterator>
+#include <fcntl.h>
+#include <unistd.h>
+#include <openssl/evp.h>
+
+static constexpr const char* kJournalMagic = "videoDownloader-journal 1";
+
+// 去掉地址中的查询参数，签名、过期时间等每次解析都会变化
+static std::string StripQuery(const std::string& url) {
+    return url.substr(0, url.find('?'));
+}
+
+SegmentJournal::SegmentJournal(std::filesystem::path path) : path(std::move(path)) {}
+
+SegmentJournal::~SegmentJournal() {
+    if (fd != -1) close(fd);
+}
+
+bool SegmentJournal::Open(const JournalSnapshot& current) {
+    std::lock_guard<std::mutex> lock(mutex);
+    resumed = Load(current);
+    if (!resumed && !Create(current)) {
+        std::cerr << "[Journal] Cannot create journal: " << path << std::endl;
+        return false;
+    }
+    fd = open(path.c_str(), O_WRONLY | O_APPEND);
+    return fd != -1;
+}
+
+bool SegmentJournal::Load(const JournalSnapshot& current) {
+    std::ifstream ifs(path, std::ios::binary);
+    if (!ifs) return false;
+    std::string content((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+    ifs.close();
+
+    // 最后一行没有换行符说明写到一半时崩溃，丢弃；截掉后续追加的记录才不会和它粘在一起
+    size_t complete = content.rfind('\n');
+    if (complete == std::string::npos) return false;
+    if (complete + 1 != content.size()) {
+        content.resize(complete + 1);
+        if (truncate(path.c_str(), static_cast<off_t>(content.size())) != 0) return false;
+    }
+
+    std::istringstream in(content);
+    std::string line;
+    if (!std::getline(in, line) || line != kJournalMagic) return false;
+
+    auto field = [&](const char* name, std::string& value) {
+        if (!std::getline(in, line)) return false;
+        size_t space = line.find(' ');
+        if (line.compare(0, space, name) != 0) return false;
+        value = space == std::string::npos ? "" : line.substr(space + 1);
+        return true;
+    };
+
+    JournalSnapshot loaded;
+    std::string sequence, plain, count;
+    if (!field("playlist", loaded.playlist) || !field("method", loaded.method) || !field("key", loaded.keyHex) ||
+        !field("iv", loaded.iv) || !field("sequence", sequence) || !field("plain", plain) ||
+        !field("segments", count)) {
+        return false;
+    }
+    loaded.mediaSequence = strtoull(sequence.c_str(), nullptr, 10);
+    loaded.plainSegments = plain == "1";
+    size_t segmentCount = strtoull(count.c_str(), nullptr, 10);
+    loaded.segments.reserve(segmentCount);
+    for (size_t i = 0; i < segmentCount; ++i) {
+        if (!std::getline(in, line)) return false;
+        loaded.segments.push_back(line);
+    }
+    if (!std::getline(in, line) || line != "end") return false;
+    if (!SameTask(loaded, current)) {
+        std::cout << "[Journal] Playlist changed, discard journal: " << path << std::endl;
+        return false;
+    }
+
+    // 记录：D <序号> <长度> <校验和>，M <已合并分片数> <已合并字节数>
+    std::vector<SegmentRecord> records(segmentCount);
+    size_t merged = 0;
+    uint64_t mergedSize = 0;
+    while (std::getline(in, line)) {
+        std::istringstream record(line);
+        std::string type;
+        record >> type;
+        if (type == "D") {
+            size_t index;
+            SegmentRecord r;
+            if (record >> index >> r.length >> r.checksum && index < segmentCount && r.checksum.size() == 64) {
+                records[index] = std::move(r);
+            }
+        } else if (type == "M") {
+            size_t n;
+            uint64_t bytes;
+            if (record >> n >> bytes && n <= segmentCount) {
+                merged = n;
+                mergedSize = bytes;
+            }
+        }
+    }
+
+    snapshot = std::move(loaded);
+    segments = std::move(records);
+    mergedCount = merged;
+    mergedBytes = mergedSize;
+    return true;
+}
+
+bool SegmentJournal::Create(const JournalSnapshot& current) {
+    snapshot = current;
+    segments.assign(current.segments.size(), SegmentRecord());
+    mergedCount = 0;
+    mergedBytes = 0;
+
+    std::ostringstream out;
+    out << kJournalMagic << '\n'
+        << "playlist " << current.playlist << '\n'
+        << "method " << current.method << '\n'
+        << "key " << current.keyHex << '\n'
+        << "iv " << current.iv << '\n'
+        << "sequence " << current.mediaSequence << '\n'
+        << "plain " << (current.plainSegments ? 1 : 0) << '\n'
+        << "segments " << current.segments.size() << '\n';
+    for (const auto& segment : current.segments) {
+        out << segment << '\n';
+    }
+    out << "end\n";
+    std::string header = out.str();
+
+    // 先写临时文件再rename，任何时候磁盘上的头部都是完整的
+    std::filesystem::path temp = path;
+    temp += ".tmp";
+    int tmp = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (tmp == -1) return false;
+    bool ok = write(tmp, header.data(), header.size()) == static_cast<ssize_t>(header.size()) && fsync(tmp) == 0;
+    ok = close(tmp) == 0 && ok;
+    std::error_code ec;
+    if (ok) std::filesystem::rename(temp, path, ec);
+    if (!ok || ec) {
+        std::filesystem::remove(temp, ec);
+        return false;
+    }
+    return true;
+}
+
+bool SegmentJournal::SameTask(const JournalSnapshot& a, const JournalSnapshot& b) {
+    if (a.method != b.method || a.iv != b.iv || a.mediaSequence != b.mediaSequence ||
+        a.plainSegments != b.plainSegments || a.segments.size() != b.segments.size()) {
+        return false;
+    }
+    // key地址失效时本次没有拿到key，只要分片一致仍然可以续传
+    if (!a.keyHex.empty() && !b.keyHex.empty() && a.keyHex != b.keyHex) return false;
+    for (size_t i = 0; i < a.segments.size(); ++i) {
+        if (StripQuery(a.segments[i]) != StripQuery(b.segments[i])) return false;
+    }
+    return true;
+}
+
+void SegmentJournal::Append(const std::string& line) {
+    // 调用方已加锁；一次write写完整行，O_APPEND保证不会与其他记录交错
+    if (fd == -1) return;
+    if (write(fd, line.data(), line.size()) != static_cast<ssize_t>(line.size())) {
+        std::cerr << "[Journal] Write failed: " << path << std::endl;
+    }
+}
+
+void SegmentJournal::MarkDownloaded(size_t index, uint64_t length, const std::string& checksum) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (index >= segments.size()) return;
+    segments[index] = SegmentRecord{length, checksum};
+    Append("D " + std::to_string(index) + " " + std::to_string(length) + " " + checksum + "\n");
+}
+
+void SegmentJournal::MarkMerged(size_t count, uint64_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex);
+    mergedCount = count;
+    mergedBytes = bytes;
+    Append("M " + std::to_string(count) + " " + std::to_string(bytes) + "\n");
+}
+
+void SegmentJournal::Remove() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (fd != -1) {
+        close(fd);
+        fd = -1;
+    }
+    std::error_code ec;
+    std::filesystem::remove(path, ec);
+}
+
+bool SegmentJournal::VerifyFile(const std::filesystem::path& file, const SegmentRecord& record) {
+    if (record.checksum.empty()) return false;
+    std::error_code ec;
+    uint64_t size = std::filesystem::file_size(file, ec);
+    if (ec || size != record.length) return false;
+
+    int in = open(file.c_str(), O_RDONLY);
+    if (in == -1) return false;
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+    bool ok = ctx && EVP_DigestInit_ex(ctx, EVP_sha256(), nullptr) == 1;
+    static thread_local std::vector<unsigned char> buf(1024 * 1024);
+    while (ok) {
+        ssize_t n = read(in, buf.data(), buf.size());
+        if (n == 0) break;
+        if (n < 0) {
+            ok = false;
+            break;
+        }
+        ok = EVP_DigestUpdate(ctx, buf.data(), n) == 1;
+    }
+    close(in);
+
+    unsigned char hash[EVP_MAX_MD_SIZE];
+    unsigned int hashLen = 0;
+    ok = ok && EVP_DigestFinal_ex(ctx, hash, &hashLen) == 1;
+    EVP_MD_CTX_free(ctx);
+    if (!ok) return false;
+
+    static const char* const kHex = "0123456789abcdef";
+    std::string digest;
+    for (unsigned int i = 0; i < hashLen; ++i) {
+        digest.push_back(kHex[hash[i] >> 4]);
+        digest.push_back(kHex[hash[i] & 0x0F]);
+    }
+    return digest == record.checksum;
+}
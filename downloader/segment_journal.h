@@ -0,0 +1,78 @@
+//
+// Created by 翔 on 25-11-29.
+//
+
+#ifndef SEGMENT_JOURNAL_H
+#define SEGMENT_JOURNAL_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <filesystem>
+
+// 日志文件名，位于任务的分片目录下
+inline constexpr const char* kJournalFileName = "download.journal";
+
+// 任务快照，日志只对同一份播放列表有效
+struct JournalSnapshot {
+    std::string playlist;               // m3u8地址
+    std::string method;                 // 加密方式
+    std::string keyHex;                 // AES key（十六进制），key地址失效后仍可解密已下载的分片
+    std::string iv;                     // EXT-X-KEY中的IV属性
+    uint64_t mediaSequence = 0;
+    bool plainSegments = false;         // 落盘的分片是否已经解密
+    std::vector<std::string> segments;  // 分片地址
+};
+
+// 已下载分片的记录
+struct SegmentRecord {
+    uint64_t length = 0;
+    std::string checksum;               // 落盘内容的SHA-256，空表示未完成
+};
+
+// 下载任务日志，失败重试或程序重启后跳过已完成的分片，合并阶段从上一个检查点继续
+// 头部是任务快照（写临时文件后rename，保证完整），之后每完成一个分片追加一行记录，只追加不修改；
+// 崩溃时最多丢掉最后一行不完整的记录。分片文件是否完整由长度和校验和判断，因此下载时不需要fsync
+class SegmentJournal {
+public:
+    explicit SegmentJournal(std::filesystem::path path);
+    ~SegmentJournal();
+    SegmentJournal(const SegmentJournal&) = delete;
+    SegmentJournal& operator=(const SegmentJournal&) = delete;
+
+    // 加载已有日志；不存在或与current不是同一个任务时重新创建。返回false表示日志无法写入
+    bool Open(const JournalSnapshot& current);
+    // 是否从已有日志恢复
+    bool Resumed() const { return resumed; }
+    const JournalSnapshot& Snapshot() const { return snapshot; }
+
+    const SegmentRecord& Segment(size_t index) const { return segments[index]; }
+    void MarkDownloaded(size_t index, uint64_t length, const std::string& checksum);
+    // 合并检查点：前count个分片共bytes字节已经写入输出文件并落盘
+    void MarkMerged(size_t count, uint64_t bytes);
+    size_t MergedCount() const { return mergedCount; }
+    uint64_t MergedBytes() const { return mergedBytes; }
+    // 任务完成后删除日志
+    void Remove();
+
+    // 校验落盘分片的长度和校验和
+    static bool VerifyFile(const std::filesystem::path& file, const SegmentRecord& record);
+
+private:
+    bool Load(const JournalSnapshot& current);
+    bool Create(const JournalSnapshot& current);
+    void Append(const std::string& line);
+    static bool SameTask(const JournalSnapshot& a, const JournalSnapshot& b);
+
+    std::filesystem::path path;
+    JournalSnapshot snapshot;
+    std::vector<SegmentRecord> segments;
+    size_t mergedCount = 0;
+    uint64_t mergedBytes = 0;
+    bool resumed = false;
+    int fd = -1;                        // 以O_APPEND打开，每条记录一次write
+    std::mutex mutex;
+};
+
+#endif //SEGMENT_JOURNAL_H
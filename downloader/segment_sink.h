@@ -0,0 +1,191 @@
+//
+// Created by 翔 on 25-11-22.
+//
+
+#ifndef SEGMENT_SINK_H
+#define SEGMENT_SINK_H
+
+#include <cstdio>
+#include <cstdint>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <filesystem>
+#include "aes_decryptor.h"
+
+// 分片数据的写入目标，由下载引擎在curl写回调中调用
+class SegmentSink {
+public:
+    virtual ~SegmentSink() = default;
+    // 每次开始传输（包括重试）前调用，之前写入的数据全部作废
+    virtual bool Open() = 0;
+    // 写入收到的数据，返回值小于len时curl会中断当前传输
+    virtual size_t Write(const char* data, size_t len) = 0;
+    // 传输结束时调用，success为false表示本次传输失败；返回false表示收尾失败
+    virtual bool Close(bool success) = 0;
+    // 断点续传：保留前offset字节，之后的Write从offset处继续。不支持时返回false，下载引擎会改为调用Open从头下载
+    virtual bool Resume(uint64_t) { return false; }
+    // 响应头给出了分片的完整大小，在本次传输第一次Write之前调用；返回false时中断传输
+    virtual bool OnSize(uint64_t) { return true; }
+};
+
+// 写入本地文件
+class FileSink : public SegmentSink {
+public:
+    explicit FileSink(std::filesystem::path path) : path(std::move(path)) {}
+    ~FileSink() override {
+        if (fp) fclose(fp);
+    }
+
+    bool Open() override {
+        if (fp) fclose(fp);
+        fp = fopen(path.c_str(), "wb");
+        return fp != nullptr;
+    }
+    size_t Write(const char* data, size_t len) override {
+        return fwrite(data, 1, len, fp);
+    }
+    bool Close(bool) override {
+        if (!fp) return false;
+        bool ok = fclose(fp) == 0;
+        fp = nullptr;
+        return ok;
+    }
+    bool Resume(uint64_t offset) override {
+        if (!fp) fp = fopen(path.c_str(), "r+b");
+        if (!fp || fflush(fp) != 0) return false;
+        // 截掉断点之后可能残留的数据
+        return ftruncate(fileno(fp), static_cast<off_t>(offset)) == 0 &&
+               fseeko(fp, static_cast<off_t>(offset), SEEK_SET) == 0;
+    }
+
+private:
+    std::filesystem::path path;
+    FILE* fp = nullptr;
+};
+
+// 写入内存，流式模式下分片不落盘
+class MemorySink : public SegmentSink {
+public:
+    bool Open() override {
+        buffer.clear();
+        return true;
+    }
+    size_t Write(const char* data, size_t len) override {
+        buffer.insert(buffer.end(), data, data + len);
+        return len;
+    }
+    bool Close(bool) override { return true; }
+    bool Resume(uint64_t offset) override {
+        if (offset > buffer.size()) return false;
+        buffer.resize(offset);
+        return true;
+    }
+
+    // 取走已下载的数据
+    std::vector<unsigned char> Take() { return std::move(buffer); }
+
+private:
+    std::vector<unsigned char> buffer;
+};
+
+// 写入内部sink的同时计算长度和SHA-256，断点续传时据此校验落盘的分片，不需要再读一遍文件
+class ChecksumSink : public SegmentSink {
+public:
+    explicit ChecksumSink(std::shared_ptr<SegmentSink> inner) : inner(std::move(inner)), ctx(EVP_MD_CTX_new()) {}
+    ~ChecksumSink() override {
+        EVP_MD_CTX_free(ctx);
+    }
+    ChecksumSink(const ChecksumSink&) = delete;
+    ChecksumSink& operator=(const ChecksumSink&) = delete;
+
+    bool Open() override {
+        length = 0;
+        digest.clear();
+        return ctx && EVP_DigestInit_ex(ctx, EVP_sha256(), nullptr) == 1 && inner->Open();
+    }
+    size_t Write(const char* data, size_t len) override {
+        size_t n = inner->Write(data, len);
+        EVP_DigestUpdate(ctx, data, n);
+        length += n;
+        return n;
+    }
+    bool Close(bool success) override {
+        bool ok = inner->Close(success) && success;
+        unsigned char hash[EVP_MAX_MD_SIZE];
+        unsigned int hashLen = 0;
+        if (ok && EVP_DigestFinal_ex(ctx, hash, &hashLen) == 1) {
+            static const char* const kHex = "0123456789abcdef";
+            for (unsigned int i = 0; i < hashLen; ++i) {
+                digest.push_back(kHex[hash[i] >> 4]);
+                digest.push_back(kHex[hash[i] & 0x0F]);
+            }
+        }
+        return ok && !digest.empty();
+    }
+    bool Resume(uint64_t offset) override {
+        // 摘要只能继续累加，不能回退
+        return offset == length && inner->Resume(offset);
+    }
+    bool OnSize(uint64_t size) override { return inner->OnSize(size); }
+
+    uint64_t Length() const { return length; }
+    // 十六进制小写，传输成功后才有值
+    const std::string& Digest() const { return digest; }
+
+private:
+    std::shared_ptr<SegmentSink> inner;
+    EVP_MD_CTX* ctx;
+    uint64_t length = 0;
+    std::string digest;
+};
+
+// 边收边解密：在curl写回调中增量解密后写入内部sink，传输结束时明文已经就绪，不需要单独的解密阶段
+class DecryptSink : public SegmentSink {
+public:
+    DecryptSink(std::shared_ptr<SegmentSink> inner, std::vector<unsigned char> key, std::vector<unsigned char> iv)
+        : inner(std::move(inner)), key(std::move(key)), iv(std::move(iv)) {}
+
+    bool Open() override {
+        // 重试时从头开始，IV同样需要重置
+        consumed = 0;
+        produced = 0;
+        return decryptor.Init(key, iv) && inner->Open();
+    }
+    size_t Write(const char* data, size_t len) override {
+        plain.clear();
+        if (!decryptor.Update(reinterpret_cast<const unsigned char*>(data), len, plain)) return 0;
+        if (!plain.empty() && inner->Write(reinterpret_cast<const char*>(plain.data()), plain.size()) != plain.size()) return 0;
+        consumed += len;
+        produced += plain.size();
+        return len;
+    }
+    bool Resume(uint64_t offset) override {
+        // CBC链式状态和不完整的块都保存在解密器中，从已接收的位置继续即可接着解密
+        return offset == consumed && inner->Resume(produced);
+    }
+    // 解密时不去除填充，明文与密文大小相同
+    bool OnSize(uint64_t size) override { return inner->OnSize(size); }
+    bool Close(bool success) override {
+        if (success) {
+            plain.clear();
+            decryptor.Finish(plain);
+            if (!plain.empty() && inner->Write(reinterpret_cast<const char*>(plain.data()), plain.size()) != plain.size()) {
+                success = false;
+            }
+        }
+        return inner->Close(success) && success;
+    }
+
+private:
+    std::shared_ptr<SegmentSink> inner;
+    std::vector<unsigned char> key;
+    std::vector<unsigned char> iv;
+    CbcDecryptor decryptor;
+    std::vector<unsigned char> plain;   // 复用的明文缓冲区
+    uint64_t consumed = 0;              // 已接收的密文字节数
+    uint64_t produced = 0;              // 已写入inner的明文字节数
+};
+
+#endif //SEGMENT_SINK_H
@@ -0,0 +1,98 @@
+//
+// Created by 翔 on 25-11-30.
+//
+
+#ifndef TASK_H
+#define TASK_H
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// 执行器中的任务对象，只能移动不能拷贝
+// 不超过kInlineSize的闭包直接存放在对象内部（小对象优化），提交任务时不需要堆分配；
+// 与std::function相比不要求闭包可拷贝，可以直接捕获promise、unique_ptr等只能移动的对象
+class Task {
+public:
+    Task() = default;
+
+    template<class F, class = std::enable_if_t<!std::is_same_v<std::decay_t<F>, Task>>>
+    Task(F&& f) {
+        using Fn = std::decay_t<F>;
+        if constexpr (sizeof(Fn) <= kInlineSize && alignof(Fn) <= alignof(std::max_align_t) &&
+                      std::is_nothrow_move_constructible_v<Fn>) {
+            new (storage) Fn(std::forward<F>(f));
+            ops = &InlineOps<Fn>::ops;
+        } else {
+            *reinterpret_cast<Fn**>(storage) = new Fn(std::forward<F>(f));
+            ops = &HeapOps<Fn>::ops;
+        }
+    }
+
+    Task(Task&& other) noexcept { MoveFrom(other); }
+    Task& operator=(Task&& other) noexcept {
+        if (this != &other) {
+            Reset();
+            MoveFrom(other);
+        }
+        return *this;
+    }
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+    ~Task() { Reset(); }
+
+    explicit operator bool() const { return ops != nullptr; }
+    void operator()() { ops->invoke(storage); }
+
+    void Reset() {
+        if (ops) {
+            ops->destroy(storage);
+            ops = nullptr;
+        }
+    }
+
+private:
+    // 与ops一起正好占满一个64字节的缓存行
+    static constexpr size_t kInlineSize = 64 - sizeof(void*);
+
+    struct Ops {
+        void (*invoke)(void* storage);
+        void (*move)(void* dst, void* src);     // 移动后src中的对象已销毁
+        void (*destroy)(void* storage);
+    };
+
+    template<class Fn>
+    struct InlineOps {
+        static Fn* Get(void* p) { return std::launder(reinterpret_cast<Fn*>(p)); }
+        static void Invoke(void* p) { (*Get(p))(); }
+        static void Move(void* dst, void* src) {
+            new (dst) Fn(std::move(*Get(src)));
+            Get(src)->~Fn();
+        }
+        static void Destroy(void* p) { Get(p)->~Fn(); }
+        static constexpr Ops ops{Invoke, Move, Destroy};
+    };
+
+    template<class Fn>
+    struct HeapOps {
+        static Fn*& Get(void* p) { return *reinterpret_cast<Fn**>(p); }
+        static void Invoke(void* p) { (*Get(p))(); }
+        static void Move(void* dst, void* src) { Get(dst) = Get(src); }
+        static void Destroy(void* p) { delete Get(p); }
+        static constexpr Ops ops{Invoke, Move, Destroy};
+    };
+
+    void MoveFrom(Task& other) {
+        if (other.ops) {
+            other.ops->move(storage, other.storage);
+            ops = other.ops;
+            other.ops = nullptr;
+        }
+    }
+
+    alignas(std::max_align_t) unsigned char storage[kInlineSize];
+    const Ops* ops = nullptr;
+};
+
+#endif //TASK_H
@@ -5,96 +5,32 @@
 #ifndef THREAD_POOL_H
 #define THREAD_POOL_H
 
-#include <vector>
-#include <queue>
-#include <thread>
-#include <chrono>
-#include <mutex>
-#include <condition_variable>
 #include <future>
-#include <functional>
-#include <stdexcept>
+#include <type_traits>
+#include "executor.h"
 
+// 线程池，接口保持不变，内部为工作窃取执行器：
+// 任务是只能移动的小对象优化类型，提交时只锁一个分片队列，大量小任务可以用PostBatch批量提交
+// 新代码优先使用进程级的Executors::Cpu()/Io()，不要为每个阶段单独创建线程池
 class ThreadPool {
 public:
-    explicit ThreadPool(size_t threads);
-    ~ThreadPool();
+    explicit ThreadPool(size_t threads) : executor(threads) {}
 
     // 提交任务，返回 future
     template<class F, class... Args>
     auto enqueue(F&& f, Args&&... args)
-        -> std::future<typename std::invoke_result_t<F, Args...>>;
-
-private:
-    std::vector<std::thread> workers;                 // 线程集合
-    std::queue<std::function<void()>> tasks;          // 任务队列
-    std::mutex queue_mutex;                           // 队列互斥锁
-    std::condition_variable condition;                // 条件变量
-    bool stop;                                        // 停止标志
-};
-
-// 构造函数：启动指定数量的线程
-inline ThreadPool::ThreadPool(size_t threads) : stop(false) {
-    for (size_t i = 0; i < threads; ++i) {
-        workers.emplace_back([this] {
-            for (;;) {
-                std::function<void()> task;
-
-                // 等待任务或结束信号
-                {
-                    std::unique_lock<std::mutex> lock(this->queue_mutex);
-                    this->condition.wait(lock, [this] {
-                        return this->stop || !this->tasks.empty();
-                    });
-
-                    if (this->stop && this->tasks.empty())
-                        return;
-
-                    task = std::move(this->tasks.front());
-                    this->tasks.pop();
-                }
-
-                task(); // 执行任务
-            }
-        });
-    }
-}
-
-// 添加任务
-template<class F, class... Args>
-auto ThreadPool::enqueue(F&& f, Args&&... args)
-    -> std::future<typename std::invoke_result_t<F, Args...>>
-{
-    using return_type = typename std::invoke_result_t<F, Args...>;
-
-    auto task = std::make_shared<std::packaged_task<return_type()>>(
-        std::bind(std::forward<F>(f), std::forward<Args>(args)...)
-    );
-
-    std::future<return_type> res = task->get_future();
-    {
-        std::unique_lock<std::mutex> lock(queue_mutex);
-
-        if (stop)
-            throw std::runtime_error("enqueue on stopped ThreadPool");
-
-        tasks.emplace([task]() { (*task)(); });
-    }
-
-    condition.notify_one();
-    return res;
-}
-
-// 析构函数：等待所有线程结束
-inline ThreadPool::~ThreadPool() {
+        -> std::future<typename std::invoke_result_t<F, Args...>>
     {
-        std::unique_lock<std::mutex> lock(queue_mutex);
-        stop = true;
+        return executor.Submit(std::forward<F>(f), std::forward<Args>(args)...);
     }
+    // 提交任务，不关心结果，没有future的开销
+    void Post(Task task) { executor.Post(std::move(task)); }
+    // 批量提交，提交后tasks被清空
+    void PostBatch(std::vector<Task>& tasks) { executor.PostBatch(tasks); }
+    size_t Size() const { return executor.Size(); }
 
-    condition.notify_all();
-    for (std::thread &worker : workers)
-        worker.join();
-}
+private:
+    WorkStealingExecutor executor;
+};
 
-#endif // THREAD_POOL_H
\ No newline at end of file
+#endif // THREAD_POOL_H
@@ -0,0 +1,1040 @@
+//
+// Created by 翔 on 25-11-28.
+//
+
+#include "ts_remuxer.h"
+#include <iostream>
+#include <cstring>
+#include <algorithm>
+
+namespace {
+
+constexpr size_t kTsPacketSize = 188;
+constexpr int64_t kTsClock = 90000;                       // PES时间戳时钟
+constexpr int64_t kFragmentDuration = kTsClock;           // 每个fragment约1秒，在视频关键帧处切分
+constexpr uint32_t kDefaultVideoDuration = 3600;          // 无法推算帧时长时按25fps处理
+constexpr uint32_t kAacFrameSamples = 1024;
+constexpr int64_t kMaxTimestampJump = 10 * kTsClock;      // 向前跳变超过这个跨度视为时间戳不连续
+constexpr size_t kMaxPendingBytes = 64 * 1024 * 1024;     // 编码参数迟迟拿不到时最多缓存的样本数据
+
+constexpr uint32_t kSyncSampleFlags = 0x02000000;         // sample_depends_on = 2
+constexpr uint32_t kNonSyncSampleFlags = 0x01010000;      // sample_depends_on = 1, is_non_sync_sample = 1
+
+const int kAacSampleRates[] = {96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050, 16000, 12000, 11025, 8000, 7350};
+
+enum class Codec { H264, HEVC, AAC };
+
+// 按位读取，解析SPS用，越界后读到的都是0
+class BitReader {
+public:
+    BitReader(const unsigned char* data, size_t len) : data(data), bitLen(len * 8) {}
+
+    uint32_t Bits(int n) {
+        uint32_t v = 0;
+        for (int i = 0; i < n; ++i) {
+            v <<= 1;
+            if (pos < bitLen) v |= (data[pos >> 3] >> (7 - (pos & 7))) & 1;
+            ++pos;
+        }
+        return v;
+    }
+    void Skip(size_t n) { pos += n; }
+    uint32_t Ue() {
+        int zeros = 0;
+        while (Bits(1) == 0) {
+            if (++zeros >= 32) return 0;
+        }
+        return ((1u << zeros) - 1) + Bits(zeros);
+    }
+    int32_t Se() {
+        uint32_t k = Ue();
+        return (k & 1) ? static_cast<int32_t>((k + 1) / 2) : -static_cast<int32_t>(k / 2);
+    }
+    bool Overrun() const { return pos > bitLen; }
+
+private:
+    const unsigned char* data;
+    size_t bitLen;
+    size_t pos = 0;
+};
+
+// 去掉防竞争字节（00 00 03），得到RBSP
+std::vector<unsigned char> Unescape(const unsigned char* data, size_t len) {
+    std::vector<unsigned char> out;
+    out.reserve(len);
+    int zeros = 0;
+    for (size_t i = 0; i < len; ++i) {
+        if (zeros >= 2 && data[i] == 3) {
+            zeros = 0;
+            continue;
+        }
+        out.push_back(data[i]);
+        zeros = data[i] == 0 ? zeros + 1 : 0;
+    }
+    return out;
+}
+
+// 按大端序构造MP4 box
+class BoxWriter {
+public:
+    std::vector<unsigned char> buf;
+
+    void U8(uint32_t v) { buf.push_back(static_cast<unsigned char>(v)); }
+    void U16(uint32_t v) { U8(v >> 8); U8(v); }
+    void U24(uint32_t v) { U8(v >> 16); U16(v); }
+    void U32(uint32_t v) { U16(v >> 16); U16(v); }
+    void U64(uint64_t v) { U32(static_cast<uint32_t>(v >> 32)); U32(static_cast<uint32_t>(v)); }
+    void Bytes(const void* data, size_t len) {
+        auto* p = static_cast<const unsigned char*>(data);
+        buf.insert(buf.end(), p, p + len);
+    }
+    void Zeros(size_t n) { buf.insert(buf.end(), n, 0); }
+
+    size_t Begin(const char* type) {
+        size_t pos = buf.size();
+        U32(0);
+        Bytes(type, 4);
+        return pos;
+    }
+    size_t BeginFull(const char* type, uint8_t version, uint32_t flags) {
+        size_t pos = Begin(type);
+        U32((static_cast<uint32_t>(version) << 24) | flags);
+        return pos;
+    }
+    void End(size_t pos) { Patch32(pos, static_cast<uint32_t>(buf.size() - pos)); }
+    void Patch32(size_t pos, uint32_t v) {
+        buf[pos] = v >> 24;
+        buf[pos + 1] = v >> 16;
+        buf[pos + 2] = v >> 8;
+        buf[pos + 3] = v;
+    }
+    void Matrix() {
+        const uint32_t matrix[9] = {0x00010000, 0, 0, 0, 0x00010000, 0, 0, 0, 0x40000000};
+        for (uint32_t v : matrix) U32(v);
+    }
+};
+
+int64_t ReadTimestamp(const unsigned char* p) {
+    return (static_cast<int64_t>(p[0] >> 1) & 0x07) << 30 |
+           static_cast<int64_t>(p[1]) << 22 |
+           static_cast<int64_t>(p[2] >> 1) << 15 |
+           static_cast<int64_t>(p[3]) << 7 |
+           (p[4] >> 1);
+}
+
+// 按Annex B起始码拆分NAL单元
+std::vector<std::pair<const unsigned char*, size_t>> SplitNalUnits(const unsigned char* data, size_t len) {
+    std::vector<std::pair<const unsigned char*, size_t>> nals;
+    size_t i = 0;
+    size_t start = SIZE_MAX;
+    while (i + 3 <= len) {
+        if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1) {
+            if (start != SIZE_MAX) nals.emplace_back(data + start, i - start);
+            i += 3;
+            start = i;
+            continue;
+        }
+        ++i;
+    }
+    if (start != SIZE_MAX && start < len) nals.emplace_back(data + start, len - start);
+
+    // 四字节起始码的前导0和trailing_zero_8bits都挂在上一个NAL末尾，去掉
+    for (auto& nal : nals) {
+        while (nal.second > 0 && nal.first[nal.second - 1] == 0) --nal.second;
+    }
+    nals.erase(std::remove_if(nals.begin(), nals.end(), [](const auto& nal) { return nal.second == 0; }), nals.end());
+    return nals;
+}
+
+} // namespace
+
+
+namespace {
+
+// 从SPS中取出写sample entry需要的参数
+struct SpsInfo {
+    int width = 0;
+    int height = 0;
+    uint32_t chromaFormat = 1;
+    uint32_t bitDepthLuma = 8;
+    uint32_t bitDepthChroma = 8;
+    std::vector<unsigned char> ptl;     // HEVC general_profile_tier_level，12字节
+    uint32_t subLayers = 1;             // HEVC
+    uint32_t temporalNesting = 0;       // HEVC
+};
+
+bool ParseH264Sps(const unsigned char* nal, size_t len, SpsInfo& info) {
+    if (len < 4) return false;
+    std::vector<unsigned char> rbsp = Unescape(nal + 1, len - 1);
+    BitReader br(rbsp.data(), rbsp.size());
+
+    uint32_t profile = br.Bits(8);
+    br.Skip(16);            // constraint_set flags + level_idc
+    br.Ue();                // seq_parameter_set_id
+    uint32_t chromaFormat = 1;
+    if (profile == 100 || profile == 110 || profile == 122 || profile == 244 || profile == 44 ||
+        profile == 83 || profile == 86 || profile == 118 || profile == 128 || profile == 138 ||
+        profile == 139 || profile == 134 || profile == 135) {
+        chromaFormat = br.Ue();
+        if (chromaFormat == 3) br.Skip(1);
+        info.bitDepthLuma = br.Ue() + 8;
+        info.bitDepthChroma = br.Ue() + 8;
+        br.Skip(1);         // qpprime_y_zero_transform_bypass_flag
+        if (br.Bits(1)) {   // seq_scaling_matrix_present_flag
+            int lists = chromaFormat != 3 ? 8 : 12;
+            for (int i = 0; i < lists; ++i) {
+                if (!br.Bits(1)) continue;
+                int size = i < 6 ? 16 : 64;
+                int last = 8;
+                int next = 8;
+                for (int j = 0; j < size; ++j) {
+                    if (next != 0) next = (last + br.Se() + 256) % 256;
+                    if (next != 0) last = next;
+                }
+            }
+        }
+    }
+    info.chromaFormat = chromaFormat;
+
+    br.Ue();                // log2_max_frame_num_minus4
+    uint32_t pocType = br.Ue();
+    if (pocType == 0) {
+        br.Ue();
+    } else if (pocType == 1) {
+        br.Skip(1);
+        br.Se();
+        br.Se();
+        uint32_t cycle = br.Ue();
+        if (cycle > 255) return false;
+        for (uint32_t i = 0; i < cycle; ++i) br.Se();
+    }
+    br.Ue();                // max_num_ref_frames
+    br.Skip(1);             // gaps_in_frame_num_value_allowed_flag
+    uint32_t widthMbs = br.Ue() + 1;
+    uint32_t heightMapUnits = br.Ue() + 1;
+    uint32_t frameMbsOnly = br.Bits(1);
+    if (!frameMbsOnly) br.Skip(1);
+    br.Skip(1);             // direct_8x8_inference_flag
+
+    uint32_t cropLeft = 0, cropRight = 0, cropTop = 0, cropBottom = 0;
+    if (br.Bits(1)) {
+        cropLeft = br.Ue();
+        cropRight = br.Ue();
+        cropTop = br.Ue();
+        cropBottom = br.Ue();
+    }
+    if (br.Overrun()) return false;
+
+    uint32_t cropUnitX = 1;
+    uint32_t cropUnitY = 2 - frameMbsOnly;
+    if (chromaFormat != 0) {
+        cropUnitX = chromaFormat == 3 ? 1 : 2;
+        cropUnitY *= chromaFormat == 1 ? 2 : 1;
+    }
+    info.width = static_cast<int>(widthMbs * 16 - (cropLeft + cropRight) * cropUnitX);
+    info.height = static_cast<int>((2 - frameMbsOnly) * heightMapUnits * 16 - (cropTop + cropBottom) * cropUnitY);
+    return info.width > 0 && info.height > 0;
+}
+
+bool ParseHevcSps(const unsigned char* nal, size_t len, SpsInfo& info) {
+    if (len < 15) return false;
+    std::vector<unsigned char> rbsp = Unescape(nal + 2, len - 2);
+    if (rbsp.size() < 13) return false;
+    BitReader br(rbsp.data(), rbsp.size());
+
+    br.Skip(4);             // sps_video_parameter_set_id
+    uint32_t maxSubLayersMinus1 = br.Bits(3);
+    info.subLayers = maxSubLayersMinus1 + 1;
+    info.temporalNesting = br.Bits(1);
+
+    // general_profile_tier_level 固定12字节，hvcC里原样使用
+    info.ptl.assign(rbsp.begin() + 1, rbsp.begin() + 13);
+    br.Skip(96);
+
+    bool profilePresent[8] = {};
+    bool levelPresent[8] = {};
+    for (uint32_t i = 0; i < maxSubLayersMinus1; ++i) {
+        profilePresent[i] = br.Bits(1);
+        levelPresent[i] = br.Bits(1);
+    }
+    if (maxSubLayersMinus1 > 0) {
+        for (uint32_t i = maxSubLayersMinus1; i < 8; ++i) br.Skip(2);
+    }
+    for (uint32_t i = 0; i < maxSubLayersMinus1; ++i) {
+        if (profilePresent[i]) br.Skip(88);
+        if (levelPresent[i]) br.Skip(8);
+    }
+
+    br.Ue();                // sps_seq_parameter_set_id
+    info.chromaFormat = br.Ue();
+    if (info.chromaFormat == 3) br.Skip(1);
+    uint32_t width = br.Ue();
+    uint32_t height = br.Ue();
+    if (br.Bits(1)) {       // conformance_window_flag
+        uint32_t left = br.Ue();
+        uint32_t right = br.Ue();
+        uint32_t top = br.Ue();
+        uint32_t bottom = br.Ue();
+        uint32_t subWidth = info.chromaFormat == 1 || info.chromaFormat == 2 ? 2 : 1;
+        uint32_t subHeight = info.chromaFormat == 1 ? 2 : 1;
+        width -= subWidth * (left + right);
+        height -= subHeight * (top + bottom);
+    }
+    info.bitDepthLuma = br.Ue() + 8;
+    info.bitDepthChroma = br.Ue() + 8;
+    if (br.Overrun()) return false;
+
+    info.width = static_cast<int>(width);
+    info.height = static_cast<int>(height);
+    return info.width > 0 && info.height > 0;
+}
+
+} // namespace
+
+struct TsRemuxer::Sample {
+    std::vector<unsigned char> data;
+    int64_t dts = 0;            // 90kHz
+    int64_t pts = 0;            // 90kHz
+    uint32_t duration = 0;      // 轨道时间刻度
+    bool keyframe = false;
+};
+
+struct TsRemuxer::Track {
+    uint16_t pid = 0;
+    Codec codec = Codec::H264;
+    uint32_t trackId = 0;
+    uint32_t timescale = kTsClock;
+    bool configured = false;            // 编码参数已齐全，可以写进moov
+
+    std::vector<unsigned char> pes;     // 正在组装的PES包
+    int64_t lastTs = -1;                // 上一个展开后的原始时间戳，用于处理33位回绕
+    int64_t tsOffset = 0;               // 时间戳不连续时的修正量
+    int64_t lastDts = -1;               // 上一个样本的解码时间（已修正）
+
+    // 视频
+    std::vector<unsigned char> vps, sps, pps;
+    SpsInfo spsInfo;
+    bool seenKeyframe = false;
+    uint32_t lastDuration = kDefaultVideoDuration;
+
+    // 音频
+    int objectType = 0;
+    int freqIndex = 0;
+    int channels = 0;
+    std::vector<unsigned char> adts;    // 跨PES的不完整ADTS帧
+    int64_t audioPts = -1;              // 当前PES第一帧的时间戳
+    int64_t audioFrames = 0;            // 当前PES已经切出的帧数
+
+    std::vector<Sample> samples;        // 等待写出的样本
+    size_t pendingBytes = 0;
+    uint64_t decodeTime = 0;            // 下一个fragment的baseMediaDecodeTime
+    bool decodeTimeValid = false;
+
+    bool IsVideo() const { return codec != Codec::AAC; }
+
+    // 展开33位时间戳
+    int64_t Unwrap(int64_t ts) {
+        if (lastTs >= 0) {
+            ts += lastTs & ~((1LL << 33) - 1);
+            if (ts < lastTs - (1LL << 32)) ts += 1LL << 33;
+            else if (ts > lastTs + (1LL << 32)) ts -= 1LL << 33;
+        }
+        lastTs = ts;
+        return ts;
+    }
+};
+
+TsRemuxer::TsRemuxer(const std::filesystem::path& outputFile)
+    : ofs(outputFile, std::ios::binary | std::ios::trunc) {
+    if (!ofs) {
+        std::cerr << "[Remux] Cannot open output file: " << outputFile << std::endl;
+    }
+}
+
+TsRemuxer::~TsRemuxer() = default;
+
+TsRemuxer::Track* TsRemuxer::FindTrack(uint16_t pid) {
+    for (auto& track : tracks) {
+        if (track->pid == pid) return track.get();
+    }
+    return nullptr;
+}
+
+bool TsRemuxer::Write(const unsigned char* data, size_t len) {
+    if (failed || !ofs) return false;
+
+    // 上次剩下的半个包和本次数据拼起来处理；分片按188字节对齐时carry始终为空，不产生拷贝
+    const unsigned char* buf = data;
+    size_t size = len;
+    if (!carry.empty()) {
+        carry.insert(carry.end(), data, data + len);
+        buf = carry.data();
+        size = carry.size();
+    }
+
+    size_t pos = 0;
+    while (pos + kTsPacketSize <= size) {
+        // 失步时逐字节向后找同步字节
+        if (buf[pos] != 0x47) {
+            ++pos;
+            continue;
+        }
+        ProcessPacket(buf + pos);
+        pos += kTsPacketSize;
+    }
+    std::vector<unsigned char> rest(buf + pos, buf + size);
+    carry.swap(rest);
+    return !failed;
+}
+
+void TsRemuxer::ProcessPacket(const unsigned char* packet) {
+    if (packet[1] & 0x80) return;       // transport_error_indicator
+    bool unitStart = packet[1] & 0x40;
+    uint16_t pid = ((packet[1] & 0x1F) << 8) | packet[2];
+    uint8_t adaptation = (packet[3] >> 4) & 0x03;
+
+    size_t offset = 4;
+    if (adaptation & 0x02) offset += 1 + packet[4];
+    if (!(adaptation & 0x01) || offset >= kTsPacketSize) return;
+    const unsigned char* payload = packet + offset;
+    size_t len = kTsPacketSize - offset;
+
+    if (pid == 0 || (pmtPid >= 0 && pid == pmtPid)) {
+        // PSI表在HLS里都很短，只处理单个包内的section
+        if (!unitStart || tracksKnown) return;
+        size_t pointer = payload[0];
+        if (1 + pointer >= len) return;
+        if (pid == 0) ProcessPat(payload + 1 + pointer, len - 1 - pointer);
+        else ProcessPmt(payload + 1 + pointer, len - 1 - pointer);
+        return;
+    }
+
+    Track* track = FindTrack(pid);
+    if (!track) return;
+    if (unitStart) {
+        if (!track->pes.empty()) ProcessPes(*track);
+        track->pes.assign(payload, payload + len);
+    } else if (!track->pes.empty()) {
+        track->pes.insert(track->pes.end(), payload, payload + len);
+    }
+
+    // PES_packet_length 已知时收齐就处理，不必等下一个包
+    if (track->pes.size() >= 6) {
+        size_t pesLen = (track->pes[4] << 8) | track->pes[5];
+        if (pesLen != 0 && track->pes.size() >= pesLen + 6) ProcessPes(*track);
+    }
+}
+
+void TsRemuxer::ProcessPat(const unsigned char* section, size_t len) {
+    if (len < 8 || section[0] != 0x00) return;
+    size_t sectionLen = ((section[1] & 0x0F) << 8) | section[2];
+    size_t end = std::min(len, sectionLen + 3);
+    if (end < 12) return;
+    // 跳过CRC，只取第一个节目
+    for (size_t i = 8; i + 4 <= end - 4; i += 4) {
+        uint16_t program = (section[i] << 8) | section[i + 1];
+        if (program == 0) continue;
+        pmtPid = ((section[i + 2] & 0x1F) << 8) | section[i + 3];
+        return;
+    }
+}
+
+void TsRemuxer::ProcessPmt(const unsigned char* section, size_t len) {
+    if (len < 12 || section[0] != 0x02) return;
+    size_t sectionLen = ((section[1] & 0x0F) << 8) | section[2];
+    size_t end = std::min(len, sectionLen + 3);
+    if (end < 16) return;
+    size_t programInfoLen = ((section[10] & 0x0F) << 8) | section[11];
+
+    bool hasVideo = false;
+    bool hasAudio = false;
+    for (size_t i = 12 + programInfoLen; i + 5 <= end - 4;) {
+        uint8_t streamType = section[i];
+        uint16_t pid = ((section[i + 1] & 0x1F) << 8) | section[i + 2];
+        size_t esInfoLen = ((section[i + 3] & 0x0F) << 8) | section[i + 4];
+        i += 5 + esInfoLen;
+
+        // 各取第一路视频和音频，其余流（字幕、私有数据等）忽略
+        auto track = std::make_unique<Track>();
+        track->pid = pid;
+        if ((streamType == 0x1B || streamType == 0x24) && !hasVideo) {
+            track->codec = streamType == 0x1B ? Codec::H264 : Codec::HEVC;
+            hasVideo = true;
+        } else if (streamType == 0x0F && !hasAudio) {
+            track->codec = Codec::AAC;
+            hasAudio = true;
+        } else {
+            // 私有数据、ID3元数据、SCTE-35可以直接丢弃，其他音视频编码（MP3、AC-3等）无法转封装
+            if (streamType != 0x1B && streamType != 0x24 && streamType != 0x0F &&
+                streamType != 0x06 && streamType != 0x15 && streamType != 0x86) {
+                std::cerr << "[Remux] Unsupported stream type 0x" << std::hex << static_cast<int>(streamType)
+                          << std::dec << " (PID " << pid << ")" << std::endl;
+                unsupported = true;
+            }
+            continue;
+        }
+        tracks.push_back(std::move(track));
+    }
+    tracksKnown = true;
+    // 视频轨放在前面
+    std::stable_sort(tracks.begin(), tracks.end(), [](const auto& a, const auto& b) {
+        return a->IsVideo() && !b->IsVideo();
+    });
+}
+
+void TsRemuxer::ProcessPes(Track& track) {
+    std::vector<unsigned char> pes;
+    pes.swap(track.pes);
+    if (pes.size() < 9 || pes[0] != 0 || pes[1] != 0 || pes[2] != 1) return;
+
+    size_t pesLen = (pes[4] << 8) | pes[5];
+    size_t end = pesLen != 0 ? std::min(pes.size(), pesLen + 6) : pes.size();
+    uint8_t ptsDtsFlags = pes[7] >> 6;
+    size_t headerEnd = 9 + pes[8];
+    if (headerEnd > end) return;
+
+    int64_t pts = -1;
+    int64_t dts = -1;
+    if ((ptsDtsFlags & 0x02) && headerEnd >= 14) {
+        pts = track.Unwrap(ReadTimestamp(pes.data() + 9));
+        dts = pts;
+        if (ptsDtsFlags == 0x03 && headerEnd >= 19) {
+            dts = pts - ((ReadTimestamp(pes.data() + 9) - ReadTimestamp(pes.data() + 14)) & ((1LL << 33) - 1));
+        }
+        pts += track.tsOffset;
+        dts += track.tsOffset;
+    }
+
+    if (track.IsVideo()) ProcessVideo(track, pes.data() + headerEnd, end - headerEnd, pts, dts);
+    else ProcessAudio(track, pes.data() + headerEnd, end - headerEnd, pts);
+}
+
+void TsRemuxer::ProcessVideo(Track& track, const unsigned char* data, size_t len, int64_t pts, int64_t dts) {
+    Sample sample;
+    sample.data.reserve(len + 64);
+    for (const auto& [nal, size] : SplitNalUnits(data, len)) {
+        int type;
+        bool aud, keyframe;
+        std::vector<unsigned char>* paramSet = nullptr;
+        if (track.codec == Codec::H264) {
+            type = nal[0] & 0x1F;
+            aud = type == 9;
+            keyframe = type == 5;
+            if (type == 7) paramSet = &track.sps;
+            else if (type == 8) paramSet = &track.pps;
+        } else {
+            type = (nal[0] >> 1) & 0x3F;
+            aud = type == 35;
+            keyframe = type >= 16 && type <= 21;
+            if (type == 32) paramSet = &track.vps;
+            else if (type == 33) paramSet = &track.sps;
+            else if (type == 34) paramSet = &track.pps;
+        }
+        if (aud) continue;
+        sample.keyframe |= keyframe;
+
+        // 参数集记录第一份用于sample entry，样本里仍保留一份（avc1/hev1允许带内参数集），中途切换参数也能正常解码
+        if (paramSet && paramSet->empty()) {
+            if (paramSet == &track.sps) {
+                SpsInfo info;
+                bool ok = track.codec == Codec::H264 ? ParseH264Sps(nal, size, info) : ParseHevcSps(nal, size, info);
+                if (ok) {
+                    track.spsInfo = std::move(info);
+                    paramSet->assign(nal, nal + size);
+                }
+            } else {
+                paramSet->assign(nal, nal + size);
+            }
+        }
+
+        uint32_t nalSize = static_cast<uint32_t>(size);
+        const unsigned char prefix[4] = {
+            static_cast<unsigned char>(nalSize >> 24), static_cast<unsigned char>(nalSize >> 16),
+            static_cast<unsigned char>(nalSize >> 8), static_cast<unsigned char>(nalSize)};
+        sample.data.insert(sample.data.end(), prefix, prefix + 4);
+        sample.data.insert(sample.data.end(), nal, nal + size);
+    }
+    if (sample.data.empty()) return;
+
+    if (!track.configured && !track.sps.empty() && !track.pps.empty() &&
+        (track.codec == Codec::H264 || !track.vps.empty())) {
+        track.configured = true;
+    }
+    // 第一个关键帧之前的帧无法解码，直接丢弃
+    if (!track.seenKeyframe) {
+        if (!sample.keyframe || !track.configured) return;
+        track.seenKeyframe = true;
+    }
+
+    if (dts < 0) {
+        // 没有时间戳的PES按上一帧推算
+        if (track.lastDts < 0) return;
+        dts = track.lastDts + track.lastDuration;
+        pts = dts;
+    }
+    sample.dts = dts;
+    sample.pts = pts;
+    AddSample(track, std::move(sample));
+}
+
+void TsRemuxer::ProcessAudio(Track& track, const unsigned char* data, size_t len, int64_t pts) {
+    // 上一个PES没有剩余数据时，本PES第一帧的时间戳就是PES时间戳
+    if (pts >= 0 && track.adts.empty()) {
+        track.audioPts = pts;
+        track.audioFrames = 0;
+    }
+    track.adts.insert(track.adts.end(), data, data + len);
+
+    size_t pos = 0;
+    std::vector<unsigned char>& buf = track.adts;
+    while (pos + 7 <= buf.size()) {
+        if (buf[pos] != 0xFF || (buf[pos + 1] & 0xF0) != 0xF0) {
+            ++pos;
+            continue;
+        }
+        bool protectionAbsent = buf[pos + 1] & 0x01;
+        int profile = buf[pos + 2] >> 6;
+        int freqIndex = (buf[pos + 2] >> 2) & 0x0F;
+        int channels = ((buf[pos + 2] & 0x01) << 2) | (buf[pos + 3] >> 6);
+        size_t frameLen = ((buf[pos + 3] & 0x03) << 11) | (buf[pos + 4] << 3) | (buf[pos + 5] >> 5);
+        size_t headerLen = protectionAbsent ? 7 : 9;
+        if (freqIndex >= 13 || frameLen <= headerLen) {
+            ++pos;
+            continue;
+        }
+        if (pos + frameLen > buf.size()) break;
+
+        if (!track.configured) {
+            track.objectType = profile + 1;
+            track.freqIndex = freqIndex;
+            track.channels = channels;
+            track.timescale = kAacSampleRates[freqIndex];
+            track.configured = true;
+        }
+
+        if (track.audioPts >= 0) {
+            Sample sample;
+            sample.data.assign(buf.begin() + pos + headerLen, buf.begin() + pos + frameLen);
+            sample.dts = track.audioPts + track.audioFrames * kAacFrameSamples * kTsClock / track.timescale;
+            sample.pts = sample.dts;
+            sample.duration = kAacFrameSamples;
+            sample.keyframe = true;
+            ++track.audioFrames;
+            AddSample(track, std::move(sample));
+        }
+        pos += frameLen;
+    }
+    buf.erase(buf.begin(), buf.begin() + pos);
+}
+
+void TsRemuxer::AddSample(Track& track, Sample&& sample) {
+    if (track.lastDts >= 0) {
+        int64_t delta = sample.dts - track.lastDts;
+        if (delta <= 0 || delta > kMaxTimestampJump) {
+            // 解码时间回退或大幅跳变（HLS的 DISCONTINUITY），之后的样本整体平移到紧接上一个样本的位置
+            int64_t step = track.IsVideo() ? track.lastDuration
+                                           : kAacFrameSamples * kTsClock / track.timescale;
+            int64_t shift = track.lastDts + step - sample.dts;
+            track.tsOffset += shift;
+            if (!track.IsVideo()) track.audioPts += shift;
+            sample.dts += shift;
+            sample.pts += shift;
+        }
+    }
+
+    if (track.IsVideo()) {
+        if (!track.samples.empty()) {
+            Sample& prev = track.samples.back();
+            prev.duration = static_cast<uint32_t>(sample.dts - prev.dts);
+            track.lastDuration = prev.duration;
+        }
+        // 在关键帧处切分fragment，保证每个fragment都能独立解码
+        if (sample.keyframe && headerWritten && !track.samples.empty() &&
+            sample.dts - track.samples.front().dts >= kFragmentDuration) {
+            WriteFragment(sample.dts);
+        }
+    } else if (headerWritten && !tracks.front()->IsVideo() && !track.samples.empty() &&
+               sample.dts - track.samples.front().dts >= kFragmentDuration) {
+        // 纯音频按时长切分
+        WriteFragment(sample.dts);
+    }
+
+    track.lastDts = sample.dts;
+    track.pendingBytes += sample.data.size();
+    track.samples.push_back(std::move(sample));
+
+    if (headerWritten) return;
+    if (HeaderReady()) {
+        WriteHeader();
+        return;
+    }
+    // 某一路流一直拿不到编码参数时不能无限缓存，放弃这一路
+    size_t pending = 0;
+    for (const auto& t : tracks) pending += t->pendingBytes;
+    if (pending > kMaxPendingBytes) {
+        DropUnconfiguredTracks();
+        if (!tracks.empty()) WriteHeader();
+    }
+}
+
+bool TsRemuxer::HeaderReady() const {
+    if (!tracksKnown || tracks.empty()) return false;
+    for (const auto& track : tracks) {
+        if (track->samples.empty()) return false;
+    }
+    return true;
+}
+
+void TsRemuxer::DropUnconfiguredTracks() {
+    tracks.erase(std::remove_if(tracks.begin(), tracks.end(), [](const auto& track) {
+        if (!track->samples.empty()) return false;
+        std::cerr << "[Remux] No usable data on PID " << track->pid << ", track dropped" << std::endl;
+        return true;
+    }), tracks.end());
+}
+
+void TsRemuxer::WriteHeader() {
+    baseDts = INT64_MAX;
+    uint32_t nextId = 1;
+    for (auto& track : tracks) {
+        baseDts = std::min(baseDts, track->samples.front().dts);
+        track->trackId = nextId++;
+    }
+
+    BoxWriter w;
+    size_t ftyp = w.Begin("ftyp");
+    w.Bytes("iso5", 4);
+    w.U32(512);
+    w.Bytes("iso5", 4);
+    w.Bytes("iso6", 4);
+    w.Bytes("mp41", 4);
+    w.End(ftyp);
+
+    size_t moov = w.Begin("moov");
+    size_t mvhd = w.BeginFull("mvhd", 0, 0);
+    w.U32(0);               // creation_time
+    w.U32(0);               // modification_time
+    w.U32(1000);            // timescale
+    w.U32(0);               // duration，由fragment决定
+    w.U32(0x00010000);      // rate
+    w.U16(0x0100);          // volume
+    w.Zeros(10);
+    w.Matrix();
+    w.Zeros(24);
+    w.U32(nextId);
+    w.End(mvhd);
+
+    for (const auto& track : tracks) {
+        const bool video = track->IsVideo();
+        const SpsInfo& info = track->spsInfo;
+
+        size_t trak = w.Begin("trak");
+        size_t tkhd = w.BeginFull("tkhd", 0, 0x000003);   // enabled | in_movie
+        w.U32(0);
+        w.U32(0);
+        w.U32(track->trackId);
+        w.U32(0);
+        w.U32(0);
+        w.Zeros(8);
+        w.U16(0);           // layer
+        w.U16(0);           // alternate_group
+        w.U16(video ? 0 : 0x0100);
+        w.U16(0);
+        w.Matrix();
+        w.U32(video ? static_cast<uint32_t>(info.width) << 16 : 0);
+        w.U32(video ? static_cast<uint32_t>(info.height) << 16 : 0);
+        w.End(tkhd);
+
+        size_t mdia = w.Begin("mdia");
+        size_t mdhd = w.BeginFull("mdhd", 0, 0);
+        w.U32(0);
+        w.U32(0);
+        w.U32(track->timescale);
+        w.U32(0);
+        w.U16(0x55C4);      // und
+        w.U16(0);
+        w.End(mdhd);
+
+        size_t hdlr = w.BeginFull("hdlr", 0, 0);
+        w.U32(0);
+        w.Bytes(video ? "vide" : "soun", 4);
+        w.Zeros(12);
+        const char* name = video ? "VideoHandler" : "SoundHandler";
+        w.Bytes(name, strlen(name) + 1);
+        w.End(hdlr);
+
+        size_t minf = w.Begin("minf");
+        if (video) {
+            size_t vmhd = w.BeginFull("vmhd", 0, 1);
+            w.Zeros(8);
+            w.End(vmhd);
+        } else {
+            size_t smhd = w.BeginFull("smhd", 0, 0);
+            w.Zeros(4);
+            w.End(smhd);
+        }
+        size_t dinf = w.Begin("dinf");
+        size_t dref = w.BeginFull("dref", 0, 0);
+        w.U32(1);
+        w.End(w.BeginFull("url ", 0, 1));   // 数据就在本文件中
+        w.End(dref);
+        w.End(dinf);
+
+        size_t stbl = w.Begin("stbl");
+        size_t stsd = w.BeginFull("stsd", 0, 0);
+        w.U32(1);
+        if (video) {
+            // 参数集同时保留在样本中，HEVC用hev1表示允许带内参数集
+            size_t entry = w.Begin(track->codec == Codec::H264 ? "avc1" : "hev1");
+            w.Zeros(6);
+            w.U16(1);           // data_reference_index
+            w.Zeros(16);
+            w.U16(info.width);
+            w.U16(info.height);
+            w.U32(0x00480000);  // 72 dpi
+            w.U32(0x00480000);
+            w.U32(0);
+            w.U16(1);           // frame_count
+            w.Zeros(32);        // compressorname
+            w.U16(0x0018);
+            w.U16(0xFFFF);
+
+            const auto& sps = track->sps;
+            const auto& pps = track->pps;
+            if (track->codec == Codec::H264) {
+                size_t avcC = w.Begin("avcC");
+                w.U8(1);
+                w.U8(sps[1]);   // profile_idc
+                w.U8(sps[2]);   // constraint flags
+                w.U8(sps[3]);   // level_idc
+                w.U8(0xFF);     // lengthSizeMinusOne = 3
+                w.U8(0xE1);
+                w.U16(sps.size());
+                w.Bytes(sps.data(), sps.size());
+                w.U8(1);
+                w.U16(pps.size());
+                w.Bytes(pps.data(), pps.size());
+                if (sps[1] == 100 || sps[1] == 110 || sps[1] == 122 || sps[1] == 244) {
+                    w.U8(0xFC | info.chromaFormat);
+                    w.U8(0xF8 | (info.bitDepthLuma - 8));
+                    w.U8(0xF8 | (info.bitDepthChroma - 8));
+                    w.U8(0);
+                }
+                w.End(avcC);
+            } else {
+                size_t hvcC = w.Begin("hvcC");
+                w.U8(1);
+                w.Bytes(info.ptl.data(), info.ptl.size());
+                w.U16(0xF000);  // min_spatial_segmentation_idc
+                w.U8(0xFC);     // parallelismType
+                w.U8(0xFC | info.chromaFormat);
+                w.U8(0xF8 | (info.bitDepthLuma - 8));
+                w.U8(0xF8 | (info.bitDepthChroma - 8));
+                w.U16(0);       // avgFrameRate
+                w.U8((info.subLayers << 3) | (info.temporalNesting << 2) | 0x03);
+                w.U8(3);
+                const std::pair<int, const std::vector<unsigned char>*> arrays[] = {
+                    {32, &track->vps}, {33, &sps}, {34, &pps}};
+                for (const auto& [type, nal] : arrays) {
+                    w.U8(type);
+                    w.U16(1);
+                    w.U16(nal->size());
+                    w.Bytes(nal->data(), nal->size());
+                }
+                w.End(hvcC);
+            }
+            w.End(entry);
+        } else {
+            int channels = track->channels > 0 ? track->channels : 2;
+            size_t entry = w.Begin("mp4a");
+            w.Zeros(6);
+            w.U16(1);
+            w.Zeros(8);
+            w.U16(channels);
+            w.U16(16);          // samplesize
+            w.Zeros(4);
+            w.U32(std::min<uint32_t>(track->timescale, 0xFFFF) << 16);
+
+            uint16_t asc = (track->objectType << 11) | (track->freqIndex << 7) | (track->channels << 3);
+            size_t esds = w.BeginFull("esds", 0, 0);
+            w.U8(0x03);         // ES_Descriptor
+            w.U8(25);
+            w.U16(track->trackId);
+            w.U8(0);
+            w.U8(0x04);         // DecoderConfigDescriptor
+            w.U8(17);
+            w.U8(0x40);         // MPEG-4 Audio
+            w.U8(0x15);         // AudioStream
+            w.U24(0);
+            w.U32(0);
+            w.U32(0);
+            w.U8(0x05);         // DecoderSpecificInfo: AudioSpecificConfig
+            w.U8(2);
+            w.U16(asc);
+            w.U8(0x06);         // SLConfigDescriptor
+            w.U8(1);
+            w.U8(0x02);
+            w.End(esds);
+            w.End(entry);
+        }
+        w.End(stsd);
+        // 样本表全部为空，样本信息都在moof中
+        for (const char* type : {"stts", "stsc", "stsz", "stco"}) {
+            size_t table = w.BeginFull(type, 0, 0);
+            if (strcmp(type, "stsz") == 0) w.U32(0);    // sample_size
+            w.U32(0);                                   // entry_count / sample_count
+            w.End(table);
+        }
+        w.End(stbl);
+
+        w.End(minf);
+        w.End(mdia);
+        w.End(trak);
+    }
+
+    size_t mvex = w.Begin("mvex");
+    for (const auto& track : tracks) {
+        size_t trex = w.BeginFull("trex", 0, 0);
+        w.U32(track->trackId);
+        w.U32(1);           // default_sample_description_index
+        w.U32(0);
+        w.U32(0);
+        w.U32(0);
+        w.End(trex);
+    }
+    w.End(mvex);
+    w.End(moov);
+
+    if (!ofs.write(reinterpret_cast<const char*>(w.buf.data()), static_cast<std::streamsize>(w.buf.size()))) {
+        failed = true;
+    }
+    headerWritten = true;
+}
+
+void TsRemuxer::WriteFragment(int64_t cutDts) {
+    struct Run {
+        Track* track;
+        size_t count;
+        size_t offsetPos;   // trun.data_offset 的位置，moof写完后回填
+        size_t dataSize;
+    };
+    std::vector<Run> runs;
+
+    BoxWriter w;
+    size_t moof = w.Begin("moof");
+    size_t mfhd = w.BeginFull("mfhd", 0, 0);
+    w.U32(++sequenceNumber);
+    w.End(mfhd);
+
+    for (auto& trackPtr : tracks) {
+        Track& track = *trackPtr;
+        size_t count = 0;
+        while (count < track.samples.size() && track.samples[count].dts < cutDts) ++count;
+        if (count == 0) continue;
+        // 最后一帧的时长无法从下一帧推算，沿用上一帧
+        if (track.IsVideo() && track.samples[count - 1].duration == 0) {
+            track.samples[count - 1].duration = track.lastDuration;
+        }
+
+        const Sample& first = track.samples.front();
+        uint64_t decodeTime = static_cast<uint64_t>(std::max<int64_t>(first.dts - baseDts, 0)) *
+                              track.timescale / kTsClock;
+        // 换算的舍入误差不超过一帧时接着上一个fragment，保证时间轴连续
+        if (track.decodeTimeValid && decodeTime < track.decodeTime + first.duration) {
+            decodeTime = track.decodeTime;
+        }
+
+        size_t traf = w.Begin("traf");
+        size_t tfhd = w.BeginFull("tfhd", 0, 0x020000);   // default-base-is-moof
+        w.U32(track.trackId);
+        w.End(tfhd);
+        size_t tfdt = w.BeginFull("tfdt", 1, 0);
+        w.U64(decodeTime);
+        w.End(tfdt);
+
+        // data-offset | duration | size | flags | composition-time-offset
+        size_t trun = w.BeginFull("trun", 1, 0x000F01);
+        w.U32(static_cast<uint32_t>(count));
+        size_t offsetPos = w.buf.size();
+        w.U32(0);
+        size_t dataSize = 0;
+        uint64_t duration = 0;
+        for (size_t i = 0; i < count; ++i) {
+            const Sample& s = track.samples[i];
+            w.U32(s.duration);
+            w.U32(static_cast<uint32_t>(s.data.size()));
+            w.U32(s.keyframe ? kSyncSampleFlags : kNonSyncSampleFlags);
+            w.U32(static_cast<uint32_t>(static_cast<int32_t>(track.IsVideo() ? s.pts - s.dts : 0)));
+            dataSize += s.data.size();
+            duration += s.duration;
+        }
+        w.End(trun);
+        w.End(traf);
+
+        track.decodeTime = decodeTime + duration;
+        track.decodeTimeValid = true;
+        runs.push_back({&track, count, offsetPos, dataSize});
+    }
+    w.End(moof);
+    if (runs.empty()) return;
+
+    size_t mdatSize = 8;
+    for (const auto& run : runs) {
+        w.Patch32(run.offsetPos, static_cast<uint32_t>(w.buf.size() + mdatSize));
+        mdatSize += run.dataSize;
+    }
+    w.U32(static_cast<uint32_t>(mdatSize));
+    w.Bytes("mdat", 4);
+    ofs.write(reinterpret_cast<const char*>(w.buf.data()), static_cast<std::streamsize>(w.buf.size()));
+
+    for (const auto& run : runs) {
+        auto& samples = run.track->samples;
+        for (size_t i = 0; i < run.count; ++i) {
+            ofs.write(reinterpret_cast<const char*>(samples[i].data.data()),
+                      static_cast<std::streamsize>(samples[i].data.size()));
+        }
+        samples.erase(samples.begin(), samples.begin() + static_cast<std::ptrdiff_t>(run.count));
+        run.track->pendingBytes -= run.dataSize;
+    }
+    if (!ofs) failed = true;
+}
+
+bool TsRemuxer::Finish() {
+    if (failed || !ofs) return false;
+    for (auto& track : tracks) {
+        if (!track->pes.empty()) ProcessPes(*track);
+    }
+    if (!headerWritten) {
+        DropUnconfiguredTracks();
+        if (tracks.empty()) {
+            std::cerr << "[Remux] No H.264/HEVC/AAC stream found" << std::endl;
+            failed = true;
+            return false;
+        }
+        WriteHeader();
+    }
+    WriteFragment(INT64_MAX);
+    ofs.close();
+    return !failed && !ofs.fail();
+}
+
+bool RemuxTsFilesToMp4(const std::vector<std::string>& tsFiles, const std::filesystem::path& mp4File) {
+    TsRemuxer remuxer(mp4File);
+    if (!remuxer.IsOpen()) return false;
+
+    std::vector<unsigned char> buffer(1024 * 1024);
+    for (const auto& tsFile : tsFiles) {
+        std::ifstream ifs(tsFile, std::ios::binary);
+        if (!ifs) {
+            std::cerr << "[Remux] Cannot open TS file: " << tsFile << std::endl;
+            return false;
+        }
+        while (ifs) {
+            ifs.read(reinterpret_cast<char*>(buffer.data()), static_cast<std::streamsize>(buffer.size()));
+            std::streamsize n = ifs.gcount();
+            if (n <= 0) break;
+            if (!remuxer.Write(buffer.data(), static_cast<size_t>(n)) || remuxer.Unsupported()) return false;
+        }
+    }
+    return remuxer.Finish();
+}
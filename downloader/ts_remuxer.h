@@ -0,0 +1,68 @@
+//
+// Created by 翔 on 25-11-28.
+//
+
+#ifndef TS_REMUXER_H
+#define TS_REMUXER_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <memory>
+#include <fstream>
+#include <filesystem>
+
+// 进程内 MPEG-TS -> MP4 转封装（只换容器，不重新编码）
+// 支持 H.264 / HEVC 视频与 AAC(ADTS) 音频，输出 fragmented MP4：
+// 拿到编码参数后立即在文件开头写出 moov，之后每个 fragment（moof + mdat）随输入数据增量写出，
+// 不需要先写完整的TS再读一遍，也不依赖主机上的ffmpeg
+class TsRemuxer {
+public:
+    explicit TsRemuxer(const std::filesystem::path& outputFile);
+    ~TsRemuxer();
+    TsRemuxer(const TsRemuxer&) = delete;
+    TsRemuxer& operator=(const TsRemuxer&) = delete;
+
+    bool IsOpen() const { return static_cast<bool>(ofs); }
+    // 按顺序输入TS数据，长度任意（不要求按188字节对齐）
+    bool Write(const unsigned char* data, size_t len);
+    // 输入结束，写出剩余样本；没有可用的音视频轨道时返回false
+    bool Finish();
+    // 节目中含有无法转封装的音视频编码（如MP3、AC-3），调用方应改用ffmpeg，避免静默丢掉这一路流
+    bool Unsupported() const { return unsupported; }
+
+private:
+    struct Sample;
+    struct Track;
+
+    void ProcessPacket(const unsigned char* packet);
+    void ProcessPat(const unsigned char* section, size_t len);
+    void ProcessPmt(const unsigned char* section, size_t len);
+    void ProcessPes(Track& track);
+    void ProcessVideo(Track& track, const unsigned char* data, size_t len, int64_t pts, int64_t dts);
+    void ProcessAudio(Track& track, const unsigned char* data, size_t len, int64_t pts);
+    void AddSample(Track& track, Sample&& sample);
+    bool HeaderReady() const;
+    void DropUnconfiguredTracks();
+    void WriteHeader();
+    // 写出所有解码时间早于cutDts的样本
+    void WriteFragment(int64_t cutDts);
+    Track* FindTrack(uint16_t pid);
+
+    std::ofstream ofs;
+    std::vector<unsigned char> carry;            // 未凑满一个TS包的数据
+    int pmtPid = -1;
+    bool tracksKnown = false;
+    bool headerWritten = false;
+    bool failed = false;
+    bool unsupported = false;
+    int64_t baseDts = 0;                         // 所有轨道的起始时间（90kHz）
+    uint32_t sequenceNumber = 0;                 // moof序号
+    std::vector<std::unique_ptr<Track>> tracks;
+};
+
+// 将按顺序排列的多个TS文件（如解密后的分片）直接转封装为一个MP4，不先合并出完整的TS；
+// 含有不支持的编码时返回false
+bool RemuxTsFilesToMp4(const std::vector<std::string>& tsFiles, const std::filesystem::path& mp4File);
+
+#endif //TS_REMUXER_H
@@ -18,6 +18,16 @@
 #include <QPlainTextEdit>
 #include <QStringList>
 #include <QFontMetrics>
+#include <QComboBox>
+
+// 下载流水线模式，在界面上选择，每次点击下载时读取
+enum class PipelineMode {
+    TempFiles,   // 分片落盘后再解密、合并，有任务日志，失败或重启后可以断点续传
+    Stream,      // 下载、解密、合并在内存中完成，中间分片不落盘，只写最终文件
+    Positional,  // 分片完成后直接写入输出文件的最终位置，不需要合并
+};
+// 临时文件模式下同一线路的下载次数，重试时只下载未完成的分片
+static constexpr int kDownloadAttempts = 3;
 
 int main(int argc, char *argv[]) {
     QApplication app(argc, argv);
@@ -41,6 +51,17 @@ int main(int argc, char *argv[]) {
     inputLayout->addWidget(label);
     inputLayout->addWidget(urlInput);
 
+    // 下载模式：默认使用临时文件模式，只有它支持断点续传，流式模式中途失败需要整条线路从头下载
+    QHBoxLayout *modeLayout = new QHBoxLayout();
+    QLabel *modeLabel = new QLabel("下载模式：");
+    QComboBox *modeBox = new QComboBox();
+    modeBox->addItem("临时文件（可断点续传）", static_cast<int>(PipelineMode::TempFiles));
+    modeBox->addItem("流式（分片不落盘）", static_cast<int>(PipelineMode::Stream));
+    modeBox->addItem("定位写入（直接写入最终文件）", static_cast<int>(PipelineMode::Positional));
+    modeBox->setCurrentIndex(0);
+    modeLayout->addWidget(modeLabel);
+    modeLayout->addWidget(modeBox, 1);
+
     // 下载按钮
     QPushButton *downloadBtn = new QPushButton("下载");
     // 显示下载视频的标题
@@ -91,6 +112,7 @@ int main(int argc, char *argv[]) {
 
     // 加入布局（输入框，下载按钮，标题框，进度条, 路径选择按钮）
     mainLayout->addLayout(inputLayout);
+    mainLayout->addLayout(modeLayout);
     mainLayout->addWidget(downloadBtn);
     // 在 URL 输入框和标题之间加 10 像素空白
     mainLayout->addSpacing(10);
@@ -158,6 +180,9 @@ int main(int argc, char *argv[]) {
             totalPercentLabel->setText(QString::number(initialProgress) + "%");
         }
 
+        // 本次点击的所有任务使用同一种下载模式
+        const PipelineMode pipelineMode = static_cast<PipelineMode>(modeBox->currentData().toInt());
+
         // 设置下载路径
         QString downloadPath;
         if (tipLabel->text() == "（默认下载路径为桌面）") {
@@ -237,42 +262,64 @@ int main(int argc, char *argv[]) {
 
                 std::filesystem::path basePath(downloadPath.toStdString());
                 // 解析m3u8文件占比20%，下载所有分片占比40%，合并所有分片占比30%，格式转换占比10%
-                for(auto item: m3u8Urls) {
+                // 所有线路并行解析并测速，从最快的线路开始下载，其余线路已解析好作为备用，失效时直接切换
+                updateProgress(10);
+                auto lines = m3u8Downloader::RaceMirrors(m3u8Urls);
+                for(auto& line: lines) {
+                    // 上一条线路失败时已在循环末尾销毁，它登记的指纹已经释放，当前线路重新登记
                     bool success = true;
-                    // 解析m3u8文件
-                    m3u8Downloader m3u8_downloader(item);
-                    updateProgress(10);
-                    m3u8_downloader.parseM3U8();
+                    m3u8Downloader& m3u8_downloader = *line;
                     //m3u8_downloader.printInfo();
                     updateProgress(20);
-                    // 目录不要拼接，否则路径中包含'/'时会出错
-                    std::filesystem::path dirPath = basePath.append(title);
+                    // 目录不要拼接，否则路径中包含'/'时会出错；每条线路都从同一目录开始
+                    std::filesystem::path dirPath = basePath / title;
+
+                    if (pipelineMode != PipelineMode::TempFiles) {
+                        std::filesystem::path outputFile = dirPath.append(title + ".ts");
+                        success = pipelineMode == PipelineMode::Stream
+                            ? m3u8_downloader.StreamToVideo(outputFile, updateProgress, m3u8Downloader::VideoFormat::MP4)
+                            : m3u8_downloader.DownloadToFile(outputFile, updateProgress, m3u8Downloader::VideoFormat::MP4);
+                        if (success) break;
+                        std::cerr << "[Stream] 当前线路失效，选择其他线路" << std::endl;
+                        updateProgress(0);
+                        line.reset();
+                        continue;
+                    }
 
-                    // 下载所有ts分片
-                    success = m3u8_downloader.DownloadAllSegments( dirPath.c_str(), updateProgress);
+                    // 下载所有ts分片，失败时先在当前线路上续传
+                    success = false;
+                    for (int attempt = 0; attempt < kDownloadAttempts && !success; ++attempt) {
+                        success = m3u8_downloader.DownloadAllSegments( dirPath.c_str(), updateProgress);
+                    }
                     if (!success) {
                         //这里可以做重新下载的操作
                         std::cerr << "[DownloadSegment] 当前线路失效，选择其他线路" << std::endl;
                         updateProgress(0);
+                        line.reset();
                         continue;
                     }
 
                     // 重复视频跳过解密
-                    if (m3u8_downloader.isRepeat.load()) continue;
+                    if (m3u8_downloader.isRepeat.load()) break;
                     // 将下载好的所有ts分片进行解密
                     success = m3u8_downloader.DecryptAllTs(updateProgress);
                     if(!success) {
                         std::cerr << "Decrypt TS failed" << std::endl;
+                        line.reset();
                         continue;
                     }
 
                     // 将所有分片和并为完整视频，如需转换格式，则需要使用ffmpeg
                     // 默认格式是将合并后的TS转换为MP4，如有需要可传参
                     success = m3u8_downloader.MergeToVideo(dirPath.append(title + ".ts"), updateProgress, m3u8Downloader::VideoFormat::MP4);
-                    m3u8_downloader.DeleteTemplateFile();
-
-                    if (success) break;
+                    // 失败时保留分片和任务日志，下次可以从断点继续
+                    if (success) {
+                        m3u8_downloader.DeleteTemplateFile();
+                        break;
+                    }
                     updateProgress(0); // 下载失败进度归零
+                    // 失效的线路在切换前销毁，释放它在指纹索引中登记的记录，不会在之后删掉备用线路下载完成的记录
+                    line.reset();
                 }
 
                 // 下载完成后，更新总进度